@@ -0,0 +1,180 @@
+# A Biologically-Inspired Appearance Model for Snake Skin: script to measure the effect of Russian roulette in the multilayered BSDF.
+# Example command: python ./scripts/rr_benchmark.py -spp 64 -ref_spp 4096 -rr_depth 4 8
+#
+# The default scene, ./scripts/rr_benchmark.xml, is a sphere with a thin-film coating over a thick scattering layer. Other
+# scenes must forward the roulette parameters to their multilayered BSDF, e.g.
+#   <integer name="rrDepth" value="$rrDepth"/>
+#   <float name="rrMaxSurvival" value="$rrMaxSurvival"/>
+# Every configuration is rendered with the same spp and compared to a high spp reference (rendered without roulette).
+# The efficiency is 1 / (time * MSE): higher is better, and its ratio to the baseline is the speed-up at equal error.
+#
+# No render-mode numbers are recorded here yet: fill in the table printed by the default scene once Mitsuba is available.
+#
+# With -synthetic, no renderer is needed: the roulette is applied to a model of the walk inside one layer (isotropic slab of
+# optical thickness -tau and albedo -albedo over a Lambertian base of albedo -base, normal incidence, index-matched top) and
+# the diffuse reflectance estimate is compared without and with roulette. The roulette is the one of the BSDF: from vertex
+# rrDepth on, survive with q = min(throughput, rrMaxSurvival) and divide the throughput by q.
+# MODEL RESULTS, NOT A MEASUREMENT OF THE BSDF: the table below comes from the stand-in slab model, with the cost counted as
+# walk vertices instead of render time. It shows the trend to expect, the render mode gives the actual time x MSE speed-up.
+# Obtained with: python ./scripts/rr_benchmark.py -synthetic -walks 100000 -rr_depth 2 4 8 (seed 1, Python 3.11).
+#
+#  tau 32, albedo 0.999 (default)                                   tau 8, albedo 0.9 (-tau 8 -albedo 0.9)
+#  rrDepth   vertices/walk     estimate     variance   speed-up      rrDepth   vertices/walk     estimate     variance   speed-up
+#      off          163.24   9.0746e-01   5.3166e-02       1.00          off           40.04   4.1543e-01   1.2286e-01       1.00
+#        2           63.11   9.0853e-01   8.2953e-02       1.66            2            5.80   4.1807e-01   2.2931e-01       3.70
+#        4           63.91   9.0772e-01   8.3215e-02       1.63            4            6.17   4.1701e-01   2.0048e-01       3.97
+#        8           63.57   9.0896e-01   8.1377e-02       1.68            8            7.17   4.1474e-01   1.6224e-01       4.23
+#
+# With -rr_max_survival 0.95 the deep walks lose 5% per vertex even at full throughput and grow 1/0.95 per vertex when they
+# survive: in the model, at rrDepth 2 the variance rises to 1.78e+01 (speed-up 0.05), hence the default survival cap of 1.
+
+import os
+import sys
+import time
+import math
+import random
+import argparse
+
+class SnakeSkinUtils:
+    def __init__(self, args):
+        # Render configuration
+        self.scene_file = args.scene_file
+        self.width = args.width
+        self.height = args.height
+        self.n_threads = args.threads
+
+        # General configuration
+        self.verbose = args.verbose
+        self.output_folder = args.output_folder
+
+    def createRender(self, output_file, spp, rr_depth, rr_max_survival):
+        # Render scene
+        command = "mitsuba {0} -o {1} -p {2} -q -Dspp={3} -Dwidth={4} -Dheigth={5} -DrrDepth={6} -DrrMaxSurvival={7}".format(self.scene_file, \
+                  output_file, self.n_threads, spp, self.width, self.height, rr_depth, rr_max_survival)
+
+        # Execute command
+        if self.verbose:
+            print("Executing command: {0}".format(command))
+
+        start = time.time()
+        if os.system(command) != 0:
+            sys.exit("Render failed: {0}".format(command))
+
+        return time.time() - start
+
+def readImage(file_name):
+    os.environ["OPENCV_IO_ENABLE_OPENEXR"] = "1"
+    import cv2
+    import numpy as np
+
+    image = cv2.imread(file_name, cv2.IMREAD_UNCHANGED)
+    if image is None:
+        sys.exit("Could not read {0}".format(file_name))
+    return image[:, :, :3].astype(np.float64)
+
+def slabWalk(rng, tau, albedo, base, rr_depth, rr_max_survival):
+    # Returns the reflectance estimate of one walk and its number of vertices
+    z, mu, throughput, vertices = 0.0, 1.0, 1.0, 0
+    while True:
+        z += -math.log(1.0 - rng.random()) * mu
+        if z <= 0.0:
+            return throughput, vertices
+        if z >= tau:
+            z, mu = tau, -math.sqrt(rng.random())
+            throughput *= base
+        else:
+            mu = 2.0 * rng.random() - 1.0
+            throughput *= albedo
+        vertices += 1
+        if throughput == 0.0:
+            return 0.0, vertices
+        if rr_depth >= 0 and vertices >= rr_depth:
+            q = min(throughput, rr_max_survival)
+            if rng.random() >= q:
+                return 0.0, vertices
+            throughput /= q
+
+def syntheticBenchmark(args):
+    print("{0:>8} {1:>10} {2:>15} {3:>12} {4:>12} {5:>11} {6:>9}".format("rrDepth", "time [s]", "vertices/walk", "estimate", "variance", "1/(v*var)", "speed-up"))
+    baseline_efficiency = None
+    for rr_depth in [-1] + args.rr_depth:
+        rng = random.Random(args.seed)
+        start = time.time()
+        total, total_sqr, vertices = 0.0, 0.0, 0
+        for _ in range(args.walks):
+            value, n = slabWalk(rng, args.tau, args.albedo, args.base, rr_depth, args.rr_max_survival)
+            total += value
+            total_sqr += value * value
+            vertices += n
+        elapsed = time.time() - start
+
+        mean = total / args.walks
+        variance = total_sqr / args.walks - mean * mean
+        cost = vertices / float(args.walks)
+        efficiency = 1.0 / (cost * variance) if variance > 0 else float("inf")
+        if baseline_efficiency is None:
+            baseline_efficiency = efficiency
+        print("{0:>8} {1:>10.2f} {2:>15.2f} {3:>12.4e} {4:>12.4e} {5:>11.4e} {6:>9.2f}".format("off" if rr_depth < 0 else rr_depth, \
+              elapsed, cost, mean, variance, efficiency, efficiency / baseline_efficiency))
+
+# Argument parameters of the program
+parser = argparse.ArgumentParser(description="This script will measure the render efficiency of the multilayered BSDF with and without Russian roulette")
+parser.add_argument("--scene_file", "-scene", type=str, default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "rr_benchmark.xml"), \
+                    help="scene file exposing the $rrDepth and $rrMaxSurvival parameters")
+parser.add_argument("--output_folder", "-of", type=str, default="./scenes/rr_benchmark/renders", help="output folder of the renders")
+parser.add_argument("-spp", "--spp", type=int, default=64, help="set the number of samples per pixel of the measured renders")
+parser.add_argument("-ref_spp", "--ref_spp", type=int, default=4096, help="set the number of samples per pixel of the reference")
+parser.add_argument("-rr_depth", "--rr_depth", type=int, nargs="+", default=[2, 4, 8], help="roulette start depths to measure")
+parser.add_argument("-rr_max_survival", "--rr_max_survival", type=float, default=1.0, help="maximum survival probability of the roulette")
+parser.add_argument("-repeat", "--repeat", type=int, default=1, help="number of timed renders per configuration (the fastest one is kept)")
+parser.add_argument("-p", "--threads", type=int, default=20, help="set the number of threads to be used")
+parser.add_argument("-width", "--width", type=int, default=256, help="width of the image")
+parser.add_argument("-height", "--height", type=int, default=256, help="height of the image")
+parser.add_argument('-v', "--verbose", action='store_false', help="enable verbose mode")
+parser.add_argument("-synthetic", "--synthetic", action='store_true', help="measure the roulette on a slab walk model instead of rendering")
+parser.add_argument("-walks", "--walks", type=int, default=20000, help="number of walks per configuration (synthetic)")
+parser.add_argument("-tau", "--tau", type=float, default=32.0, help="optical thickness of the slab (synthetic)")
+parser.add_argument("-albedo", "--albedo", type=float, default=0.999, help="single-scattering albedo of the slab (synthetic)")
+parser.add_argument("-base", "--base", type=float, default=0.5, help="albedo of the Lambertian base (synthetic)")
+parser.add_argument("-seed", "--seed", type=int, default=1, help="random seed (synthetic)")
+
+args = parser.parse_args()
+
+if args.synthetic:
+    syntheticBenchmark(args)
+    sys.exit(0)
+
+import numpy as np
+
+snake_skin_utils = SnakeSkinUtils(args = args)
+
+output_folder = args.output_folder
+
+# Create renders folder
+if not os.path.exists(output_folder):
+    os.makedirs(output_folder)
+
+# Reference without roulette
+reference_file = os.path.join(output_folder, "reference.exr")
+if not os.path.exists(reference_file):
+    snake_skin_utils.createRender(reference_file, args.ref_spp, -1, args.rr_max_survival)
+reference = readImage(reference_file)
+
+# Baseline (-1: roulette disabled) followed by the requested start depths
+results = []
+for rr_depth in [-1] + args.rr_depth:
+    output_file = os.path.join(output_folder, "rr_{0}.exr".format(rr_depth))
+
+    render_time = min(snake_skin_utils.createRender(output_file, args.spp, rr_depth, args.rr_max_survival) for _ in range(args.repeat))
+    mse = np.mean((readImage(output_file) - reference) ** 2)
+    efficiency = 1.0 / (render_time * mse) if mse > 0 else float("inf")
+
+    results.append((rr_depth, render_time, mse, efficiency))
+
+n_pixels = args.width * args.height
+baseline_efficiency = results[0][3]
+
+print("{0:>8} {1:>10} {2:>14} {3:>12} {4:>12} {5:>9}".format("rrDepth", "time [s]", "us/pixel", "MSE", "1/(t*MSE)", "speed-up"))
+for rr_depth, render_time, mse, efficiency in results:
+    print("{0:>8} {1:>10.2f} {2:>14.3f} {3:>12.4e} {4:>12.4e} {5:>9.2f}".format("off" if rr_depth < 0 else rr_depth, render_time, \
+          1e6 * render_time / n_pixels, mse, efficiency, efficiency / baseline_efficiency))
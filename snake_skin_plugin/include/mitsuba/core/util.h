@@ -513,6 +513,355 @@ extern MTS_EXPORT_CORE Float ThinFilmTransmissionExt(Float cos0, Float &cosTheta
 extern MTS_EXPORT_CORE Float ThinFilmReflectanceExt(Float cos0, Float &cosThetaT_, Float lambda, Float thickness,
                                                         Float n0, Float n1, Float n2);
 
+/**
+ * \brief Tabulated RGB thin-film reflectance and transmittance
+ *
+ * Tabulates the RGB film transmittance on a regular grid over the cosine
+ * of the incident angle and the film thickness, for one fixed ordering of
+ * the indices of refraction. Lookups interpolate bilinearly. The RGB values
+ * follow one of the models in \ref EModel.
+ *
+ * When total internal reflection can occur inside the film stack, the
+ * table is parameterized by the cosine inside the medium with the lowest
+ * index (instead of \c cos0), which resolves the square-root behavior
+ * near the critical angle.
+ *
+ * At construction time, the grid is refined until the interpolation error
+ * measured at the cell midpoints against the exact expression drops below
+ * \c maxError, or until the table holds \c maxEntries grid points. The
+ * achieved error is available via \ref getError().
+ *
+ * Like the exact functions, the reflectance is given by <tt>1 - T</tt>.
+ * \ingroup libpython
+ */
+class MTS_EXPORT_CORE ThinFilmTable {
+public:
+    /// Number of tabulated wavelengths
+    static const int Channels = 3;
+
+    /// Wavelengths (in nanometers) of the red, green and blue channels
+    static const Float Wavelengths[Channels];
+
+    /// Conversion of the film spectrum to RGB
+    enum EModel {
+        /// Evaluate \ref ThinFilmTransmission() at \ref Wavelengths
+        EPointSampled = 0,
+
+        /**
+         * Integrate the transmission spectrum against the CIE 1931 color
+         * matching functions (360-830nm) and convert it to linear RGB. The
+         * result is normalized so that a spectrally flat transmittance of
+         * one maps to white, which keeps <tt>R + T = 1</tt> per channel.
+         */
+        ESpectral,
+
+        /// Antialiased Airy summation, see \ref ThinFilmReflectanceFourier()
+        EFourier
+    };
+
+    /// Create an empty table
+    ThinFilmTable();
+
+    /**
+     * \brief Tabulate the film between the media \c n0 and \c n2
+     *
+     * \param n0
+     *      Index of refraction on the incident side
+     * \param n1
+     *      Index of refraction of the film
+     * \param n2
+     *      Index of refraction on the transmitted side
+     * \param thicknessMin
+     *      Smallest tabulated film thickness (in nanometers)
+     * \param thicknessMax
+     *      Largest tabulated film thickness. When equal to \c thicknessMin,
+     *      the table only depends on the incident angle.
+     * \param model
+     *      Conversion of the film spectrum to RGB
+     * \param maxError
+     *      Target for the absolute interpolation error
+     * \param maxEntries
+     *      Upper bound on the number of grid points
+     * \param thicknessVariation
+     *      When positive, every entry averages the response over film
+     *      thicknesses uniformly distributed in <tt>[d - thicknessVariation,
+     *      d + thicknessVariation]</tt> (clamped at zero) around the
+     *      tabulated thickness \c d.
+     */
+    ThinFilmTable(Float n0, Float n1, Float n2,
+        Float thicknessMin, Float thicknessMax, EModel model = EPointSampled,
+        Float maxError = 1e-3f, size_t maxEntries = 1 << 20,
+        Float thicknessVariation = 0);
+
+    /**
+     * \brief Tabulate a stack of films between the media \c n0 and \c n2
+     *
+     * The stack is evaluated with \ref ThinFilmStackTransmission(), and the
+     * table only depends on the incident angle. \ref EFourier is not
+     * available for stacks.
+     *
+     * \param n
+     *      Indices of refraction of the films, starting on the \c n0 side;
+     *      the stack must not be empty
+     * \param thickness
+     *      Thicknesses of the films (in nanometers)
+     */
+    ThinFilmTable(Float n0, const std::vector<Float> &n,
+        const std::vector<Float> &thickness, Float n2, EModel model = EPointSampled,
+        Float maxError = 1e-3f, size_t maxEntries = 1 << 20);
+
+    /**
+     * \brief Tabulate a film on top of a conductor
+     *
+     * The film is evaluated with \ref ThinFilmReflectanceConductor(). The
+     * complex index of refraction of the conductor is given on an arbitrary
+     * wavelength grid and interpolated linearly (and clamped beyond its
+     * ends). \ref EFourier is not available for conductors. The tabulated
+     * "transmittance" is the absorbed fraction <tt>1 - R</tt>.
+     *
+     * \param baseLambda
+     *      Increasing wavelengths (in nanometers) of the conductor data
+     * \param baseEta
+     *      Real part of the conductor's index of refraction at \c baseLambda
+     * \param baseK
+     *      Imaginary part (absorption coefficient) at \c baseLambda
+     */
+    ThinFilmTable(Float n0, Float n1, const std::vector<Float> &baseLambda,
+        const std::vector<Float> &baseEta, const std::vector<Float> &baseK,
+        Float thicknessMin, Float thicknessMax, EModel model = EPointSampled,
+        Float maxError = 1e-3f, size_t maxEntries = 1 << 20);
+
+    /// Unserialize a table, e.g. from an on-disk cache
+    ThinFilmTable(Stream *stream);
+
+    /// Serialize the tabulated data (the construction parameters are not stored)
+    void serialize(Stream *stream) const;
+
+    /**
+     * \brief Interpolate the transmittance of every channel
+     *
+     * \c cos0 is clamped to [0, 1] and \c thickness to the tabulated range.
+     */
+    void evalTransmittance(Float cos0, Float thickness, Float *T) const;
+
+    /// Interpolate the reflectance and transmittance of every channel
+    inline void eval(Float cos0, Float thickness, Float *R, Float *T) const {
+        evalTransmittance(cos0, thickness, T);
+        for (int i=0; i<Channels; ++i)
+            R[i] = 1 - T[i];
+    }
+
+    /**
+     * \brief Cosine of the transmitted angle on the \c n2 side
+     *
+     * Follows from Snell's law between \c n0 and \c n2 (the film does not
+     * change the outgoing direction). Returns zero under total internal
+     * reflection.
+     */
+    inline Float cosThetaT(Float cos0) const {
+        Float sinThetaT2 = m_eta2 * (1 - cos0 * cos0);
+        return sinThetaT2 >= 1 ? 0.0f : std::sqrt(1 - sinThetaT2);
+    }
+
+    /// Return the conversion of the film spectrum to RGB
+    inline EModel getModel() const { return m_model; }
+
+    /// Was this table created with actual film parameters?
+    inline bool isValid() const { return !m_data.empty(); }
+
+    /// Return the interpolation error measured at construction time
+    inline Float getError() const { return m_error; }
+
+    /// Return the number of samples along the cosine axis
+    inline size_t getCosResolution() const { return m_cosRes; }
+
+    /// Return the number of samples along the thickness axis
+    inline size_t getThicknessResolution() const { return m_thicknessRes; }
+
+    /// Return the number of film thicknesses averaged into every entry
+    inline size_t getAveragedThicknesses() const { return m_averageNodes; }
+
+private:
+    /// Map an incident cosine to the table axis (negative: no transmission)
+    inline Float toAxis(Float cos0) const {
+        if (!m_critical)
+            return cos0;
+        Float cos2 = 1 - m_etaCritical2 * (1 - cos0 * cos0);
+        return cos2 > 0 ? std::sqrt(cos2) : -1.0f;
+    }
+
+    /// Map a position on the table axis back to the incident cosine
+    inline Float fromAxis(Float x) const {
+        if (!m_critical)
+            return x;
+        return std::sqrt(std::max((Float) 0, 1 - (1 - x * x) / m_etaCritical2));
+    }
+
+    void init(Float etaCritical, Float opticalThickness,
+        Float maxError, size_t maxEntries);
+    Float cosAt(size_t i) const;
+    Float thicknessAt(size_t j) const;
+    void evalRow(const Float *cos0, size_t nCos, Float thickness, Float *T) const;
+    void evalFilm(const Float *cos0, size_t nCos, Float thickness, Float *T) const;
+    void build();
+    Float measureError(Float &cosError, Float &thicknessError) const;
+
+private:
+    std::vector<float> m_data;
+    std::vector<Float> m_lambda, m_rgbWeights;
+    std::vector<Float> m_stackIOR, m_stackThickness;
+    std::vector<Float> m_baseLambda, m_baseEta, m_baseK;
+    EModel m_model;
+    Float m_n0, m_n1, m_n2, m_eta2, m_etaCritical2;
+    bool m_critical;
+    Float m_thicknessMin, m_thicknessMax, m_invThicknessStep;
+    Float m_thicknessVariation;
+    size_t m_cosRes, m_thicknessRes, m_averageNodes;
+    Float m_error;
+};
+
+/**
+ * \brief Batched thin-film transmission for packets of incident cosines
+ * and several wavelengths
+ *
+ * Computes the same quantity as \ref ThinFilmTransmission(), but evaluates
+ * the refraction geometry and the Fresnel amplitudes once per cosine and
+ * shares them across all wavelengths, which only differ in the phase term.
+ * The wavelength loop runs over the whole packet at once so that the
+ * compiler can vectorize it.
+ *
+ * \param cos0
+ *      Packet of \c nCos incident cosines (in [0, 1])
+ * \param lambda
+ *      \c nLambda wavelengths (in nanometers)
+ * \param T
+ *      Output array of <tt>nCos * nLambda</tt> transmission values; the
+ *      wavelengths of one cosine are stored contiguously
+ * \param cosThetaT
+ *      Optional output array of \c nCos (non-negative) cosines of the
+ *      transmitted angles, zero under total internal reflection
+ * \ingroup libpython
+ */
+extern MTS_EXPORT_CORE void ThinFilmTransmission(const Float *cos0, size_t nCos,
+        const Float *lambda, size_t nLambda, Float thickness, Float n0, Float n1, Float n2,
+        Float *T, Float *cosThetaT = NULL);
+
+/**
+ * \brief Transmission of a stack of thin films
+ *
+ * Uses the characteristic matrix method of Abel\`es: every film contributes
+ * a 2x2 matrix per polarization, and the reflection and transmission
+ * amplitudes of the stack follow from their product. Evanescent waves in
+ * films under total internal reflection are handled, so thin low-index
+ * films can be tunneled through. The films are non-absorbing, hence the
+ * reflectance is <tt>1 - T</tt>.
+ *
+ * \param cos0
+ *      Packet of \c nCos incident cosines (in [0, 1])
+ * \param lambda
+ *      \c nLambda wavelengths (in nanometers)
+ * \param n0
+ *      Index of refraction on the incident side
+ * \param n
+ *      Indices of refraction of the \c nLayers films, starting on the
+ *      \c n0 side
+ * \param thickness
+ *      Thicknesses of the films (in nanometers)
+ * \param n2
+ *      Index of refraction on the transmitted side
+ * \param T
+ *      Output array of <tt>nCos * nLambda</tt> transmission values
+ * \param cosThetaT
+ *      Optional output array of \c nCos (non-negative) cosines of the
+ *      transmitted angles, zero under total internal reflection
+ * \ingroup libpython
+ */
+extern MTS_EXPORT_CORE void ThinFilmStackTransmission(const Float *cos0, size_t nCos,
+        const Float *lambda, size_t nLambda, Float n0, const Float *n,
+        const Float *thickness, size_t nLayers, Float n2, Float *T,
+        Float *cosThetaT = NULL);
+
+/**
+ * \brief Reflectance of a thin film on top of a conductor
+ *
+ * Sums the interreflections inside the film (Airy) with the complex
+ * Fresnel coefficients of the film/conductor interface, per polarization.
+ * With a vanishing thickness, this reduces to the Fresnel reflectance of
+ * the conductor under the medium \c n1.
+ *
+ * \param cos0
+ *      Packet of \c nCos incident cosines (in [0, 1])
+ * \param lambda
+ *      \c nLambda wavelengths (in nanometers)
+ * \param thickness
+ *      Film thickness (in nanometers)
+ * \param n0
+ *      Index of refraction on the incident side
+ * \param n1
+ *      Index of refraction of the film
+ * \param eta2
+ *      Real part of the conductor's index of refraction at every wavelength
+ * \param k2
+ *      Absorption coefficient of the conductor at every wavelength
+ * \param R
+ *      Output array of <tt>nCos * nLambda</tt> reflectance values
+ * \ingroup libpython
+ */
+extern MTS_EXPORT_CORE void ThinFilmReflectanceConductor(const Float *cos0, size_t nCos,
+        const Float *lambda, size_t nLambda, Float thickness, Float n0, Float n1,
+        const Float *eta2, const Float *k2, Float *R);
+
+/**
+ * \brief Batched thin-film transmission at the RGB wavelengths
+ *
+ * Shorthand for \ref ThinFilmTransmission() with the wavelengths in
+ * \ref ThinFilmTable::Wavelengths. \c T receives <tt>3 * nCos</tt> values.
+ */
+inline void ThinFilmTransmissionRGB(const Float *cos0, size_t nCos, Float thickness,
+        Float n0, Float n1, Float n2, Float *T, Float *cosThetaT = NULL) {
+    ThinFilmTransmission(cos0, nCos, ThinFilmTable::Wavelengths, ThinFilmTable::Channels,
+        thickness, n0, n1, n2, T, cosThetaT);
+}
+
+/**
+ * \brief Batched thin-film reflection at the RGB wavelengths
+ *
+ * Like the scalar version, the reflectance is given by <tt>1 - T</tt>.
+ */
+inline void ThinFilmReflectanceRGB(const Float *cos0, size_t nCos, Float thickness,
+        Float n0, Float n1, Float n2, Float *R, Float *cosThetaT = NULL) {
+    ThinFilmTransmissionRGB(cos0, nCos, thickness, n0, n1, n2, R, cosThetaT);
+    for (size_t i=0; i<nCos * ThinFilmTable::Channels; ++i)
+        R[i] = 1 - R[i];
+}
+
+/**
+ * \brief Spectrally integrated RGB thin-film reflectance in Fourier space
+ *
+ * Implements the model of "A Practical Extension to Microfacet Theory for
+ * the Modeling of Varying Iridescence" by Belcour and Barla (SIGGRAPH 2017).
+ * The Airy summation of the film is expanded into a series of cosines in
+ * the optical path difference, and every term is integrated analytically
+ * against Gaussian fits of the CIE 1931 matching functions. The result is
+ * free of the aliasing of point-sampled wavelengths for thick films, at a
+ * cost independent of the film thickness.
+ *
+ * Like \ref ThinFilmTable::ESpectral, the RGB values are normalized so that
+ * a flat spectrum of one maps to white, and the transmittance is
+ * <tt>1 - R</tt> per channel.
+ *
+ * \param cos0
+ *      Packet of \c nCos incident cosines (in [0, 1])
+ * \param R
+ *      Output array of <tt>3 * nCos</tt> RGB reflectance values
+ * \param cosThetaT
+ *      Optional output array of \c nCos (non-negative) cosines of the
+ *      transmitted angles, zero under total internal reflection
+ * \ingroup libpython
+ */
+extern MTS_EXPORT_CORE void ThinFilmReflectanceFourier(const Float *cos0, size_t nCos,
+        Float thickness, Float n0, Float n1, Float n2, Float *R, Float *cosThetaT = NULL);
+
 //! @}
 // -----------------------------------------------------------------------
 
@@ -21,6 +21,7 @@
 #include <mitsuba/hw/basicshader.h>
 #include <boost/algorithm/string.hpp>
 #include "ior.h"
+#include "thinfilm.h"
 
 MTS_NAMESPACE_BEGIN
 
@@ -39,6 +40,12 @@ MTS_NAMESPACE_BEGIN
  *     \parameter{specular\showbreak Reflectance}{\Spectrum\Or\Texture}{Optional
  *         factor that can be used to modulate the specular reflection component. Note
  *         that for physical realism, this parameter should never be touched. \default{1.0}}
+ *     \parameter{filmBase}{\String}{Material under the film: \code{dielectric}
+ *         (the index \code{intIOR}) or \code{conductor} (the complex index given
+ *         by \code{material} or \code{eta}, \code{k}). \default{\code{dielectric}}}
+ *     \parameter{filmCache}{\String}{Optional directory in which the film tables
+ *         are cached across runs, keyed by the material and film parameters.
+ *         \default{none}}
  * }
  * \renderings{
  *     \rendering{Measured copper material (the default), rendered using 30
@@ -162,11 +169,23 @@ public:
         if (boost::to_lower_copy(materialName) == "none") {
             intEta = Spectrum(0.0f);
             intK = Spectrum(1.0f);
+            m_baseLambda.assign(1, 550.0f);
+            m_baseEta.assign(1, 0.0f);
+            m_baseK.assign(1, 1.0f);
         } else {
-            intEta.fromContinuousSpectrum(InterpolatedSpectrum(
-                fResolver->resolve("data/ior/" + materialName + ".eta.spd")));
-            intK.fromContinuousSpectrum(InterpolatedSpectrum(
-                fResolver->resolve("data/ior/" + materialName + ".k.spd")));
+            InterpolatedSpectrum etaSpec(
+                fResolver->resolve("data/ior/" + materialName + ".eta.spd"));
+            InterpolatedSpectrum kSpec(
+                fResolver->resolve("data/ior/" + materialName + ".k.spd"));
+            intEta.fromContinuousSpectrum(etaSpec);
+            intK.fromContinuousSpectrum(kSpec);
+
+            /* Keep the measured data for the spectral film model */
+            for (Float lambda = 360; lambda <= 830; lambda += 5) {
+                m_baseLambda.push_back(lambda);
+                m_baseEta.push_back(etaSpec.eval(lambda));
+                m_baseK.push_back(kSpec.eval(lambda));
+            }
         }
 
         /*extIOR = lookupIOR(props, "extIOR", "air");
@@ -181,7 +200,49 @@ public:
         
 
 
-        m_thickness = props.getFloat("thickness", 400);
+        /* Film thickness in nanometers, either constant or a texture */
+        m_thickness = new ConstantFloatTexture(props.getFloat("thickness", 400));
+
+        /* Tabulate the film reflectance at configure() time instead of
+           evaluating the interference terms for every query */
+        m_filmTable = props.getBoolean("filmTable", true);
+        m_filmTableError = props.getFloat("filmTableError", 1e-3f);
+        m_filmModel = lookupFilmModel(props);
+
+        if (m_filmModel == ThinFilmTable::ESpectral && !m_filmTable) {
+            Log(EWarn, "The spectral film model is only available through "
+                "the lookup table, ignoring filmTable=false");
+            m_filmTable = true;
+        }
+
+        std::string filmBase = boost::to_lower_copy(props.getString("filmBase", "dielectric"));
+        if (filmBase == "conductor")
+            m_conductorBase = true;
+        else if (filmBase == "dielectric")
+            m_conductorBase = false;
+        else
+            Log(EError, "Specified an invalid film base \"%s\", must be "
+                "\"dielectric\" or \"conductor\"!", filmBase.c_str());
+
+        if (m_conductorBase && m_filmModel == ThinFilmTable::EFourier)
+            Log(EError, "The fourier film model is not available on a conductor, "
+                "use \"rgb\" or \"spectral\"!");
+
+        m_filmCache = props.getString("filmCache", "");
+        if (!m_filmCache.empty())
+            m_filmCache = fResolver->resolveAbsolute(m_filmCache).string();
+
+        if (props.hasProperty("eta") || props.hasProperty("k")) {
+            /* Only the RGB values are known: place them at the channel wavelengths */
+            Spectrum eta = props.getSpectrum("eta", intEta),
+                     k = props.getSpectrum("k", intK);
+            m_baseLambda.clear(); m_baseEta.clear(); m_baseK.clear();
+            for (int ch=ThinFilmTable::Channels-1; ch>=0; --ch) {
+                m_baseLambda.push_back(ThinFilmTable::Wavelengths[ch]);
+                m_baseEta.push_back(eta[ch]);
+                m_baseK.push_back(k[ch]);
+            }
+        }
 
         m_eta0 = props.getSpectrum("eta", intEta) / extIOR;
         m_k   = props.getSpectrum("k", intK) / extIOR;
@@ -192,6 +253,24 @@ public:
         m_specularReflectance = static_cast<Texture *>(manager->getInstance(stream));
         m_eta0 = Spectrum(stream);
         m_k = Spectrum(stream);
+        m_thickness = static_cast<Texture *>(manager->getInstance(stream));
+        extIOR = stream->readFloat();
+        mediumIOR = stream->readFloat();
+        intIOR = stream->readFloat();
+        m_filmTable = stream->readBool();
+        m_filmModel = (ThinFilmTable::EModel) stream->readInt();
+        m_filmTableError = stream->readFloat();
+        m_filmCache = stream->readString();
+        m_conductorBase = stream->readBool();
+        size_t baseSamples = stream->readSize();
+        m_baseLambda.resize(baseSamples);
+        m_baseEta.resize(baseSamples);
+        m_baseK.resize(baseSamples);
+        if (baseSamples > 0) {
+            stream->readFloatArray(&m_baseLambda[0], baseSamples);
+            stream->readFloatArray(&m_baseEta[0], baseSamples);
+            stream->readFloatArray(&m_baseK[0], baseSamples);
+        }
 
         configure();
     }
@@ -201,12 +280,63 @@ public:
         m_specularReflectance = ensureEnergyConservation(
             m_specularReflectance, "specularReflectance", 1.0f);
 
+        /* A constant thickness gives a table over the incident angle only.
+           Otherwise, the table spans the range of the thickness texture */
+        m_thicknessMin = m_thickness->getMinimum().min();
+        m_thicknessMax = m_thickness->getMaximum().max();
+        if (m_thicknessMin < 0)
+            Log(EError, "The film thickness must be nonnegative!");
+
         m_usesRayDifferentials =
-            m_specularReflectance->usesRayDifferentials();
+            m_specularReflectance->usesRayDifferentials() ||
+            m_thickness->usesRayDifferentials();
 
         m_components.clear();
         m_components.push_back(EDeltaReflection | EFrontSide
-            | (m_specularReflectance->isConstant() ? 0 : ESpatiallyVarying));
+            | (m_specularReflectance->isConstant()
+               && m_thicknessMax == m_thicknessMin ? 0 : ESpatiallyVarying));
+
+        if (m_conductorBase) {
+            /* Conductor data at the RGB wavelengths for the exact evaluation */
+            for (int ch=0; ch<ThinFilmTable::Channels; ++ch) {
+                Float lambda = ThinFilmTable::Wavelengths[ch];
+                size_t idx = std::lower_bound(m_baseLambda.begin(), m_baseLambda.end(),
+                    lambda) - m_baseLambda.begin();
+                if (idx == 0 || idx == m_baseLambda.size()) {
+                    idx = std::min(idx, m_baseLambda.size() - 1);
+                    m_channelEta[ch] = m_baseEta[idx];
+                    m_channelK[ch] = m_baseK[idx];
+                } else {
+                    Float t = (lambda - m_baseLambda[idx-1])
+                        / (m_baseLambda[idx] - m_baseLambda[idx-1]);
+                    m_channelEta[ch] = (1 - t) * m_baseEta[idx-1] + t * m_baseEta[idx];
+                    m_channelK[ch] = (1 - t) * m_baseK[idx-1] + t * m_baseK[idx];
+                }
+            }
+        }
+
+        if (m_filmTable) {
+            std::ostringstream key;
+            key.precision(9);
+            key << "conductorThinFilm model=" << m_filmModel << " error=" << m_filmTableError
+                << " extIOR=" << extIOR << " mediumIOR=" << mediumIOR
+                << " thickness=[" << m_thicknessMin << ", " << m_thicknessMax << "]";
+            if (m_conductorBase) {
+                key << " conductor=";
+                for (size_t i=0; i<m_baseLambda.size(); ++i)
+                    key << m_baseLambda[i] << ":" << m_baseEta[i] << "+" << m_baseK[i] << "i ";
+            } else {
+                key << " intIOR=" << intIOR;
+            }
+
+            m_filmTableExt = cachedFilmTable(m_filmCache, key.str(), [&]() {
+                if (m_conductorBase)
+                    return ThinFilmTable(extIOR, mediumIOR, m_baseLambda, m_baseEta,
+                        m_baseK, m_thicknessMin, m_thicknessMax, m_filmModel, m_filmTableError);
+                return ThinFilmTable(extIOR, mediumIOR, intIOR,
+                    m_thicknessMin, m_thicknessMax, m_filmModel, m_filmTableError);
+            });
+        }
 
         BSDF::configure();
     }
@@ -216,12 +346,29 @@ public:
         manager->serialize(stream, m_specularReflectance.get());
         m_eta0.serialize(stream);
         m_k.serialize(stream);
+        manager->serialize(stream, m_thickness.get());
+        stream->writeFloat(extIOR);
+        stream->writeFloat(mediumIOR);
+        stream->writeFloat(intIOR);
+        stream->writeBool(m_filmTable);
+        stream->writeInt(m_filmModel);
+        stream->writeFloat(m_filmTableError);
+        stream->writeString(m_filmCache);
+        stream->writeBool(m_conductorBase);
+        stream->writeSize(m_baseLambda.size());
+        if (!m_baseLambda.empty()) {
+            stream->writeFloatArray(&m_baseLambda[0], m_baseLambda.size());
+            stream->writeFloatArray(&m_baseEta[0], m_baseEta.size());
+            stream->writeFloatArray(&m_baseK[0], m_baseK.size());
+        }
     }
 
     void addChild(const std::string &name, ConfigurableObject *child) {
         if (child->getClass()->derivesFrom(MTS_CLASS(Texture)) && name == "specularReflectance") {
             m_specularReflectance = static_cast<Texture *>(child);
             m_usesRayDifferentials |= m_specularReflectance->usesRayDifferentials();
+        } else if (child->getClass()->derivesFrom(MTS_CLASS(Texture)) && name == "thickness") {
+            m_thickness = static_cast<Texture *>(child);
         } else {
             BSDF::addChild(name, child);
         }
@@ -232,6 +379,34 @@ public:
         return Vector(-wi.x, -wi.y, wi.z);
     }
 
+    /// Film thickness at \c its, skipping the texture lookup when it is constant
+    inline Float getThickness(const Intersection &its) const {
+        if (m_thicknessMax == m_thicknessMin)
+            return m_thicknessMin;
+        return m_thickness->eval(its).average();
+    }
+
+    /// RGB thin-film reflectance for an incident cosine on the exterior side
+    inline Spectrum evalThinFilm(Float cosThetaI, Float thickness) const {
+        Float R[SPECTRUM_SAMPLES], T[SPECTRUM_SAMPLES];
+
+        if (m_filmTable) {
+            m_filmTableExt.eval(cosThetaI, thickness, R, T);
+        } else if (m_conductorBase) {
+            ThinFilmReflectanceConductor(&cosThetaI, 1, ThinFilmTable::Wavelengths,
+                ThinFilmTable::Channels, thickness, extIOR, mediumIOR,
+                m_channelEta, m_channelK, R);
+        } else if (m_filmModel == ThinFilmTable::EFourier) {
+            ThinFilmReflectanceFourier(&cosThetaI, 1, thickness,
+                extIOR, mediumIOR, intIOR, R);
+        } else {
+            ThinFilmReflectanceRGB(&cosThetaI, 1, thickness,
+                extIOR, mediumIOR, intIOR, R);
+        }
+
+        return Spectrum(R);
+    }
+
     Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
         bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
                 && (bRec.component == -1 || bRec.component == 0);
@@ -244,17 +419,7 @@ public:
             std::abs(dot(reflect(bRec.wi), bRec.wo)-1) > DeltaEpsilon)
             return Spectrum(0.0f);
         
-        Float RGB[SPECTRUM_SAMPLES];
-        
-        float r = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float g = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float b = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-
-        RGB[0] = r;
-        RGB[1] = g;
-        RGB[2] = b;
-
-        Spectrum spec(RGB);
+        Spectrum spec = evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its));
 
         return m_specularReflectance->eval(bRec.its) * spec;
     }
@@ -286,19 +451,9 @@ public:
         bRec.wo = reflect(bRec.wi);
         bRec.eta = 1.0f;
 
-        Float RGB[SPECTRUM_SAMPLES];
-        
-        float r = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float g = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float b = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-
-        RGB[0] = r;
-        RGB[1] = g;
-        RGB[2] = b;
-
-        Spectrum spec(RGB);
+        Spectrum spec = evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its));
 
-        Float F = (r+g+b) / Float(3.0f);
+        Float F = spec.average();
 
         return m_specularReflectance->eval(bRec.its) * (spec/F);
     }
@@ -316,19 +471,9 @@ public:
         bRec.eta = 1.0f;
         pdf = 1;
 
-        Float RGB[SPECTRUM_SAMPLES];
-        
-        float r = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float g = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-        float b = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-
-        RGB[0] = r;
-        RGB[1] = g;
-        RGB[2] = b;
-
-        Spectrum spec(RGB);
+        Spectrum spec = evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its));
 
-        Float F = (r+g+b) / Float(3.0f);
+        Float F = spec.average();
 
         return m_specularReflectance->eval(bRec.its) * (spec/F);
     }
@@ -343,6 +488,17 @@ public:
             << "  id = \"" << getID() << "\"," << endl
             << "  eta = " << m_eta0.toString() << "," << endl
             << "  k = " << m_k.toString() << "," << endl
+            << "  extIOR = " << extIOR << "," << endl
+            << "  mediumIOR = " << mediumIOR << "," << endl
+            << "  intIOR = " << intIOR << "," << endl
+            << "  thickness = " << indent(m_thickness->toString()) << "," << endl
+            << "  filmTable = " << m_filmTable << "," << endl
+            << "  filmModel = " << filmModelName(m_filmModel) << "," << endl
+            << "  filmTableError = " << m_filmTableError << "," << endl
+            << "  conductorBase = " << m_conductorBase << "," << endl
+            << "  baseLambda = " << filmListString(m_baseLambda) << "," << endl
+            << "  baseEta = " << filmListString(m_baseEta) << "," << endl
+            << "  baseK = " << filmListString(m_baseK) << "," << endl
             << "  specularReflectance = " << indent(m_specularReflectance->toString()) << endl
             << "]";
         return oss.str();
@@ -359,8 +515,18 @@ private:
     //Thin-film properties
     Spectrum m_eta1, m_eta2;
     Float extIOR, mediumIOR, intIOR;
-    Float m_thickness;
-    
+    ref<Texture> m_thickness;
+    Float m_thicknessMin, m_thicknessMax;
+    ThinFilmTable m_filmTableExt;
+    ThinFilmTable::EModel m_filmModel;
+    Float m_filmTableError;
+    bool m_filmTable;
+    std::string m_filmCache;
+
+    //Conductor under the film
+    bool m_conductorBase;
+    std::vector<Float> m_baseLambda, m_baseEta, m_baseK;
+    Float m_channelEta[ThinFilmTable::Channels], m_channelK[ThinFilmTable::Channels];
 };
 
 /* Smooth conductor shader -- it is really hopeless to visualize
@@ -19,7 +19,7 @@
 #include <mitsuba/render/bsdf.h>
 #include <mitsuba/hw/basicshader.h>
 #include "ior.h"
-#include <random>
+#include "thinfilm.h"
 
 MTS_NAMESPACE_BEGIN
 
@@ -154,9 +154,35 @@ public:
         
 
 
-        m_thickness = props.getFloat("thickness", 400);
+        /* Film thickness in nanometers, either constant or a texture */
+        m_thickness = new ConstantFloatTexture(props.getFloat("thickness", 400));
 
-        m_thickness_variation = props.getFloat("thickness_variation", 100);
+        /* Film thicknesses are distributed uniformly in
+           [thickness - thickness_variation, thickness + thickness_variation]
+           around the (textured) thickness. The response is averaged over this
+           range when the table is built, so eval(), pdf() and sample() agree */
+        m_thickness_variation = props.getFloat("thickness_variation", 0);
+
+        if (m_thickness_variation < 0)
+            Log(EError, "The thickness variation must be nonnegative!");
+
+        /* Tabulate the film reflectance at configure() time instead of
+           evaluating the interference terms for every query */
+        m_filmTable = props.getBoolean("filmTable", true);
+        m_filmTableError = props.getFloat("filmTableError", 1e-3f);
+        m_filmModel = lookupFilmModel(props);
+
+        if (m_filmModel == ThinFilmTable::ESpectral && !m_filmTable) {
+            Log(EWarn, "The spectral film model is only available through "
+                "the lookup table, ignoring filmTable=false");
+            m_filmTable = true;
+        }
+
+        if (m_thickness_variation > 0 && !m_filmTable) {
+            Log(EWarn, "The thickness variation is only available through "
+                "the lookup table, ignoring filmTable=false");
+            m_filmTable = true;
+        }
 
         if (intIOR < 0 || extIOR < 0)
             Log(EError, "The interior and exterior indices of "
@@ -176,6 +202,14 @@ public:
         m_eta = stream->readFloat();
         m_specularReflectance = static_cast<Texture *>(manager->getInstance(stream));
         m_specularTransmittance = static_cast<Texture *>(manager->getInstance(stream));
+        m_thickness = static_cast<Texture *>(manager->getInstance(stream));
+        extIOR = stream->readFloat();
+        mediumIOR = stream->readFloat();
+        intIOR = stream->readFloat();
+        m_thickness_variation = stream->readFloat();
+        m_filmTable = stream->readBool();
+        m_filmModel = (ThinFilmTable::EModel) stream->readInt();
+        m_filmTableError = stream->readFloat();
         m_invEta = 1 / m_eta;
         configure();
     }
@@ -186,6 +220,14 @@ public:
         stream->writeFloat(m_eta);
         manager->serialize(stream, m_specularReflectance.get());
         manager->serialize(stream, m_specularTransmittance.get());
+        manager->serialize(stream, m_thickness.get());
+        stream->writeFloat(extIOR);
+        stream->writeFloat(mediumIOR);
+        stream->writeFloat(intIOR);
+        stream->writeFloat(m_thickness_variation);
+        stream->writeBool(m_filmTable);
+        stream->writeInt(m_filmModel);
+        stream->writeFloat(m_filmTableError);
     }
 
     void configure() {
@@ -195,15 +237,34 @@ public:
         m_specularTransmittance = ensureEnergyConservation(
             m_specularTransmittance, "specularTransmittance", 1.0f);
 
+        /* A constant thickness gives a table over the incident angle only.
+           Otherwise, the table spans the range of the thickness texture */
+        m_thicknessMin = m_thickness->getMinimum().min();
+        m_thicknessMax = m_thickness->getMaximum().max();
+        if (m_thicknessMin < 0)
+            Log(EError, "The film thickness must be nonnegative!");
+
+        unsigned int extraFlags = 0;
+        if (m_thicknessMax > m_thicknessMin)
+            extraFlags |= ESpatiallyVarying;
+
         m_components.clear();
-        m_components.push_back(EDeltaReflection | EFrontSide | EBackSide
+        m_components.push_back(EDeltaReflection | EFrontSide | EBackSide | extraFlags
             | (m_specularReflectance->isConstant() ? 0 : ESpatiallyVarying));
         m_components.push_back(EDeltaTransmission | EFrontSide | EBackSide | ENonSymmetric
-            | (m_specularTransmittance->isConstant() ? 0 : ESpatiallyVarying));
+            | extraFlags | (m_specularTransmittance->isConstant() ? 0 : ESpatiallyVarying));
 
         m_usesRayDifferentials =
             m_specularReflectance->usesRayDifferentials() ||
-            m_specularTransmittance->usesRayDifferentials();
+            m_specularTransmittance->usesRayDifferentials() ||
+            m_thickness->usesRayDifferentials();
+
+        if (m_filmTable) {
+            m_filmTableExt = ThinFilmTable(extIOR, mediumIOR, intIOR, m_thicknessMin,
+                m_thicknessMax, m_filmModel, m_filmTableError, 1 << 20, m_thickness_variation);
+            m_filmTableInt = ThinFilmTable(intIOR, mediumIOR, extIOR, m_thicknessMin,
+                m_thicknessMax, m_filmModel, m_filmTableError, 1 << 20, m_thickness_variation);
+        }
 
         BSDF::configure();
     }
@@ -214,6 +275,8 @@ public:
                 m_specularReflectance = static_cast<Texture *>(child);
             else if (name == "specularTransmittance")
                 m_specularTransmittance = static_cast<Texture *>(child);
+            else if (name == "thickness")
+                m_thickness = static_cast<Texture *>(child);
             else
                 BSDF::addChild(name, child);
         } else {
@@ -237,20 +300,67 @@ public:
         return -wi;
     }
 
+    /// Film thickness at \c its, skipping the texture lookup when it is constant
+    inline Float getThickness(const Intersection &its) const {
+        if (m_thicknessMax == m_thicknessMin)
+            return m_thicknessMin;
+        return m_thickness->eval(its).average();
+    }
+
+    /**
+     * \brief RGB thin-film reflectance and transmittance for an incident
+     * cosine on either side of the interface
+     *
+     * With a thickness variation, the tables hold the response averaged
+     * over the film thicknesses. \c cosThetaT follows the convention of
+     * \ref fresnelDielectricExt() and is zero under total internal reflection.
+     */
+    inline void evalThinFilm(Float cosThetaI, Float thickness,
+            Spectrum &R, Spectrum &T, Float &cosThetaT) const {
+        Float cos0 = std::abs(cosThetaI);
+        Float r[ThinFilmTable::Channels], t[ThinFilmTable::Channels];
+
+        if (m_filmTable) {
+            const ThinFilmTable &table = cosThetaI > 0 ? m_filmTableExt : m_filmTableInt;
+            table.eval(cos0, thickness, r, t);
+            cosThetaT = table.cosThetaT(cos0);
+        } else {
+            Float n0 = cosThetaI > 0 ? extIOR : intIOR,
+                  n2 = cosThetaI > 0 ? intIOR : extIOR;
+
+            if (m_filmModel == ThinFilmTable::EFourier) {
+                ThinFilmReflectanceFourier(&cos0, 1, thickness, n0, mediumIOR, n2, r, &cosThetaT);
+                for (int i=0; i<ThinFilmTable::Channels; ++i)
+                    t[i] = 1 - r[i];
+            } else {
+                ThinFilmTransmissionRGB(&cos0, 1, thickness, n0, mediumIOR, n2, t, &cosThetaT);
+                for (int i=0; i<ThinFilmTable::Channels; ++i)
+                    r[i] = 1 - t[i];
+            }
+        }
+
+        R = Spectrum(r);
+        T = Spectrum(t);
+
+        if (cosThetaI > 0)
+            cosThetaT = -cosThetaT;
+    }
+
     Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
         bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
                 && (bRec.component == -1 || bRec.component == 0) && measure == EDiscrete;
         bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
                 && (bRec.component == -1 || bRec.component == 1) && measure == EDiscrete;
 
+        Spectrum R, T;
         Float cosThetaT;
-        Float F = fresnelDielectricExt(Frame::cosTheta(bRec.wi), cosThetaT, m_eta);
+        evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its), R, T, cosThetaT);
 
         if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) >= 0) {
             if (!sampleReflection || std::abs(dot(reflect(bRec.wi), bRec.wo)-1) > DeltaEpsilon)
                 return Spectrum(0.0f);
 
-            return m_specularReflectance->eval(bRec.its) * F;
+            return m_specularReflectance->eval(bRec.its) * R;
         } else {
             if (!sampleTransmission || std::abs(dot(refract(bRec.wi, cosThetaT), bRec.wo)-1) > DeltaEpsilon)
                 return Spectrum(0.0f);
@@ -260,7 +370,7 @@ public:
             Float factor = (bRec.mode == ERadiance)
                 ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
 
-            return m_specularTransmittance->eval(bRec.its)  * factor * factor * (1 - F);
+            return m_specularTransmittance->eval(bRec.its) * T * (factor * factor);
         }
     }
 
@@ -270,8 +380,10 @@ public:
         bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
                 && (bRec.component == -1 || bRec.component == 1) && measure == EDiscrete;
 
+        Spectrum R, T;
         Float cosThetaT;
-        Float F = fresnelDielectricExt(Frame::cosTheta(bRec.wi), cosThetaT, m_eta);
+        evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its), R, T, cosThetaT);
+        Float F = R.average();
 
         if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) >= 0) {
             if (!sampleReflection || std::abs(dot(reflect(bRec.wi), bRec.wo)-1) > DeltaEpsilon)
@@ -292,86 +404,33 @@ public:
         bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
                 && (bRec.component == -1 || bRec.component == 1);
 
-        Float thickness = m_thickness;
-        Float cosThetaT, cosThetaT_;
-        if(m_thickness_variation > 100){
-            std::random_device rd;
-            std::mt19937 mt(rd());
-            std::uniform_int_distribution<int> dist(-m_thickness_variation, m_thickness_variation);
-            int dice_roll = dist(mt);
-            Float thickness = dice_roll;
-        }
-        
-        //Float F = fresnelDielectricExt(Frame::cosTheta(bRec.wi), cosThetaT_, m_eta);
-        
-
-        float r, g, b;
-        
-        if(Frame::cosTheta(bRec.wi) > 0){
-            r = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 650.0, thickness, extIOR, mediumIOR, intIOR);
-            g = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 510.0, thickness, extIOR, mediumIOR, intIOR);
-            b = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 475.0, thickness, extIOR, mediumIOR, intIOR);
-        }else{
-            r = ThinFilmReflectance(std::abs(Frame::cosTheta(bRec.wi)), 650.0, thickness, intIOR, mediumIOR, extIOR);
-            g = ThinFilmReflectance(std::abs(Frame::cosTheta(bRec.wi)), 510.0, thickness, intIOR, mediumIOR, extIOR);
-            b = ThinFilmReflectance(std::abs(Frame::cosTheta(bRec.wi)), 475.0, thickness, intIOR, mediumIOR, extIOR);
-        }
-        
-
-        Float F = (r + g + b) / Float(3.0f);
-
+        Spectrum R, T;
+        Float cosThetaT;
+        evalThinFilm(Frame::cosTheta(bRec.wi), getThickness(bRec.its), R, T, cosThetaT);
+        Float F = R.average();
 
         if (sampleTransmission && sampleReflection) {
             if (sample.x <= F) {
-                Float RGB[SPECTRUM_SAMPLES];
-                //float r = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 650.0, thickness, extIOR, mediumIOR, intIOR);
-                //float g = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 510.0, thickness, extIOR, mediumIOR, intIOR);
-                //float b = ThinFilmReflectance(Frame::cosTheta(bRec.wi), 475.0, thickness, extIOR, mediumIOR, intIOR);
-
-                RGB[0] = r;
-                RGB[1] = g;
-                RGB[2] = b;
-
-                Spectrum spec(RGB);
                 bRec.sampledComponent = 0;
                 bRec.sampledType = EDeltaReflection;
                 bRec.wo = reflect(bRec.wi);
                 bRec.eta = 1.0f;
                 pdf = F;
-                // if totally specular pdf = 1.0f;
-                // if not totally specular pdf = F;
 
-                return m_specularReflectance->eval(bRec.its) * (spec);
+                return m_specularReflectance->eval(bRec.its) * R / F;
             } else {
-                Float RGB[SPECTRUM_SAMPLES];
-
-                if(Frame::cosTheta(bRec.wi) >= 0){ // estamos chocando por el exterior del material
-                    r = ThinFilmTransmissionExt(Frame::cosTheta(bRec.wi), cosThetaT, 650.0, thickness, extIOR, mediumIOR, intIOR);
-                    g = ThinFilmTransmissionExt(Frame::cosTheta(bRec.wi), cosThetaT, 510.0, thickness, extIOR, mediumIOR, intIOR);
-                    b = ThinFilmTransmissionExt(Frame::cosTheta(bRec.wi), cosThetaT, 475.0, thickness, extIOR, mediumIOR, intIOR);
-                }else{ // estamos chocando por el interior del material
-                    r = ThinFilmTransmissionExt(std::abs(Frame::cosTheta(bRec.wi)), cosThetaT, 650.0, thickness, intIOR, mediumIOR, extIOR);
-                    g = ThinFilmTransmissionExt(std::abs(Frame::cosTheta(bRec.wi)), cosThetaT, 510.0, thickness, intIOR, mediumIOR, extIOR);
-                    b = ThinFilmTransmissionExt(std::abs(Frame::cosTheta(bRec.wi)), cosThetaT, 475.0, thickness, intIOR, mediumIOR, extIOR);
-                    cosThetaT = -cosThetaT;
-                }
-                
-
-                RGB[0] = r;
-                RGB[1] = g;
-                RGB[2] = b;
-
-                Spectrum spec(RGB);
                 bRec.sampledComponent = 1;
                 bRec.sampledType = EDeltaTransmission;
                 bRec.wo = refract(bRec.wi, cosThetaT);
                 bRec.eta = cosThetaT < 0 ? m_eta : m_invEta;
-                // if totally refraction pdf = 1.0f;
-                // if not totally refraction pdf = 1-F;
-                pdf = 1.0f-F;
+                pdf = 1-F;
 
+                /* Radiance must be scaled to account for the solid angle compression
+                   that occurs when crossing the interface. */
+                Float factor = (bRec.mode == ERadiance)
+                    ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
 
-                return m_specularTransmittance->eval(bRec.its)  * spec;
+                return m_specularTransmittance->eval(bRec.its) * T * (factor * factor / (1-F));
             }
         } else if (sampleReflection) {
             bRec.sampledComponent = 0;
@@ -380,8 +439,11 @@ public:
             bRec.eta = 1.0f;
             pdf = 1.0f;
 
-            return m_specularReflectance->eval(bRec.its) * F;
+            return m_specularReflectance->eval(bRec.its) * R;
         } else if (sampleTransmission) {
+            if (cosThetaT == 0)
+                return Spectrum(0.0f);
+
             bRec.sampledComponent = 1;
             bRec.sampledType = EDeltaTransmission;
             bRec.wo = refract(bRec.wi, cosThetaT);
@@ -393,64 +455,15 @@ public:
             Float factor = (bRec.mode == ERadiance)
                 ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
 
-            return m_specularTransmittance->eval(bRec.its) * (factor * factor * (1-F));
+            return m_specularTransmittance->eval(bRec.its) * T * (factor * factor);
         }
 
         return Spectrum(0.0f);
     }
 
     Spectrum sample(BSDFSamplingRecord &bRec, const Point2 &sample) const {
-        bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
-                && (bRec.component == -1 || bRec.component == 0);
-        bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
-                && (bRec.component == -1 || bRec.component == 1);
-
-        Float cosThetaT;
-        Float F = fresnelDielectricExt(Frame::cosTheta(bRec.wi), cosThetaT, m_eta);
-
-        if (sampleTransmission && sampleReflection) {
-            if (sample.x <= F) {
-                bRec.sampledComponent = 0;
-                bRec.sampledType = EDeltaReflection;
-                bRec.wo = reflect(bRec.wi);
-                bRec.eta = 1.0f;
-
-                return m_specularReflectance->eval(bRec.its);
-            } else {
-                bRec.sampledComponent = 1;
-                bRec.sampledType = EDeltaTransmission;
-                bRec.wo = refract(bRec.wi, cosThetaT);
-                bRec.eta = cosThetaT < 0 ? m_eta : m_invEta;
-
-                /* Radiance must be scaled to account for the solid angle compression
-                   that occurs when crossing the interface. */
-                Float factor = (bRec.mode == ERadiance)
-                    ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
-
-                return m_specularTransmittance->eval(bRec.its) * (factor * factor);
-            }
-        } else if (sampleReflection) {
-            bRec.sampledComponent = 0;
-            bRec.sampledType = EDeltaReflection;
-            bRec.wo = reflect(bRec.wi);
-            bRec.eta = 1.0f;
-
-            return m_specularReflectance->eval(bRec.its) * F;
-        } else if (sampleTransmission) {
-            bRec.sampledComponent = 1;
-            bRec.sampledType = EDeltaTransmission;
-            bRec.wo = refract(bRec.wi, cosThetaT);
-            bRec.eta = cosThetaT < 0 ? m_eta : m_invEta;
-
-            /* Radiance must be scaled to account for the solid angle compression
-               that occurs when crossing the interface. */
-            Float factor = (bRec.mode == ERadiance)
-                ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
-
-            return m_specularTransmittance->eval(bRec.its) * (factor * factor * (1-F));
-        }
-
-        return Spectrum(0.0f);
+        Float pdf;
+        return SmoothDielectricThinFilm::sample(bRec, pdf, sample);
     }
 
     Float getEta() const {
@@ -466,6 +479,14 @@ public:
         oss << "SmoothDielectricThinFilm[" << endl
             << "  id = \"" << getID() << "\"," << endl
             << "  eta = " << m_eta << "," << endl
+            << "  extIOR = " << extIOR << "," << endl
+            << "  mediumIOR = " << mediumIOR << "," << endl
+            << "  intIOR = " << intIOR << "," << endl
+            << "  thickness = " << indent(m_thickness->toString()) << "," << endl
+            << "  thickness_variation = " << m_thickness_variation << "," << endl
+            << "  filmTable = " << m_filmTable << "," << endl
+            << "  filmModel = " << filmModelName(m_filmModel) << "," << endl
+            << "  filmTableError = " << m_filmTableError << "," << endl
             << "  specularReflectance = " << indent(m_specularReflectance->toString()) << "," << endl
             << "  specularTransmittance = " << indent(m_specularTransmittance->toString()) << endl
             << "]";
@@ -483,7 +504,12 @@ protected:
     //Thin-film properties
     Spectrum m_eta1, m_eta2;
     Float extIOR, mediumIOR, intIOR;
-    Float m_thickness, m_thickness_variation;
+    ref<Texture> m_thickness;
+    Float m_thicknessMin, m_thicknessMax, m_thickness_variation;
+    ThinFilmTable m_filmTableExt, m_filmTableInt;
+    ThinFilmTable::EModel m_filmModel;
+    Float m_filmTableError;
+    bool m_filmTable;
 };
 
 /* Fake glass shader -- it is really hopeless to visualize
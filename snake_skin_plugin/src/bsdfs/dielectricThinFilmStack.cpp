@@ -0,0 +1,416 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/bsdf.h>
+#include <mitsuba/hw/basicshader.h>
+#include "ior.h"
+#include "thinfilm.h"
+
+MTS_NAMESPACE_BEGIN
+
+/*!\plugin{dielectricThinFilmStack}{Smooth dielectric coated with a stack of thin films}
+ * \order{3}
+ * \parameters{
+ *     \parameter{intIOR}{\Float\Or\String}{Interior index of refraction specified
+ *      numerically or using a known material name. \default{\texttt{bk7} / 1.5046}}
+ *     \parameter{extIOR}{\Float\Or\String}{Exterior index of refraction specified
+ *      numerically or using a known material name. \default{\texttt{air} / 1.000277}}
+ *     \parameter{filmIOR}{\String}{Comma separated indices of refraction of
+ *      the films, starting on the exterior side (at least one)}
+ *     \parameter{filmThickness}{\String}{Comma separated thicknesses of the
+ *      films in nanometers (same count as \code{filmIOR})}
+ *     \parameter{periods}{\Integer}{Number of repetitions of the listed
+ *      films, e.g. to build a Bragg mirror from a pair of films. \default{1}}
+ *     \parameter{filmModel}{\String}{Conversion of the interference spectrum
+ *      to RGB: \code{rgb} (point sampled at the channel wavelengths) or
+ *      \code{spectral} (integrated over the visible range). \default{\code{rgb}}}
+ *     \parameter{filmTableError}{\Float}{Maximum interpolation error of the
+ *      tabulated stack response. \default{0.001}}
+ *     \parameter{specular\showbreak Reflectance}{\Spectrum\Or\Texture}{Optional
+ *         factor that can be used to modulate the specular reflection component. Note
+ *         that for physical realism, this parameter should never be touched. \default{1.0}}
+ *     \parameter{specular\showbreak Transmittance}{\Spectrum\Or\Texture}{Optional
+ *         factor that can be used to modulate the specular transmission component. Note
+ *         that for physical realism, this parameter should never be touched. \default{1.0}}
+ * }
+ *
+ * This plugin extends \pluginref{dielectricThinFilm} to an arbitrary stack of
+ * non-absorbing films, such as the alternating layers of the photonic
+ * structures found in iridescent scales. The stack is evaluated with the
+ * characteristic (transfer) matrix method, see \ref ThinFilmStackTransmission(),
+ * which accounts for all the interreflections between the films and for
+ * tunneling through thin films under total internal reflection.
+ *
+ * The response of the stack only depends on the incident angle, hence it is
+ * tabulated for both sides of the interface at configure() time. Rendering
+ * then costs a single table lookup regardless of the number of films.
+ *
+ * \begin{xml}[caption=A five period Bragg mirror centered at 550nm]
+ * <bsdf type="dielectricThinFilmStack">
+ *     <float name="intIOR" value="1.5"/>
+ *     <string name="filmIOR" value="2.3, 1.38"/>
+ *     <string name="filmThickness" value="59.8, 99.6"/>
+ *     <integer name="periods" value="5"/>
+ * </bsdf>
+ * \end{xml}
+ */
+class SmoothDielectricThinFilmStack : public BSDF {
+public:
+    SmoothDielectricThinFilmStack(const Properties &props) : BSDF(props) {
+        m_intIOR = lookupIOR(props, "intIOR", "bk7");
+        m_extIOR = lookupIOR(props, "extIOR", "air");
+
+        if (m_intIOR < 0 || m_extIOR < 0)
+            Log(EError, "The interior and exterior indices of "
+                "refraction must be positive!");
+
+        std::vector<Float> filmIOR = lookupFilmList(props, "filmIOR");
+        std::vector<Float> filmThickness = lookupFilmList(props, "filmThickness");
+        int periods = props.getInteger("periods", 1);
+
+        if (filmIOR.empty())
+            Log(EError, "The film stack is empty, specify at least one entry "
+                "in \"filmIOR\" and \"filmThickness\"!");
+        if (filmIOR.size() != filmThickness.size())
+            Log(EError, "Specified %i film indices of refraction, but %i thicknesses!",
+                (int) filmIOR.size(), (int) filmThickness.size());
+        if (periods < 1)
+            Log(EError, "The number of periods must be positive!");
+
+        for (int i=0; i<periods; ++i) {
+            m_filmIOR.insert(m_filmIOR.end(), filmIOR.begin(), filmIOR.end());
+            m_filmThickness.insert(m_filmThickness.end(),
+                filmThickness.begin(), filmThickness.end());
+        }
+
+        for (size_t i=0; i<m_filmIOR.size(); ++i) {
+            if (m_filmIOR[i] <= 0 || m_filmThickness[i] < 0)
+                Log(EError, "Film %i has an invalid index of refraction "
+                    "or thickness!", (int) i);
+        }
+
+        m_filmTableError = props.getFloat("filmTableError", 1e-3f);
+        m_filmModel = lookupFilmModel(props);
+
+        if (m_filmModel == ThinFilmTable::EFourier)
+            Log(EError, "The fourier film model only supports single films, "
+                "use \"rgb\" or \"spectral\"!");
+
+        m_eta = m_intIOR / m_extIOR;
+        m_invEta = 1 / m_eta;
+
+        m_specularReflectance = new ConstantSpectrumTexture(
+            props.getSpectrum("specularReflectance", Spectrum(1.0f)));
+        m_specularTransmittance = new ConstantSpectrumTexture(
+            props.getSpectrum("specularTransmittance", Spectrum(1.0f)));
+    }
+
+    SmoothDielectricThinFilmStack(Stream *stream, InstanceManager *manager)
+            : BSDF(stream, manager) {
+        m_intIOR = stream->readFloat();
+        m_extIOR = stream->readFloat();
+        m_filmModel = (ThinFilmTable::EModel) stream->readInt();
+        m_filmTableError = stream->readFloat();
+        size_t layers = stream->readSize();
+        m_filmIOR.resize(layers);
+        m_filmThickness.resize(layers);
+        if (layers > 0) {
+            stream->readFloatArray(&m_filmIOR[0], layers);
+            stream->readFloatArray(&m_filmThickness[0], layers);
+        }
+        m_specularReflectance = static_cast<Texture *>(manager->getInstance(stream));
+        m_specularTransmittance = static_cast<Texture *>(manager->getInstance(stream));
+        m_eta = m_intIOR / m_extIOR;
+        m_invEta = 1 / m_eta;
+        configure();
+    }
+
+    void serialize(Stream *stream, InstanceManager *manager) const {
+        BSDF::serialize(stream, manager);
+
+        stream->writeFloat(m_intIOR);
+        stream->writeFloat(m_extIOR);
+        stream->writeInt(m_filmModel);
+        stream->writeFloat(m_filmTableError);
+        stream->writeSize(m_filmIOR.size());
+        if (!m_filmIOR.empty()) {
+            stream->writeFloatArray(&m_filmIOR[0], m_filmIOR.size());
+            stream->writeFloatArray(&m_filmThickness[0], m_filmThickness.size());
+        }
+        manager->serialize(stream, m_specularReflectance.get());
+        manager->serialize(stream, m_specularTransmittance.get());
+    }
+
+    void configure() {
+        /* Verify the input parameters and fix them if necessary */
+        m_specularReflectance = ensureEnergyConservation(
+            m_specularReflectance, "specularReflectance", 1.0f);
+        m_specularTransmittance = ensureEnergyConservation(
+            m_specularTransmittance, "specularTransmittance", 1.0f);
+
+        m_components.clear();
+        m_components.push_back(EDeltaReflection | EFrontSide | EBackSide
+            | (m_specularReflectance->isConstant() ? 0 : ESpatiallyVarying));
+        m_components.push_back(EDeltaTransmission | EFrontSide | EBackSide | ENonSymmetric
+            | (m_specularTransmittance->isConstant() ? 0 : ESpatiallyVarying));
+
+        m_usesRayDifferentials =
+            m_specularReflectance->usesRayDifferentials() ||
+            m_specularTransmittance->usesRayDifferentials();
+
+        /* Light arriving from the interior traverses the films in reverse order */
+        std::vector<Float> revIOR(m_filmIOR.rbegin(), m_filmIOR.rend());
+        std::vector<Float> revThickness(m_filmThickness.rbegin(), m_filmThickness.rend());
+
+        m_filmTableExt = ThinFilmTable(m_extIOR, m_filmIOR, m_filmThickness,
+            m_intIOR, m_filmModel, m_filmTableError);
+        m_filmTableInt = ThinFilmTable(m_intIOR, revIOR, revThickness,
+            m_extIOR, m_filmModel, m_filmTableError);
+
+        BSDF::configure();
+    }
+
+    void addChild(const std::string &name, ConfigurableObject *child) {
+        if (child->getClass()->derivesFrom(MTS_CLASS(Texture))) {
+            if (name == "specularReflectance")
+                m_specularReflectance = static_cast<Texture *>(child);
+            else if (name == "specularTransmittance")
+                m_specularTransmittance = static_cast<Texture *>(child);
+            else
+                BSDF::addChild(name, child);
+        } else {
+            BSDF::addChild(name, child);
+        }
+    }
+
+    /// Reflection in local coordinates
+    inline Vector reflect(const Vector &wi) const {
+        return Vector(-wi.x, -wi.y, wi.z);
+    }
+
+    /// Refraction in local coordinates
+    inline Vector refract(const Vector &wi, Float cosThetaT) const {
+        Float scale = -(cosThetaT < 0 ? m_invEta : m_eta);
+        return Vector(scale*wi.x, scale*wi.y, cosThetaT);
+    }
+
+    /**
+     * \brief Tabulated reflectance and transmittance of the stack for an
+     * incident cosine on either side of the interface
+     *
+     * \c cosThetaT follows the convention of \ref fresnelDielectricExt()
+     * and is zero under total internal reflection.
+     */
+    inline void evalStack(Float cosThetaI, Spectrum &R, Spectrum &T, Float &cosThetaT) const {
+        Float cos0 = std::abs(cosThetaI);
+        const ThinFilmTable &table = cosThetaI > 0 ? m_filmTableExt : m_filmTableInt;
+
+        Float r[ThinFilmTable::Channels], t[ThinFilmTable::Channels];
+        table.eval(cos0, 0, r, t);
+        R = Spectrum(r);
+        T = Spectrum(t);
+
+        cosThetaT = table.cosThetaT(cos0);
+        if (cosThetaI > 0)
+            cosThetaT = -cosThetaT;
+    }
+
+    Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
+        bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
+                && (bRec.component == -1 || bRec.component == 0) && measure == EDiscrete;
+        bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
+                && (bRec.component == -1 || bRec.component == 1) && measure == EDiscrete;
+
+        Spectrum R, T;
+        Float cosThetaT;
+        evalStack(Frame::cosTheta(bRec.wi), R, T, cosThetaT);
+
+        if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) >= 0) {
+            if (!sampleReflection || std::abs(dot(reflect(bRec.wi), bRec.wo)-1) > DeltaEpsilon)
+                return Spectrum(0.0f);
+
+            return m_specularReflectance->eval(bRec.its) * R;
+        } else {
+            if (!sampleTransmission || std::abs(dot(refract(bRec.wi, cosThetaT), bRec.wo)-1) > DeltaEpsilon)
+                return Spectrum(0.0f);
+
+            /* Radiance must be scaled to account for the solid angle compression
+               that occurs when crossing the interface. */
+            Float factor = (bRec.mode == ERadiance)
+                ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
+
+            return m_specularTransmittance->eval(bRec.its) * T * (factor * factor);
+        }
+    }
+
+    Float pdf(const BSDFSamplingRecord &bRec, EMeasure measure) const {
+        bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
+                && (bRec.component == -1 || bRec.component == 0) && measure == EDiscrete;
+        bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
+                && (bRec.component == -1 || bRec.component == 1) && measure == EDiscrete;
+
+        Spectrum R, T;
+        Float cosThetaT;
+        evalStack(Frame::cosTheta(bRec.wi), R, T, cosThetaT);
+        Float F = R.average();
+
+        if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) >= 0) {
+            if (!sampleReflection || std::abs(dot(reflect(bRec.wi), bRec.wo)-1) > DeltaEpsilon)
+                return 0.0f;
+
+            return sampleTransmission ? F : 1.0f;
+        } else {
+            if (!sampleTransmission || std::abs(dot(refract(bRec.wi, cosThetaT), bRec.wo)-1) > DeltaEpsilon)
+                return 0.0f;
+
+            return sampleReflection ? 1-F : 1.0f;
+        }
+    }
+
+    Spectrum sample(BSDFSamplingRecord &bRec, Float &pdf, const Point2 &sample) const {
+        bool sampleReflection   = (bRec.typeMask & EDeltaReflection)
+                && (bRec.component == -1 || bRec.component == 0);
+        bool sampleTransmission = (bRec.typeMask & EDeltaTransmission)
+                && (bRec.component == -1 || bRec.component == 1);
+
+        Spectrum R, T;
+        Float cosThetaT;
+        evalStack(Frame::cosTheta(bRec.wi), R, T, cosThetaT);
+        Float F = R.average();
+
+        bool reflection;
+        if (sampleTransmission && sampleReflection) {
+            reflection = sample.x <= F;
+            pdf = reflection ? F : 1-F;
+        } else if (sampleReflection || sampleTransmission) {
+            reflection = sampleReflection;
+            pdf = 1.0f;
+        } else {
+            return Spectrum(0.0f);
+        }
+
+        if (reflection) {
+            bRec.sampledComponent = 0;
+            bRec.sampledType = EDeltaReflection;
+            bRec.wo = reflect(bRec.wi);
+            bRec.eta = 1.0f;
+
+            return m_specularReflectance->eval(bRec.its) * R / pdf;
+        } else {
+            if (cosThetaT == 0 || pdf == 0)
+                return Spectrum(0.0f);
+
+            bRec.sampledComponent = 1;
+            bRec.sampledType = EDeltaTransmission;
+            bRec.wo = refract(bRec.wi, cosThetaT);
+            bRec.eta = cosThetaT < 0 ? m_eta : m_invEta;
+
+            /* Radiance must be scaled to account for the solid angle compression
+               that occurs when crossing the interface. */
+            Float factor = (bRec.mode == ERadiance)
+                ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
+
+            return m_specularTransmittance->eval(bRec.its) * T * (factor * factor / pdf);
+        }
+    }
+
+    Spectrum sample(BSDFSamplingRecord &bRec, const Point2 &sample) const {
+        Float pdf;
+        return SmoothDielectricThinFilmStack::sample(bRec, pdf, sample);
+    }
+
+    Float getEta() const {
+        return m_eta;
+    }
+
+    Float getRoughness(const Intersection &its, int component) const {
+        return 0.0f;
+    }
+
+    std::string toString() const {
+        std::ostringstream oss;
+        oss << "SmoothDielectricThinFilmStack[" << endl
+            << "  id = \"" << getID() << "\"," << endl
+            << "  eta = " << m_eta << "," << endl
+            << "  extIOR = " << m_extIOR << "," << endl
+            << "  intIOR = " << m_intIOR << "," << endl
+            << "  filmIOR = " << filmListString(m_filmIOR) << "," << endl
+            << "  filmThickness = " << filmListString(m_filmThickness) << "," << endl
+            << "  filmModel = " << filmModelName(m_filmModel) << "," << endl
+            << "  filmTableError = " << m_filmTableError << "," << endl
+            << "  specularReflectance = " << indent(m_specularReflectance->toString()) << "," << endl
+            << "  specularTransmittance = " << indent(m_specularTransmittance->toString()) << endl
+            << "]";
+        return oss.str();
+    }
+
+    Shader *createShader(Renderer *renderer) const;
+
+    MTS_DECLARE_CLASS()
+protected:
+    Float m_eta, m_invEta;
+    Float m_intIOR, m_extIOR;
+    ref<Texture> m_specularTransmittance;
+    ref<Texture> m_specularReflectance;
+
+    //Thin-film stack, listed from the exterior side
+    std::vector<Float> m_filmIOR, m_filmThickness;
+    ThinFilmTable m_filmTableExt, m_filmTableInt;
+    ThinFilmTable::EModel m_filmModel;
+    Float m_filmTableError;
+};
+
+/* Fake glass shader -- it is really hopeless to visualize
+   this material in the VPL renderer, so let's try to do at least
+   something that suggests the presence of a transparent boundary */
+class SmoothDielectricThinFilmStackShader : public Shader {
+public:
+    SmoothDielectricThinFilmStackShader(Renderer *renderer) :
+        Shader(renderer, EBSDFShader) {
+        m_flags = ETransparent;
+    }
+
+    Float getAlpha() const {
+        return 0.3f;
+    }
+
+    void generateCode(std::ostringstream &oss,
+            const std::string &evalName,
+            const std::vector<std::string> &depNames) const {
+        oss << "vec3 " << evalName << "(vec2 uv, vec3 wi, vec3 wo) {" << endl
+            << "    if (cosTheta(wi) < 0.0 || cosTheta(wo) < 0.0)" << endl
+            << "        return vec3(0.0);" << endl
+            << "    return vec3(inv_pi * cosTheta(wo));" << endl
+            << "}" << endl
+            << endl
+            << "vec3 " << evalName << "_diffuse(vec2 uv, vec3 wi, vec3 wo) {" << endl
+            << "    return " << evalName << "(uv, wi, wo);" << endl
+            << "}" << endl;
+    }
+
+    MTS_DECLARE_CLASS()
+};
+
+Shader *SmoothDielectricThinFilmStack::createShader(Renderer *renderer) const {
+    return new SmoothDielectricThinFilmStackShader(renderer);
+}
+
+MTS_IMPLEMENT_CLASS(SmoothDielectricThinFilmStackShader, false, Shader)
+MTS_IMPLEMENT_CLASS_S(SmoothDielectricThinFilmStack, false, BSDF)
+MTS_EXPORT_PLUGIN(SmoothDielectricThinFilmStack, "Smooth dielectric thin-film stack BSDF");
+MTS_NAMESPACE_END
@@ -1,5 +1,6 @@
 #include <vector>
 #include <ctime>
+#include <atomic>
 
 #include <mitsuba/core/warp.h>
 #include <mitsuba/core/properties.h>
@@ -15,12 +16,41 @@
 #include <mitsuba/core/fstream.h>
 
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/tls.h>
+#include <mitsuba/core/pmf.h>
+#include <mitsuba/core/fresolver.h>
 
 #include <boost/math/special_functions/fpclassify.hpp>
 
 
+/// File header of cached baked tables
+#define MTS_MULTILAYERED_BAKED_MAGIC 0x4C424D4C
+
 MTS_NAMESPACE_BEGIN
 
+static StatsCounter avgWalkDepth("Multilayered BSDF", "Average random walk depth", EAverage);
+static StatsCounter maxWalkDepth("Multilayered BSDF", "Maximum random walk depth", EMaximumValue);
+static StatsCounter topCrossings("Multilayered BSDF", "Top interface events per walk", EAverage);
+static StatsCounter bottomCrossings("Multilayered BSDF", "Bottom interface events per walk", EAverage);
+static StatsCounter mediumEvents("Multilayered BSDF", "Medium events", EPercentage);
+static StatsCounter zeroThroughputWalks("Multilayered BSDF", "Walks terminated by zero throughput", EPercentage);
+static StatsCounter avgConnectedPairs("Multilayered BSDF", "Average connected vertex pairs", EAverage);
+static StatsCounter evalCalls("Multilayered BSDF", "Calls to eval()");
+static StatsCounter sampleCalls("Multilayered BSDF", "Calls to sample()");
+static StatsCounter pdfCalls("Multilayered BSDF", "Calls to pdf()");
+static StatsCounter evalAndSampleCalls("Multilayered BSDF", "Calls to evalAndSample()");
+static StatsCounter textureLookups("Multilayered BSDF", "Texture lookups per textured query", EAverage);
+
+/// Anomaly counters, indexed by MultiLayeredBSDF::EWalkAnomaly
+static StatsCounter walkAnomalies[] = {
+	{ "Multilayered BSDF", "Anomalies: negative pdf estimates" },
+	{ "Multilayered BSDF", "Anomalies: vertices outside of the slab" },
+	{ "Multilayered BSDF", "Anomalies: invalid layer indices" },
+	{ "Multilayered BSDF", "Anomalies: NaN throughputs" },
+	{ "Multilayered BSDF", "Anomalies: degenerate NEE segments" },
+	{ "Multilayered BSDF", "Anomalies: sub-paths starting in a medium" }
+};
+
 class MultiLayeredBSDF : public BSDF {
 public:
 	MultiLayeredBSDF(const Properties &props) : BSDF(props) {
@@ -36,48 +66,94 @@ public:
 		m_bidir = props.getBoolean("bidir", true);
 		m_maxSurvivalProb = props.getFloat("maxSurvivalProb", 1.0f);
 
+		/* Opt-in: evalAndSample() reuses the value sub-paths for the eval pdf. The
+		   pdf of the sampled direction still needs an independent forward walk, so
+		   this saves at most the eval pdf's backward walk (one walk in five, with
+		   bidir), and it correlates the value with its eval pdf estimate (see
+		   pdfEvaluation()). Ignored under Russian roulette */
+		m_fusedPdf = props.getBoolean("fusedPdf", false);
+
+		// Value walks always enter the stack; the outer reflection is evaluated in closed form
+		m_analyticTop = props.getBoolean("analyticTop", false);
+
+		// Upper bound on the vertex pairs connected per bidirEvaluation() (-1: all)
+		m_maxConnections = props.getInteger("maxConnections", -1);
+		if (m_maxConnections == 0 || m_maxConnections < -1)
+			Log(EError, "maxConnections must be positive (or -1 to connect all vertex pairs)");
+
+		// Throughput-based Russian roulette, starting at walk vertex rrDepth (-1: disabled)
+		m_rrDepth = props.getInteger("rrDepth", -1);
+		// A cap below one also kills walks whose throughput has not dropped, which makes
+		// long high-albedo walks heavy-tailed (see scripts/rr_benchmark.py -synthetic)
+		m_rrMaxSurvival = props.getFloat("rrMaxSurvival", 1.0f);
+		if (m_rrDepth >= 0 && (m_rrMaxSurvival <= 0 || m_rrMaxSurvival > 1))
+			Log(EError, "rrMaxSurvival must be in (0, 1]");
+
+		if (m_pdfMode != "const" && m_pdfMode != "TRT" && m_pdfMode != "bidirStochTRT" && m_pdfMode != "bidirStoch")
+			Log(EError, "Unknown pdf mode \"%s\" (must be \"const\", \"TRT\", \"bidirStochTRT\" or \"bidirStoch\")",
+				m_pdfMode.c_str());
+
+		for (int i = 0; i < EWalkAnomalyCount; ++i)
+			m_anomalyReported[i] = false;
+
+		// Tabulated evaluation of spatially constant configurations
+		m_baked = props.getBoolean("baked", false);
+		m_bakedCosRes = props.getInteger("bakedCosResolution", 32);
+		m_bakedPhiRes = props.getInteger("bakedPhiResolution", 32);
+		m_bakedSamples = props.getInteger("bakedSamples", 65536);
+		m_bakedCache = props.getString("bakedCache", "");
+		if (m_bakedCosRes < 2 || m_bakedPhiRes < 2 || m_bakedSamples < 1)
+			Log(EError, "The baked table needs at least 2x2 angular bins and one sample per bin!");
+
+		// Textured layers resampled into one interleaved parameter atlas (0: texture resolution)
+		m_useAtlas = props.getBoolean("atlas", false);
+		m_atlasResolution = props.getInteger("atlasResolution", 0);
+		if (m_atlasResolution < 0)
+			Log(EError, "atlasResolution must be positive (or 0 to use the texture resolution)");
+		// Memory budget of all atlases in MiB; layers that do not fit keep the direct lookups
+		int atlasMaxMemory = props.getInteger("atlasMaxMemory", 1024);
+		if (atlasMaxMemory <= 0)
+			Log(EError, "atlasMaxMemory must be positive (in MiB)");
+		m_atlasMaxMemory = (size_t) atlasMaxMemory * 1024 * 1024;
+		m_atlasMask = 0;
+
 		m_nbLayers = props.getInteger("nbLayers", 2);
+		if (m_nbLayers < 2 || m_nbLayers > 32)
+			Log(EError, "The number of layers must be between 2 and 32 (got %i)!", m_nbLayers);
+
+		m_flag_sigmaTs = m_flag_densities = m_flag_albedos = 0;
+		m_flag_orientations = m_flag_normals = m_flag_aniso = 0;
 
 		for (int l = 0; l < m_nbLayers-1; ++l) {
 			std::string index = std::to_string(l);
 			std::string name;
 
 			name = std::string("aniso_") + index;
-			m_flag_aniso.push_back(props.getBoolean(name, false));
-			if (!m_flag_aniso[l]) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: Homogeneous Isotropic" << std::endl;
+			if (props.getBoolean(name, false)) m_flag_aniso |= 1u << l;
+			if (!hasFlag(m_flag_aniso, l)) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: Homogeneous Isotropic" << std::endl;
 			else std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: Homogeneous Anisotropic" << std::endl;
 
 			name = std::string("sigmaT_") + index;
 			m_spectrum_sigmaTs.push_back(props.getSpectrum(name, Spectrum(1.0)));
-			if (!m_flag_aniso[l]) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: sigmaT(Spectrum)" << std::endl;
-
-			m_flag_sigmaTs.push_back(false);
+			if (!hasFlag(m_flag_aniso, l)) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: sigmaT(Spectrum)" << std::endl;
 
 			name = std::string("density_") + index;
 			m_float_densities.push_back(props.getFloat(name, 1.0));
-			if (m_flag_aniso[l]) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: density(Float)" << std::endl;
-
-			m_flag_densities.push_back(false);
+			if (hasFlag(m_flag_aniso, l)) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: density(Float)" << std::endl;
 
 			name = std::string("albedo_") + index;
 			m_spectrum_albedos.push_back(props.getSpectrum(name, Spectrum(1.0)));
 			std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: albedo(Spectrum)" << std::endl;
 			
-			m_flag_albedos.push_back(false);
-
 			name = std::string("orientation_") + index;
 			m_vector_orientations.push_back(props.getVector(name, Vector(1.0,0.0,0.0)));
-			if (m_flag_aniso[l]) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: orientation(Vector)" << std::endl;
-
-			m_flag_orientations.push_back(false);
+			if (hasFlag(m_flag_aniso, l)) std::cout << "[GY]: layer " << l + 1 << " of " << m_nbLayers << " :: medium :: orientation(Vector)" << std::endl;
 
 			name = std::string("normal_") + index;
 			m_vector_normals.push_back(props.getVector(name, Vector(0.0, 0.0, 1.0)));
 
-			m_flag_normals.push_back(false);
 		}
 		m_vector_normals.push_back(props.getVector(std::string("normal_") + std::to_string(m_nbLayers - 1), Vector(0.0, 0.0, 1.0)));
-		m_flag_normals.push_back(false);
 
 		m_bsdfs.resize(m_nbLayers);
 		m_texture_normals.resize(m_nbLayers);
@@ -119,47 +195,15 @@ public:
 			m_bsdfs[l]->configure();
 		}
 
-		// Medium
-		m_mediums.resize(NUM_COUNTERS, ref_vector<Medium>(m_nbLayers - 1));
-		m_pdfMediums.resize(NUM_COUNTERS, ref_vector<Medium>(m_nbLayers - 1));
-
-		Properties interiorIsoHomoProps("homogeneous");
-		interiorIsoHomoProps.setSpectrum("sigmaT", Spectrum(0.0));
-		interiorIsoHomoProps.setSpectrum("albedo", Spectrum(1.0));
-
-		Properties interiorAniHomoProps("homogeneous_aniso");
-		interiorAniHomoProps.setFloat("density", 0.0);
-		interiorAniHomoProps.setSpectrum("albedo", Spectrum(1.0));
-		interiorAniHomoProps.setVector("orientation", Vector(1.0, 0.0, 0.0));
-
-		for (size_t i = 0; i < NUM_COUNTERS; ++i) {
-			for (int l = 0; l < m_nbLayers - 1; ++l) {
-				if (m_flag_aniso[l]) {
-					m_mediums[i][l] = static_cast<Medium *> (PluginManager::getInstance()->
-						createObject(MTS_CLASS(Medium), interiorAniHomoProps));
-					m_mediums[i][l]->addChild(m_phaseFunctions[l]);
-					m_mediums[i][l]->configure();
-
-					m_pdfMediums[i][l] = static_cast<Medium *> (PluginManager::getInstance()->
-						createObject(MTS_CLASS(Medium), interiorAniHomoProps));
-					m_pdfMediums[i][l]->addChild(m_phaseFunctions[l]);
-					m_pdfMediums[i][l]->configure();
-				}
-				else {
-					m_mediums[i][l] = static_cast<Medium *> (PluginManager::getInstance()->
-						createObject(MTS_CLASS(Medium), interiorIsoHomoProps));
-					m_mediums[i][l]->addChild(m_phaseFunctions[l]);
-					m_mediums[i][l]->configure();
-
-					m_pdfMediums[i][l] = static_cast<Medium *> (PluginManager::getInstance()->
-						createObject(MTS_CLASS(Medium), interiorIsoHomoProps));
-					m_pdfMediums[i][l]->addChild(m_phaseFunctions[l]);
-					m_pdfMediums[i][l]->configure();
-				}
+		// Layers without an explicit phase function are isotropic
+		for (int l = 0; l < m_nbLayers - 1; ++l) {
+			if (m_phaseFunctions[l] == NULL) {
+				m_phaseFunctions[l] = static_cast<PhaseFunction *> (PluginManager::getInstance()->
+					createObject(MTS_CLASS(PhaseFunction), Properties("isotropic")));
+				m_phaseFunctions[l]->configure();
 			}
 		}
 
-
 		// 
 		size_t componentCount = m_bsdfs[m_nbLayers-1]->getComponentCount();
 		m_components.reserve(componentCount);
@@ -182,6 +226,17 @@ public:
 			cout << "[GY]: Non-tranparent layer" << endl;
 		}
 
+		if (m_useAtlas)
+			buildAtlas();
+
+		configureKernels();
+
+		if (m_baked) {
+			m_baked = canBake();
+			if (m_baked)
+				configureBaked();
+		}
+
 		cout << "[GY]: Configuration Done!" << endl;
 		cout << "##################################" << endl;
 	}
@@ -203,6 +258,62 @@ public:
 		return pdfA / (pdfA + pdfB);
 	}
 
+	/// Anomalies of the random walk, see \ref reportAnomaly()
+	enum EWalkAnomaly {
+		ENegativePdf = 0,
+		EOutOfSlabVertex,
+		EInvalidLayer,
+		ENaNThroughput,
+		EDegenerateSegment,
+		EMediumSubPathStart,
+		EWalkAnomalyCount
+	};
+
+	/**
+	 * Count an anomaly of the random walk. The counters are per-thread
+	 * StatsCounters (no locking) and are summarised with the other statistics
+	 * at the end of the render. Only the first occurrence of each kind is
+	 * logged, so that a misbehaving scene cannot flood the console.
+	 */
+	inline void reportAnomaly(EWalkAnomaly type) const {
+		static const char *descriptions[EWalkAnomalyCount] = {
+			"negative pdf estimate", "vertex outside of the slab", "invalid layer index",
+			"NaN throughput", "degenerate NEE segment", "sub-path starting in a medium"
+		};
+		++walkAnomalies[type];
+		if (!m_anomalyReported[type].load(std::memory_order_relaxed)
+			&& !m_anomalyReported[type].exchange(true))
+			Log(EWarn, "Random walk anomaly: %s. Further occurrences are only counted "
+				"in the statistics.", descriptions[type]);
+	}
+
+	/**
+	 * Throughput-based Russian roulette at walk vertex \c depth. On survival the
+	 * throughput is reweighted by 1/q. The survival probability depends on the
+	 * prefix of the walk, which the opposite sub-path of bidirEvaluation()
+	 * cannot reproduce, so unlike the analog survival of "bidirUseAnalog" it is
+	 * kept out of the vertex pdfs and the MIS weights. Returns false if the
+	 * walk dies.
+	 */
+	inline bool russianRoulette(int depth, Spectrum &throughput, Sampler *sampler) const {
+		if (m_rrDepth < 0 || depth < m_rrDepth)
+			return true;
+		Float q = std::min(throughput.max(), m_rrMaxSurvival);
+		if (sampler->next1D() >= q)
+			return false;
+		throughput /= q;
+		return true;
+	}
+
+	static inline bool hasFlag(uint32_t mask, int layer) {
+		return (mask >> layer) & 1;
+	}
+
+	/// Number of layers, known at compile time in the specialized kernels (N > 0)
+	template <int N> inline int layerCount() const {
+		return N > 0 ? N : m_nbLayers;
+	}
+
 	Normal getNormalFromTexture(const ref<Texture2D> normal_texture, const Point2 &uv) const {
 		Normal normal;
 		normal_texture->eval(uv).toLinearRGB(normal.x, normal.y, normal.z);
@@ -233,150 +344,451 @@ public:
 		return normalize(orien);
 	}
 
-	void setParameters(const BSDFSamplingRecord &_bRec, std::vector<Frame> &frames,
-		ref_vector<Medium> &mediums) const {
-
-		Point2 uv = _bRec.its.uv;
-		int thread_id = Thread::getID() & NUM_COUNTERS_MASK;
-
-		// medium and phase function for specific position.     
-		mediums = m_mediums[thread_id];
-
-		for (int l = 0; l < m_nbLayers-1; ++l) {
-			if (m_flag_aniso[l]) {
-				Float density = m_flag_densities[l] ? m_texture_densities[l]->eval(uv)[0] * m_float_densities[l] : m_float_densities[l];
-				Spectrum albedo = m_spectrum_albedos[l];
-				if (m_flag_albedos[l]) albedo *= m_texture_albedos[l]->eval(uv);
-				Vector orientation = m_flag_orientations[l] ? getOrientationFromTexture(m_texture_orientations[l], uv) : m_vector_orientations[l];
-				mediums[l]->setMediumProp(density, albedo, orientation);
-			}
-			else {
-				Spectrum sigmaT = m_spectrum_sigmaTs[l];
-				if (m_flag_sigmaTs[l]) sigmaT *= m_texture_sigmaTs[l]->eval(uv);
-				Spectrum albedo = m_spectrum_albedos[l];
-				if (m_flag_albedos[l]) albedo *= m_texture_albedos[l]->eval(uv);
-				mediums[l]->setSigmaAST(sigmaT, albedo);
-			}
+	/**
+	 * \brief Homogeneous medium filling the slab between two interfaces
+	 *
+	 * This is a plain value that is filled in per query by \ref setParameters(),
+	 * which keeps the BSDF reentrant for any number of threads. Distances are
+	 * sampled with the "balance" strategy of the \c homogeneous medium plugin
+	 * (random channel, medium sampling weight of one). Anisotropic layers use a
+	 * direction-dependent extinction density * sigmaDir(cos), as in Mitsuba's
+	 * heterogeneous medium. All queries are expressed as a direction and a
+	 * distance, since only the depth of a vertex matters inside the slab.
+	 */
+	struct SlabMedium {
+		Spectrum sigmaT, albedo;
+		Float density;
+		Vector orientation;
+		bool aniso;
+		const PhaseFunction *phase;
+
+		inline Spectrum getSigmaT(const Vector &d) const {
+			return aniso ? Spectrum(density * phase->sigmaDir(dot(d, orientation))) : sigmaT;
 		}
 
-		// Shading normal   
-		for (int l = 0; l < m_nbLayers; ++l) {
-			const Normal normal = m_flag_normals[l] ? getNormalFromTexture(m_texture_normals[l], uv) : m_vector_normals[l];
-			frames.push_back(Frame(normalize(normal)));
+		inline const PhaseFunction *getPhaseFunction() const {
+			return phase;
 		}
 
-	}
-
-	void setParametersPdf(const BSDFSamplingRecord &_bRec,
-		ref_vector<Medium> &mediums) const {
-
-		Point2 uv = _bRec.its.uv;
-		int thread_id = Thread::getID() & NUM_COUNTERS_MASK;
+		inline void evalBalance(const Spectrum &sigmaT, Float distance, MediumSamplingRecord &mRec) const {
+			mRec.pdfSuccess = 0;
+			mRec.pdfFailure = 0;
+			for (int i = 0; i < SPECTRUM_SAMPLES; ++i) {
+				Float tmp = math::fastexp(-sigmaT[i] * distance);
+				mRec.pdfSuccess += sigmaT[i] * tmp;
+				mRec.pdfFailure += tmp;
+			}
+			mRec.pdfSuccess /= SPECTRUM_SAMPLES;
+			mRec.pdfFailure /= SPECTRUM_SAMPLES;
+			mRec.pdfSuccessRev = mRec.pdfSuccess;
 
-		// medium and phase function for specific position.     
-		mediums = m_pdfMediums[thread_id];
+			mRec.transmittance = (sigmaT * (-distance)).exp();
+			if (mRec.transmittance.max() < 1e-20)
+				mRec.transmittance = Spectrum(0.0f);
+		}
 
-		for (int l = 0; l < m_nbLayers - 1; ++l) {
-			if (m_flag_aniso[l]) {
-				Float density = m_flag_densities[l] ? m_texture_densities[l]->eval(uv)[0] * m_float_densities[l] : m_float_densities[l];
-				Spectrum albedo = Spectrum(0.0);
-				Vector orientation = m_flag_orientations[l] ? getOrientationFromTexture(m_texture_orientations[l], uv) : m_vector_orientations[l];
-				mediums[l]->setMediumProp(density, albedo, orientation);
+		/// Sample a free-flight distance along \c d, failing beyond \c distSurf
+		inline bool sampleDistance(const Vector &d, Float distSurf, MediumSamplingRecord &mRec, Sampler *sampler) const {
+			const Spectrum sigmaT = getSigmaT(d);
+			Float rand = sampler->next1D();
+			int channel = std::min((int) (sampler->next1D() * SPECTRUM_SAMPLES), SPECTRUM_SAMPLES - 1);
+			Float sampledDistance = -math::fastlog(1 - rand) / sigmaT[channel];
+
+			bool success = true;
+			if (sampledDistance < distSurf) {
+				mRec.t = sampledDistance;
+				mRec.sigmaS = sigmaT * albedo;
+				mRec.sigmaA = sigmaT - mRec.sigmaS;
+				mRec.orientation = orientation;
+
+				/* Fail if there is no forward progress
+				   (e.g. due to roundoff errors) */
+				if (sampledDistance <= 0)
+					success = false;
 			}
 			else {
-				Spectrum sigmaT = m_spectrum_sigmaTs[l];
-				if (m_flag_sigmaTs[l]) sigmaT *= m_texture_sigmaTs[l]->eval(uv);
-				Spectrum albedo = Spectrum(0.0);
-				mediums[l]->setSigmaAST(sigmaT, albedo);
+				sampledDistance = distSurf;
+				success = false;
 			}
+
+			evalBalance(sigmaT, sampledDistance, mRec);
+			mRec.medium = NULL;
+			return success;
 		}
 
-	}
+		inline void eval(const Vector &d, Float distance, MediumSamplingRecord &mRec) const {
+			const Spectrum sigmaT = getSigmaT(d);
+			evalBalance(sigmaT, distance, mRec);
+			mRec.sigmaS = sigmaT * albedo;
+			mRec.sigmaA = sigmaT - mRec.sigmaS;
+			mRec.orientation = orientation;
+			mRec.medium = NULL;
+		}
 
-	bool rayIntersect(const Ray &ray, Intersection &its) const {
+		inline Spectrum evalTransmittance(const Vector &d, Float distance) const {
+			const Spectrum sigmaT = getSigmaT(d);
+			Float negLength = -distance;
+			Spectrum transmittance;
+			for (int i = 0; i < SPECTRUM_SAMPLES; ++i)
+				transmittance[i] = sigmaT[i] != 0
+					? math::fastexp(sigmaT[i] * negLength) : (Float) 1.0f;
+			return transmittance;
+		}
+	};
 
-		its.p.x = std::numeric_limits<Float>::infinity();
-		its.p.y = std::numeric_limits<Float>::infinity();
-		its.p.z = std::numeric_limits<Float>::infinity();
-		its.t = std::numeric_limits<Float>::infinity();
-		its.wi = normalize(-ray.d);
+	/**
+	 * \brief Frames and media of the layers at one shading point
+	 *
+	 * Textured parameters are looked up the first time the walk needs a layer
+	 * and memoised (see the masks) for the rest of the query, since many
+	 * queries reflect off the top interface and never reach the lower layers.
+	 * A view with a \c base (see \ref setParametersPdf()) shares the frames
+	 * and media of its base, with the albedo forced to zero.
+	 */
+	struct LayerParams {
+		const MultiLayeredBSDF *bsdf;
+		const LayerParams *base;
+		Point2 uv;
+		mutable uint32_t frameMask, mediumMask;   ///< Layers resolved so far
+		mutable std::vector<Frame> frames;
+		mutable std::vector<SlabMedium> mediums;
+
+		inline LayerParams() : bsdf(NULL), base(NULL), frameMask(0), mediumMask(0) { }
+
+		inline const Frame &frame(int l) const {
+			if (base)
+				return base->frame(l);
+			if (!hasFlag(frameMask, l)) {
+				if (hasFlag(bsdf->m_atlasMask, l)) {
+					fetchAtlas(l);
+				}
+				else {
+					textureLookups += hasFlag(bsdf->m_flag_normals, l);
+					frames[l] = bsdf->evalFrame(l, uv);
+					frameMask |= 1u << l;
+				}
+			}
+			return frames[l];
+		}
 
-		its.geoFrame = Frame(Normal(0.0, 0.0, 1.0));
-		its.shFrame = its.geoFrame;
+		inline const SlabMedium &medium(int l) const {
+			if (!hasFlag(mediumMask, l)) {
+				if (base) {
+					mediums[l] = base->medium(l);
+					mediums[l].albedo = Spectrum(0.0);
+				}
+				else if (hasFlag(bsdf->m_atlasMask, l)) {
+					fetchAtlas(l);
+					return mediums[l];
+				}
+				else {
+					textureLookups += bsdf->mediumTextureCount(l);
+					bsdf->evalMedium(l, uv, mediums[l]);
+				}
+				mediumMask |= 1u << l;
+			}
+			return mediums[l];
+		}
 
-		if (std::abs(ray.d.z) < Epsilon)
-			return false;
+		/// Frame and medium of layer \c l from a single atlas fetch
+		inline void fetchAtlas(int l) const {
+			++textureLookups;
+			bool hasMedium = l < (int) mediums.size();
+			bsdf->evalAtlas(l, uv, frames[l], hasMedium ? &mediums[l] : NULL);
+			frameMask |= 1u << l;
+			if (hasMedium)
+				mediumMask |= 1u << l;
+		}
+	};
 
-		bool isUp = ray.d.z > 0 ? true : false;
-		
-		Float z = ray(Epsilon).z;
+	/// Number of textured medium parameters of layer \c l
+	inline int mediumTextureCount(int l) const {
+		return hasFlag(m_flag_albedos, l) + (hasFlag(m_flag_aniso, l)
+			? hasFlag(m_flag_densities, l) + hasFlag(m_flag_orientations, l)
+			: hasFlag(m_flag_sigmaTs, l));
+	}
 
-		Float z_bot = std::floor(z);
-		Float z_top = z_bot + 1;
+	/// Shading frame of interface \c l at \c uv
+	Frame evalFrame(int l, const Point2 &uv) const {
+		if (hasFlag(m_flag_normals, l))
+			return Frame(normalize(getNormalFromTexture(m_texture_normals[l], uv)));
+		return Frame(normalize(m_vector_normals[l]));
+	}
 
-		if ((z_top > 0 && isUp) || (z_bot < -(m_nbLayers - 1) && !isUp)) {
-			return false;
+	/// Medium and phase function of layer \c l at \c uv
+	void evalMedium(int l, const Point2 &uv, SlabMedium &medium) const {
+		medium.aniso = hasFlag(m_flag_aniso, l);
+		medium.phase = m_phaseFunctions[l].get();
+		medium.albedo = m_spectrum_albedos[l];
+		if (hasFlag(m_flag_albedos, l))
+			medium.albedo *= m_texture_albedos[l]->eval(uv);
+		if (hasFlag(m_flag_aniso, l)) {
+			medium.density = m_float_densities[l];
+			if (hasFlag(m_flag_densities, l))
+				medium.density *= m_texture_densities[l]->eval(uv)[0];
+			medium.orientation = m_vector_orientations[l];
+			if (hasFlag(m_flag_orientations, l))
+				medium.orientation = getOrientationFromTexture(m_texture_orientations[l], uv);
 		}
-
-		its.p.z = isUp ? z_top : z_bot;
-		if (its.p.z > Epsilon || its.p.z < -(m_nbLayers - 1) - Epsilon) {
-			cout << "[GY]: Warning in rayIntersect()" << endl;
-			return false;
+		else {
+			medium.sigmaT = m_spectrum_sigmaTs[l];
+			if (hasFlag(m_flag_sigmaTs, l))
+				medium.sigmaT *= m_texture_sigmaTs[l]->eval(uv);
+			medium.density = 0.0;
+			medium.orientation = Vector(0.0, 0.0, 1.0);
 		}
-
-		its.p.x = ray.o.x + ray.d.x * ((its.p.z - ray.o.z) / ray.d.z);
-		its.p.y = ray.o.y + ray.d.y * ((its.p.z - ray.o.z) / ray.d.z);
-		its.t = (its.p - ray.o).length();
-
-		return true;
 	}
 
-	bool rayIntersectAndLookForEmitter(const Ray &ray, Intersection &its, const bool flag_type, bool &isEmitter) const {
+	/// Parameters of one layer at one atlas texel (see \ref buildAtlas())
+	struct AtlasTexel {
+		Normal normal;
+		Vector orientation;
+		Spectrum sigmaT, albedo;
+		Float density;
+	};
 
-		isEmitter = false;
+	/// Interleaved parameters of one textured layer, sampled at the texel centres
+	struct LayerAtlas {
+		int width, height;
+		std::vector<AtlasTexel> texels;
+	};
 
-		its.p.x = std::numeric_limits<Float>::infinity();
-		its.p.y = std::numeric_limits<Float>::infinity();
-		its.p.z = std::numeric_limits<Float>::infinity();
-		its.t = std::numeric_limits<Float>::infinity();
-		its.wi = normalize(-ray.d);
+	/**
+	 * \brief Resample the textures of every textured layer into a LayerAtlas
+	 *
+	 * The layer's normal, sigmaT, density, albedo and orientation (constants
+	 * and texture scales already applied) are stored together per texel, so
+	 * that \ref evalAtlas() replaces up to five virtual texture lookups with a
+	 * single bilinear fetch. The atlas uses the largest resolution among the
+	 * layer's textures unless \c atlasResolution overrides it; procedural
+	 * textures without a resolution are sampled at 512x512.
+	 *
+	 * The atlas is addressed with wrap-around, so a layer only gets one if
+	 * all of its textures repeat (see \ref isPeriodic()). Layers whose atlas
+	 * would exceed the remaining \c atlasMaxMemory budget are skipped as well;
+	 * both fall back to the direct texture lookups.
+	 */
+	void buildAtlas() {
+		m_atlas.clear();
+		m_atlas.resize(m_nbLayers);
+		m_atlasMask = 0;
+		size_t bytes = 0;
 
-		its.geoFrame = Frame(Normal(0.0, 0.0, 1.0));
-		its.shFrame = its.geoFrame;
+		for (int l = 0; l < m_nbLayers; ++l) {
+			bool hasMedium = l < m_nbLayers - 1;
+			std::vector<const Texture2D *> textures;
+			if (hasFlag(m_flag_normals, l))
+				textures.push_back(m_texture_normals[l].get());
+			if (hasMedium && hasFlag(m_flag_albedos, l))
+				textures.push_back(m_texture_albedos[l].get());
+			if (hasMedium && hasFlag(m_flag_aniso, l)) {
+				if (hasFlag(m_flag_densities, l))
+					textures.push_back(m_texture_densities[l].get());
+				if (hasFlag(m_flag_orientations, l))
+					textures.push_back(m_texture_orientations[l].get());
+			}
+			else if (hasMedium && hasFlag(m_flag_sigmaTs, l)) {
+				textures.push_back(m_texture_sigmaTs[l].get());
+			}
+			if (textures.empty())
+				continue;
+
+			bool periodic = true;
+			for (size_t i = 0; i < textures.size() && periodic; ++i)
+				periodic = isPeriodic(textures[i]);
+			if (!periodic) {
+				Log(EWarn, "Layer %i: a texture does not repeat (clamped or mirrored "
+					"wrap mode?), keeping the direct lookups instead of an atlas", l + 1);
+				continue;
+			}
 
-		if (std::abs(ray.d.z) < Epsilon)
-			return false;
+			int width = m_atlasResolution, height = m_atlasResolution;
+			if (m_atlasResolution == 0) {
+				for (size_t i = 0; i < textures.size(); ++i) {
+					Vector3i res = textures[i]->getResolution();
+					width = std::max(width, res.x);
+					height = std::max(height, res.y);
+				}
+				if (width == 0 || height == 0)
+					width = height = 512;
+			}
 
-		bool isUp = ray.d.z > 0 ? true : false;
+			size_t layerBytes = (size_t) width * height * sizeof(AtlasTexel);
+			if (bytes + layerBytes > m_atlasMaxMemory) {
+				Log(EWarn, "Layer %i: a %ix%i parameter atlas needs %s, which exceeds the "
+					"remaining atlasMaxMemory budget (%s), keeping the direct lookups", l + 1,
+					width, height, memString(layerBytes).c_str(),
+					memString(m_atlasMaxMemory - bytes).c_str());
+				continue;
+			}
 
-		Float z = ray(Epsilon).z;
+			LayerAtlas &atlas = m_atlas[l];
+			atlas.width = width;
+			atlas.height = height;
+			atlas.texels.resize((size_t) atlas.width * atlas.height);
+			SlabMedium medium;
+			medium.sigmaT = Spectrum(0.0f); // not set for anisotropic media
+			for (int y = 0; y < atlas.height; ++y) {
+				for (int x = 0; x < atlas.width; ++x) {
+					Point2 uv((x + Float(0.5)) / atlas.width, (y + Float(0.5)) / atlas.height);
+					AtlasTexel &texel = atlas.texels[(size_t) y * atlas.width + x];
+					texel.normal = hasFlag(m_flag_normals, l)
+						? getNormalFromTexture(m_texture_normals[l], uv) : Normal(m_vector_normals[l]);
+					if (hasMedium) {
+						evalMedium(l, uv, medium);
+						texel.sigmaT = medium.sigmaT;
+						texel.albedo = medium.albedo;
+						texel.density = medium.density;
+						texel.orientation = medium.orientation;
+					}
+				}
+			}
+			m_atlasMask |= 1u << l;
+			bytes += layerBytes;
+			Log(EInfo, "Layer %i: %ix%i parameter atlas (%i textures)", l + 1,
+				atlas.width, atlas.height, (int) textures.size());
+		}
 
-		Float z_bot = std::floor(z);
-		Float z_top = z_bot + 1;
+		if (m_atlasMask)
+			Log(EInfo, "Parameter atlases use %s", memString(bytes).c_str());
+	}
 
-		if ((z_top > 0 && isUp) || (z_bot < -(m_nbLayers - 1) && !isUp))
-			return false;
+	/**
+	 * Check that \c texture repeats with period 1 in u and v by comparing a
+	 * few lookups against their shifted copies. Mitsuba's textures do not
+	 * expose their wrap mode, and a clamped or mirrored bitmap differs from
+	 * its shifted copy as soon as it is not constant along the borders.
+	 */
+	static bool isPeriodic(const Texture2D *texture) {
+		const int probes = 5;
+		for (int y = 0; y < probes; ++y) {
+			for (int x = 0; x < probes; ++x) {
+				Point2 uv((x + Float(0.37)) / probes, (y + Float(0.61)) / probes);
+				Spectrum value = texture->eval(uv);
+				Spectrum shifted[2] = {
+					texture->eval(Point2(uv.x + 1, uv.y)),
+					texture->eval(Point2(uv.x, uv.y - 1))
+				};
+				Float tolerance = 1e-3f * std::max((Float) 1, value.max());
+				for (int i = 0; i < 2; ++i)
+					if ((shifted[i] - value).abs().max() > tolerance)
+						return false;
+			}
+		}
+		return true;
+	}
 
-		its.p.z = isUp ? z_top : z_bot;
-		if (its.p.z > Epsilon || its.p.z < -(m_nbLayers - 1) - Epsilon) {
-			cout << "[GY]: Warning in rayIntersect()" << endl;
-			return false;
+	/**
+	 * Frame and (if \c medium is not NULL) medium of layer \c l at \c uv,
+	 * bilinearly interpolated from the layer's atlas with wrap-around
+	 * addressing. The interpolated normal and orientation are renormalised.
+	 */
+	void evalAtlas(int l, const Point2 &uv, Frame &frame, SlabMedium *medium) const {
+		const LayerAtlas &atlas = m_atlas[l];
+		Float x = uv.x * atlas.width - Float(0.5), y = uv.y * atlas.height - Float(0.5);
+		int x0 = math::floorToInt(x), y0 = math::floorToInt(y);
+		Float fx = x - x0, fy = y - y0;
+		int xs[2] = { math::modulo(x0, atlas.width), math::modulo(x0 + 1, atlas.width) };
+		int ys[2] = { math::modulo(y0, atlas.height), math::modulo(y0 + 1, atlas.height) };
+		Float wx[2] = { 1 - fx, fx }, wy[2] = { 1 - fy, fy };
+
+		Normal normal(0.0f);
+		Vector orientation(0.0f);
+		Spectrum sigmaT(0.0f), albedo(0.0f);
+		Float density = 0;
+		for (int j = 0; j < 2; ++j) {
+			for (int i = 0; i < 2; ++i) {
+				const AtlasTexel &texel = atlas.texels[(size_t) ys[j] * atlas.width + xs[i]];
+				Float weight = wx[i] * wy[j];
+				normal += texel.normal * weight;
+				if (medium) {
+					orientation += texel.orientation * weight;
+					sigmaT += texel.sigmaT * weight;
+					albedo += texel.albedo * weight;
+					density += texel.density * weight;
+				}
+			}
 		}
 
-		its.p.x = ray.o.x + ray.d.x * ((its.p.z - ray.o.z) / ray.d.z);
-		its.p.y = ray.o.y + ray.d.y * ((its.p.z - ray.o.z) / ray.d.z);
-		its.t = (its.p - ray.o).length();
+		frame = Frame(normalize(normal));
+		if (!medium)
+			return;
+		medium->aniso = hasFlag(m_flag_aniso, l);
+		medium->phase = m_phaseFunctions[l].get();
+		medium->sigmaT = sigmaT;
+		medium->albedo = albedo;
+		medium->density = density;
+		medium->orientation = medium->aniso ? normalize(orientation) : Vector(0.0, 0.0, 1.0);
+	}
 
-		// 
-		int curLayer = -math::roundToInt(its.p.z);
-		if ((flag_type && curLayer == 0) || (!flag_type && curLayer == (m_nbLayers-1))) {
-			isEmitter = true;
+	template <int N, bool Textured>
+	void setParameters(const BSDFSamplingRecord &_bRec, LayerParams &params) const {
+		const int nbLayers = layerCount<N>();
+		params.bsdf = this;
+		params.base = NULL;
+		params.uv = _bRec.its.uv;
+
+		if (!Textured) {
+			/* Spatially constant parameters were resolved in configure() */
+			params.frames = m_constFrames;
+			params.mediums = m_constMediums;
+			params.frameMask = params.mediumMask = ~0u;
+			return;
 		}
 
-		return true;
+		/* Looked up on demand by LayerParams::frame() and medium() */
+		params.frames.resize(nbLayers);
+		params.mediums.resize(nbLayers - 1);
+		params.frameMask = params.mediumMask = 0;
+		textureLookups.incrementBase();
+	}
 
+	/// Purely absorbing view of the layer media, used by the "bidirStochTRT" pdf
+	void setParametersPdf(const LayerParams &params, LayerParams &pdfParams) const {
+		pdfParams.bsdf = this;
+		pdfParams.base = &params;
+		pdfParams.uv = params.uv;
+		pdfParams.mediums.resize(params.mediums.size());
+		pdfParams.frameMask = pdfParams.mediumMask = 0;
 	}
 
+	/**
+	 * \brief Depth-only walker through the stack
+	 *
+	 * Interface \c k lies at z = -k and medium layer \c l fills the slab
+	 * -(l+1) < z < -l. Since the layers are infinite and flat, a segment is
+	 * fully described by its starting depth, its direction and the layer it
+	 * crosses: the interface it reaches and its length follow in closed form,
+	 * without building rays or intersection records.
+	 */
+	struct SlabWalker {
+		Float z;          ///< Depth of the segment origin
+		Vector d;         ///< Direction of the segment
+		int layer;        ///< Medium layer crossed by the segment
+		int interface;    ///< Interface at the end of the segment (-1: leaves the stack)
+		Float t;          ///< Length of the segment
+
+		/// Start a segment at depth \c z0 inside \c layer0; false if it reaches no interface
+		inline bool trace(Float z0, const Vector &d0, int layer0, int nbLayers) {
+			z = z0;
+			d = d0;
+			layer = layer0;
+			if (layer < 0 || layer > nbLayers - 2 || std::abs(d.z) < Epsilon) {
+				interface = -1;
+				t = std::numeric_limits<Float>::infinity();
+				return false;
+			}
+			interface = d.z > 0 ? layer : layer + 1;
+			t = std::max((-interface - z) / d.z, (Float) 0);
+			return true;
+		}
+
+		/// Start a segment leaving interface \c k along \c d0
+		inline bool leave(int k, const Vector &d0, int nbLayers) {
+			return trace((Float) -k, d0, d0.z > 0 ? k - 1 : k, nbLayers);
+		}
+	};
+
 	Spectrum sampleRefraction(const BSDFSamplingRecord &_bRec, const BSDF *bsdf, const Frame &frame,
 		const Vector &wo_query, Vector &wo_refract, Float &pdf_refract, Float &pdf_refract_re) const {
 
@@ -470,8 +882,9 @@ public:
 		return weight;
 	}
 
+	/// One vertex of a sub-path, as assembled by generatePath()
 	struct PathInfo {
-		Point p;
+		Float z;
 		Vector wi, wo;
 		int topCounter, bottomCounter;
 		bool surf;
@@ -481,12 +894,106 @@ public:
 		Float pSurvival;
 	};
 
-	static void printPath(const std::vector<PathInfo> &paths) {
-		for (const auto &path : paths) {
-			cout << path.p.toString() << ' ' << path.wi.toString() << ' ' << path.wo.toString() << '\n'
-				 << path.surf << ' ' << path.layerID << '\n'
-				 << path.thru0.toString() << ' ' << path.thru1.toString() << '\n'
-				 << path.vpdf.toString() << ' ' << path.epdf.toString() << "\n==========" << endl;
+	/**
+	 * \brief A sub-path together with its bidirectional MIS ratios
+	 *
+	 * The vertices are stored as a structure of arrays. bidirEvaluation()
+	 * visits every pair of vertices but rejects most of them by their depth
+	 * alone (see \ref connectionPrepass()), so the depths are contiguous and
+	 * the other fields are only read for the pairs that actually connect.
+	 */
+	struct SubPath {
+		/* Connection data */
+		std::vector<Float> z;
+		std::vector<int> layerID;
+		std::vector<uint8_t> surf;
+		std::vector<Vector> wi, wo;
+		std::vector<Vector2> vpdf, epdf;
+		std::vector<Float> pSurvival;
+
+		/* Throughputs, only read for connected pairs */
+		std::vector<Spectrum> thru0, thru1;
+
+		/* Interface crossing counts, only read by unidirEvaluation() */
+		std::vector<int> topCounter, bottomCounter;
+
+		std::vector<Float> ratio, ratioPdf;
+
+		/// The first vertex was restricted to transmission (see "analyticTop")
+		bool entered;
+
+		inline SubPath() : entered(false) { }
+
+		inline size_t size() const { return z.size(); }
+		inline bool empty() const { return z.empty(); }
+
+		inline void append(const PathInfo &v) {
+			z.push_back(v.z);
+			layerID.push_back(v.layerID);
+			surf.push_back(v.surf);
+			wi.push_back(v.wi);
+			wo.push_back(v.wo);
+			vpdf.push_back(v.vpdf);
+			epdf.push_back(v.epdf);
+			pSurvival.push_back(v.pSurvival);
+			thru0.push_back(v.thru0);
+			thru1.push_back(v.thru1);
+			topCounter.push_back(v.topCounter);
+			bottomCounter.push_back(v.bottomCounter);
+		}
+
+		inline void clear() {
+			z.clear(); layerID.clear(); surf.clear();
+			wi.clear(); wo.clear();
+			vpdf.clear(); epdf.clear(); pSurvival.clear();
+			thru0.clear(); thru1.clear();
+			topCounter.clear(); bottomCounter.clear();
+			ratio.clear();
+			ratioPdf.clear();
+			entered = false;
+		}
+	};
+
+	/// A vertex pair (i, j) of bidirEvaluation() and the medium layer connecting it
+	struct ConnectPair {
+		uint32_t i, j;
+		int medium;
+		Float weight;   ///< Inverse expected number of times the pair is evaluated
+
+		inline ConnectPair(uint32_t i, uint32_t j, int medium, Float weight = 1.0f)
+			: i(i), j(j), medium(medium), weight(weight) { }
+	};
+
+	/**
+	 * Per-thread working memory of a query. The buffers are cleared (but not
+	 * released) at the beginning of every query, so that their capacity is
+	 * reused and a steady-state eval/sample/pdf call does not touch the heap.
+	 */
+	struct Scratch {
+		LayerParams params, pdfParams;
+
+		SubPath forward, backward;               // value estimators
+		SubPath pdfForward, pdfSample, pdfEval;  // stochastic pdf estimators
+
+		std::vector<int> connectMedium;          // bidirEvaluation()
+		std::vector<ConnectPair> connectPairs;
+		std::vector<uint32_t> mediumVertices, mediumVerticesStart;
+
+		std::vector<int> trtWiID, trtWoID;       // pdfTRT()
+		std::vector<Vector> trtWi, trtWo;
+		std::vector<Float> trtRatio;
+	};
+
+	inline Scratch &getScratch() const {
+		return m_scratch.get();
+	}
+
+	static void printPath(const SubPath &path) {
+		for (size_t i = 0; i < path.size(); ++i) {
+			cout << path.z[i] << ' ' << path.wi[i].toString() << ' ' << path.wo[i].toString() << '\n'
+				 << (int) path.surf[i] << ' ' << path.layerID[i] << '\n'
+				 << path.thru0[i].toString() << ' ' << path.thru1[i].toString() << '\n'
+				 << path.vpdf[i].toString() << ' ' << path.epdf[i].toString() << "\n==========" << endl;
 		}
 	}
 
@@ -496,49 +1003,73 @@ public:
 		cout << endl;
 	}
 
+	/**
+	 * Random walk from _bRec.wi through the stack. With \c flag_enter, the
+	 * first interface event only samples transmission, so that the walk
+	 * estimates the light entering the stack alone; the reflection off the
+	 * outer interface is then left to the closed-form term of the evaluation.
+	 * Russian roulette (\c flag_roulette) only applies to walks whose
+	 * throughput is used: the pdf estimators read the vertex pdfs alone and
+	 * would lose the vertices of killed walks without any reweighting.
+	 */
+	template <int N>
 	Spectrum generatePath(BSDFSamplingRecord &_bRec,
-		const std::vector<Frame> &frames, const ref_vector<Medium> &mediums, const int maxDepth,
-		std::vector<PathInfo> &path, std::vector<Float> &ratio, std::vector<Float> &ratioPdf, bool flag_backward, bool flag_bidir) const {
+		const LayerParams &params, const int maxDepth,
+		SubPath &subPath, bool flag_backward, bool flag_bidir, bool flag_enter = false,
+		bool flag_roulette = true) const {
+		const int nbLayers = layerCount<N>();
 
 		Assert(_bRec.sampler);
 		Sampler *sampler = _bRec.sampler;
 
+		subPath.clear();
+		subPath.entered = flag_enter;
+		std::vector<Float> &ratio = subPath.ratio;
+		std::vector<Float> &ratioPdf = subPath.ratioPdf;
+
 		// Path tracing
 		bool flag_incidentDir = _bRec.wi.z > 0;
 
-		Point originPoint = flag_incidentDir ? Point(0.0, 0.0, 0.0) : Point(0.0, 0.0, Float(1-m_nbLayers));
-		Ray ray(originPoint + _bRec.wi, -_bRec.wi, 0.0);
+		// The walk enters through the outer interface facing the incident direction
+		SlabWalker walker;
+		walker.d = -_bRec.wi;
+		walker.interface = flag_incidentDir ? 0 : nbLayers - 1;
+		walker.layer = -1;
+		walker.z = (Float) -walker.interface;
+		walker.t = 0;
 
 		bool flag_medium = false;
-		Intersection its;
 		MediumSamplingRecord mRec;
 
-		rayIntersect(ray, its);
 		Spectrum throughput(1.0);
 
 		int topCounter = 0;
 		int bottomCounter = 0;
+		int nbMediumEvents = 0;
 		int depth = 0;
 		int curLayer;
 		while (depth < maxDepth || maxDepth < 0) {
 			PathInfo path_this;
 
-			curLayer = -math::ceilToInt(ray(Epsilon).z);
-			if (curLayer > m_nbLayers - 2) --curLayer;
-			if (flag_medium && mediums[curLayer]->sampleDistance(Ray(ray, 0, its.t), mRec, sampler)) {
-				if (mRec.p.z > Epsilon || mRec.p.z < -(m_nbLayers - 1)-Epsilon)
-					cout << "[GY]: Warning in BSDF::multilayeredBSDF::generatePath()" << endl;
+			curLayer = walker.layer;
+			if (flag_medium && (curLayer < 0 || curLayer > nbLayers - 2)) {
+				reportAnomaly(EInvalidLayer);
+				throughput = Spectrum(0.0);
+				break;
+			}
 
-				if (curLayer < 0 || curLayer > m_nbLayers - 2)
-					cout << "[GY]: Warning in BSDF::multilayeredBSDF::generatePath()" << endl;
+			if (flag_medium && params.medium(curLayer).sampleDistance(walker.d, walker.t, mRec, sampler)) {
+				const Float z = walker.z + mRec.t * walker.d.z;
+				if (z > Epsilon || z < -(nbLayers - 1)-Epsilon)
+					reportAnomaly(EOutOfSlabVertex);
 
-				const Medium* medium = mediums[curLayer].get();
+				const SlabMedium *medium = &params.medium(curLayer);
 				const PhaseFunction* phase = medium->getPhaseFunction();
 
 				path_this.layerID = curLayer;
 				path_this.surf = false;
-				path_this.p = mRec.p;
-				path_this.wi = -ray.d;
+				path_this.z = z;
+				path_this.wi = -walker.d;
 				path_this.topCounter = 0;
 				path_this.bottomCounter = 0;
 
@@ -559,15 +1090,21 @@ public:
 					path_this.pSurvival = pSurvival = 1.0;
 				}
 
-				path_this.epdf[0] = mRec.pdfSuccess / std::abs(ray.d.z);
+				if (flag_roulette && !russianRoulette((int) subPath.size(), throughput, sampler)) {
+					throughput = Spectrum(0.0);
+					break;
+				}
+				path_this.thru0 = throughput;
+
+				path_this.epdf[0] = mRec.pdfSuccess / std::abs(walker.d.z);
 				if (path_this.epdf[0] < Epsilon) {
 					throughput = Spectrum(0.0);
 					break;					
 				}
 
-				path_this.epdf[1] = path.back().surf ? mRec.pdfFailure : mRec.pdfSuccessRev / std::abs(ray.d.z);
+				path_this.epdf[1] = subPath.surf.back() ? mRec.pdfFailure : mRec.pdfSuccessRev / std::abs(walker.d.z);
 
-				PhaseFunctionSamplingRecord pRec(mRec, -ray.d);
+				PhaseFunctionSamplingRecord pRec(mRec, -walker.d);
 				Float phaseVal = phase->sample(pRec, sampler);
 				if (std::abs(phaseVal) < Epsilon) {
 					throughput = Spectrum(0.0);
@@ -589,13 +1126,11 @@ public:
 				path_this.vpdf[1] = phase->pdf(pRec_reverse);
 				path_this.vpdf *= pSurvival;
 
-				// Trace a ray
-				ray = Ray(path_this.p, path_this.wo, 0.0);
-				ray.mint = 0.0;
-
-				path.push_back(path_this);
+				subPath.append(path_this);
+				++nbMediumEvents;
 
-				if (!rayIntersect(ray, its)) {
+				// Trace to the next interface
+				if (!walker.trace(path_this.z, path_this.wo, curLayer, nbLayers)) {
 					throughput = Spectrum(0.0);
 					break;
 				}
@@ -610,32 +1145,35 @@ public:
 						break;					
 					}
 
-					path_this.epdf[1] = path.back().surf ? mRec.pdfFailure : mRec.pdfSuccessRev / std::abs(ray.d.z);
+					path_this.epdf[1] = subPath.surf.back() ? mRec.pdfFailure : mRec.pdfSuccessRev / std::abs(walker.d.z);
 				}
 
-				if (!its.isValid()) {
+				if (walker.interface < 0) {
 					break;
 				}
 			
-				curLayer = -math::roundToInt(its.p.z);
+				curLayer = walker.interface;
 				
 				if (curLayer == 0) {
 					++topCounter;
 				}
-				else if (curLayer == (m_nbLayers - 1)) {
+				else if (curLayer == (nbLayers - 1)) {
 					++bottomCounter;
 				}
 				else
 					;
 			
-				if (curLayer >= m_nbLayers)
-					cout << "[GY]: Warning that current layer exceed max layers" << endl;
+				if (curLayer >= nbLayers) {
+					reportAnomaly(EInvalidLayer);
+					throughput = Spectrum(0.0);
+					break;
+				}
 
 				const BSDF *bsdf = m_bsdfs[curLayer].get();
-				const Frame frame = frames[curLayer];
+				const Frame frame = params.frame(curLayer);
 
-				path_this.p = its.p;
-				path_this.wi = its.wi;
+				path_this.z = (Float) -curLayer;
+				path_this.wi = -walker.d;
 				path_this.topCounter = topCounter;
 				path_this.bottomCounter = bottomCounter;
 
@@ -655,9 +1193,16 @@ public:
 				else
 					path_this.pSurvival = 1.0f;
 
+				if (flag_roulette && !russianRoulette((int) subPath.size(), throughput, sampler)) {
+					throughput = Spectrum(0.0);
+					break;
+				}
+
 				BSDFSamplingRecord bRec(_bRec);
 				bRec.mode = EImportance;
 				bRec.wi = frame.toLocal(path_this.wi);
+				if (flag_enter && depth == 0)
+					bRec.typeMask = BSDF::ETransmission;
 				Spectrum bsdfVal = bsdf->sample(bRec, sampler->next2D());
 				if (bsdfVal.isZero()) {
 					throughput = Spectrum(0.0);
@@ -693,18 +1238,18 @@ public:
 					throughput = Spectrum(0.0);
 					break;					
 				}
+				/* Walks leaving the stack here are never restricted */
 				BSDFSamplingRecord bRec_reverse(bRec);
 				bRec_reverse.reverse();
+				bRec_reverse.typeMask = _bRec.typeMask;
 				path_this.vpdf[1] = bsdf->pdf(bRec_reverse);
 
-				if ((curLayer == 0 || curLayer == (m_nbLayers-1)) && (path_this.wi.z * path_this.wo.z < 0)) {
+				if ((curLayer == 0 || curLayer == (nbLayers-1)) && (path_this.wi.z * path_this.wo.z < 0)) {
 					flag_medium = !flag_medium;
 				}
-				ray = Ray(path_this.p, path_this.wo, 0.0);
+				subPath.append(path_this);
 
-				path.push_back(path_this);
-
-				if (!rayIntersect(ray, its)) {
+				if (!walker.leave(curLayer, path_this.wo, nbLayers)) {
 					if (flag_medium) {
 						throughput = Spectrum(0.0);
 						break;
@@ -714,42 +1259,60 @@ public:
 			}
 			depth++;
 		}
-		_bRec.wo = ray.d;
+		_bRec.wo = walker.d;
+
+		if (throughput.isNaN()) {
+			reportAnomaly(ENaNThroughput);
+			throughput = Spectrum(0.0);
+		}
+
+		avgWalkDepth.incrementBase();
+		avgWalkDepth += subPath.size();
+		maxWalkDepth.recordMaximum(subPath.size());
+		topCrossings.incrementBase();
+		topCrossings += topCounter;
+		bottomCrossings.incrementBase();
+		bottomCrossings += bottomCounter;
+		mediumEvents.incrementBase(subPath.size());
+		mediumEvents += nbMediumEvents;
+		zeroThroughputWalks.incrementBase();
+		if (throughput.isZero())
+			++zeroThroughputWalks;
 
 		if (_bRec.wi.z * _bRec.wo.z >= 0)
 			_bRec.eta = 1.0;
 		else
 			_bRec.eta = _bRec.wo.z < 0 ? m_eta : m_invEta;
 
-		ratio.resize(path.size());
-		ratioPdf.resize(path.size());
-		if (flag_bidir && !path.empty()) {
+		ratio.resize(subPath.size());
+		ratioPdf.resize(subPath.size());
+		if (flag_bidir && !subPath.empty()) {
 			ratio[0] = 0.0;
-			ratioPdf[0] = path[0].vpdf[1] / path[0].vpdf[0];
-			for (size_t i = 1; i < path.size(); ++i) {
-				Float r = Float(1.0) / path[i].vpdf[1] + Float(1.0) / path[i - 1].vpdf[0];
-				Float r1 = path[i].vpdf[1] / path[i].vpdf[0];
+			ratioPdf[0] = subPath.vpdf[0][1] / subPath.vpdf[0][0];
+			for (size_t i = 1; i < subPath.size(); ++i) {
+				Float r = Float(1.0) / subPath.vpdf[i][1] + Float(1.0) / subPath.vpdf[i - 1][0];
+				Float r1 = subPath.vpdf[i][1] / subPath.vpdf[i][0];
 
-				ratio[i] = r1 * (r + path[i].epdf[1] * ratio[i - 1]) / path[i].epdf[0];
-				ratioPdf[i] = ratioPdf[i - 1] * (path[i].vpdf[1] / path[i].vpdf[0]) *(path[i].epdf[1] / path[i].epdf[0]);
+				ratio[i] = r1 * (r + subPath.epdf[i][1] * ratio[i - 1]) / subPath.epdf[i][0];
+				ratioPdf[i] = ratioPdf[i - 1] * (subPath.vpdf[i][1] / subPath.vpdf[i][0]) *(subPath.epdf[i][1] / subPath.epdf[i][0]);
 			}
 		}
 
 		return throughput;
 	}
 
+	template <int N>
 	void unidirEvaluation(const BSDFSamplingRecord &_bRec,
-		const std::vector<Frame> &frames, const ref_vector<Medium> &mediums,
-		const std::vector<PathInfo> &path, const int mode, Spectrum &_val, Float &_pdf) const {
-		
-		Assert(_bRec.sampler);
-		Sampler *sampler = _bRec.sampler;
+		const LayerParams &params,
+		const SubPath &path, const int mode, Spectrum &_val, Float &_pdf) const {
+		const int nbLayers = layerCount<N>();
 
 		bool flag_type = _bRec.wi.z * _bRec.wo.z > 0; // 1:reflection  0:transmission
 		bool flag_incidentDir = Frame::cosTheta(_bRec.wi) > 0;
 		bool flag_neeDir = (flag_incidentDir && flag_type) || (!flag_incidentDir && !flag_type); // 1. go out from top  0: go out from bottom
+		const int exitInterface = flag_neeDir ? 0 : nbLayers - 1;
 
-		Intersection its;
+		SlabWalker walker;
 		MediumSamplingRecord mRec;
 		Spectrum Li(0.0);
 		Float pdf = 0.0;
@@ -767,52 +1330,44 @@ public:
 		if (mode == 2) depth = m_stochPdfDepth < 0 ? path.size() : std::min(path.size(), size_t(m_stochPdfDepth));
 
 		for (size_t i = 0; i < depth; ++i) {
-			//cout << path[i].p.z << "|" << path[i].wi.z << "|" << path[i].wo.z << "|" << path[i].surf << "|" << path[i].layerID << endl;
-			if (!path[i].surf) {// medium
-				if ((flag_neeDir && path[i].layerID == 0) || (!flag_neeDir && path[i].layerID == (m_nbLayers-2))) {
-					curLayer = -math::ceilToInt(path[i].p.z);
-					int curLayerTest = path[i].layerID;
-					if (curLayer != curLayerTest) {
-						cout << "[GY]: Warning curLayer not match" << endl;
-						curLayer = curLayerTest;
-					}
+			//cout << path.z[i] << "|" << path.wi[i].z << "|" << path.wo[i].z << "|" << path.surf[i] << "|" << path.layerID[i] << endl;
+			if (!path.surf[i]) {// medium
+				if ((flag_neeDir && path.layerID[i] == 0) || (!flag_neeDir && path.layerID[i] == (nbLayers-2))) {
+					curLayer = path.layerID[i];
 
-					const Medium *medium = mediums[curLayer].get();
+					const SlabMedium *medium = &params.medium(curLayer);
 					const PhaseFunction *phase = medium->getPhaseFunction();
 					
 					// Direct
 					Vector wo_refract;
 					Float refractPdf, refractPdf_re;
 
-					const BSDF *bsdf_nee = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[m_nbLayers - 1].get();
-					const Frame frame_nee = flag_neeDir ? frames[0] : frames[m_nbLayers - 1];
+					const BSDF *bsdf_nee = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[nbLayers - 1].get();
+					const Frame frame_nee = flag_neeDir ? params.frame(0) : params.frame(nbLayers - 1);
 
 					Spectrum throughput_refract = sampleRefraction(_bRec, bsdf_nee, frame_nee,
 						_bRec.wo, wo_refract, refractPdf, refractPdf_re);
 
 					if (!throughput_refract.isZero()) {
-						Intersection its_nee;
-						Ray ray_nee = Ray(path[i].p, -wo_refract, 0.0);
-						ray_nee.mint = 0.0;
-						if (!rayIntersect(ray_nee, its_nee)) {
+						if (!walker.trace(path.z[i], -wo_refract, curLayer, nbLayers)) {
 							break;
 						}
 						Spectrum value(0.0);
-						if (mode == 1) value = medium->evalTransmittance(Ray(ray_nee, 0.0, its_nee.t), sampler);
-						medium->eval(Ray(its_nee.p, wo_refract, 0.0, its_nee.t, 0.0), mRec);
+						if (mode == 1) value = medium->evalTransmittance(-wo_refract, walker.t);
+						medium->eval(wo_refract, walker.t, mRec);
 
 						if (!value.isZero()) {
-							PhaseFunctionSamplingRecord pRec(mRec, path[i].wi, -wo_refract);
+							PhaseFunctionSamplingRecord pRec(mRec, path.wi[i], -wo_refract);
 							Float phaseVal;
 							if (mode == 1) phaseVal = phase->eval(pRec);
 							const Float phasePdf = phase->pdf(pRec);
 							const Float weight = miWeight(refractPdf, phasePdf);
 							if (m_MISenable) {
-								if (mode == 1) Li += path[i].thru0 * phaseVal * value * throughput_refract * weight;
+								if (mode == 1) Li += path.thru0[i] * phaseVal * value * throughput_refract * weight;
 								if (mode == 2) pdf += phasePdf * mRec.pdfFailure * refractPdf_re / refractPdf * weight;
 							}
 							else {
-								if (mode == 1) Li += path[i].thru0 * phaseVal * value * throughput_refract;
+								if (mode == 1) Li += path.thru0[i] * phaseVal * value * throughput_refract;
 								if (mode == 2) pdf += phasePdf * mRec.pdfFailure * refractPdf_re / refractPdf;
 							}
 						}
@@ -821,29 +1376,26 @@ public:
 					// Indirect
 					if (m_MISenable) {
 
-						Ray ray = Ray(path[i].p, path[i].wo, 0.0);
-						ray.mint = 0.0;
-						bool isEmitter = false;
-						if (!rayIntersectAndLookForEmitter(ray, its, flag_neeDir, isEmitter)) {
+						if (!walker.trace(path.z[i], path.wo[i], curLayer, nbLayers)) {
 							//cout << "[GY]: Warning in layeredBSDF::evaluatePdf4" << endl;
 							break;
 						}
 
-						if (isEmitter) {
-							const BSDF *bsdf = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[m_nbLayers - 1].get();
-							const Frame frame = flag_neeDir ? frames[0] : frames[m_nbLayers-1];
+						if (walker.interface == exitInterface) {
+							const BSDF *bsdf = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[nbLayers - 1].get();
+							const Frame frame = flag_neeDir ? params.frame(0) : params.frame(nbLayers-1);
 
 							Spectrum refractVal = evaluateRefraction(_bRec, bsdf, frame,
-								_bRec.wo, its.wi, refractPdf, refractPdf_re);
+								_bRec.wo, -walker.d, refractPdf, refractPdf_re);
 
 							if (!refractVal.isZero()) {
 								Spectrum value;
-								if (mode == 1) value = medium->evalTransmittance(Ray(ray, 0.0, its.t), sampler);
-								medium->eval(Ray(ray.o, ray.d, 0.0, its.t, 0.0), mRec);
+								if (mode == 1) value = medium->evalTransmittance(walker.d, walker.t);
+								medium->eval(walker.d, walker.t, mRec);
 
-								const Float weight = miWeight(path[i].vpdf[0], refractPdf);
+								const Float weight = miWeight(path.vpdf[i][0], refractPdf);
 
-								if (mode == 1) Li += path[i].thru1 * value * refractVal * weight;
+								if (mode == 1) Li += path.thru1[i] * value * refractVal * weight;
 								if (mode == 2) pdf += refractPdf_re * mRec.pdfFailure * weight;
 							}
 						}
@@ -851,62 +1403,60 @@ public:
 				}
 			}
 			else {// surface	
-				curLayer = path[i].layerID;
+				curLayer = path.layerID[i];
 				const BSDF *bsdf = m_bsdfs[curLayer].get();
-				const Frame frame = frames[curLayer];
+				const Frame frame = params.frame(curLayer);
 
 				// Direct
-				if ((flag_incidentDir && flag_type && curLayer == 0 && path[i].topCounter == 1) ||
-					(!flag_incidentDir && flag_type && curLayer == (m_nbLayers - 1) && path[i].bottomCounter == 1)) {
+				if ((flag_incidentDir && flag_type && curLayer == 0 && path.topCounter[i] == 1) ||
+					(!flag_incidentDir && flag_type && curLayer == (nbLayers - 1) && path.bottomCounter[i] == 1)) {
 
 					BSDFSamplingRecord bRec(_bRec);
-					bRec.wi = frame.toLocal(path[i].wi);
+					bRec.wi = frame.toLocal(path.wi[i]);
 					bRec.wo = frame.toLocal(_bRec.wo);
-					if (mode == 1) Li += path[i].thru0 * bsdf->eval(bRec);
+					if (mode == 1) Li += path.thru0[i] * bsdf->eval(bRec);
 					if (mode == 2) pdf += bsdf->pdf(bRec);
 				}
 
 				if ((flag_incidentDir && flag_type && curLayer == 1) ||
-					(flag_incidentDir && !flag_type && curLayer == (m_nbLayers - 2)) ||
-					(!flag_incidentDir && flag_type && curLayer == (m_nbLayers - 2)) ||
+					(flag_incidentDir && !flag_type && curLayer == (nbLayers - 2)) ||
+					(!flag_incidentDir && flag_type && curLayer == (nbLayers - 2)) ||
 					(!flag_incidentDir && !flag_type && curLayer == 1)) {
 
 					Vector wo_refract;
 					Float refractPdf, refractPdf_re;
 
-					const BSDF *bsdf_nee = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[m_nbLayers - 1].get();
-					const Frame frame_nee = flag_neeDir ? frames[0] : frames[m_nbLayers - 1];
-					const Medium *medium = flag_neeDir ? mediums[0].get() : mediums[m_nbLayers - 2].get();
+					const BSDF *bsdf_nee = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[nbLayers - 1].get();
+					const Frame frame_nee = flag_neeDir ? params.frame(0) : params.frame(nbLayers - 1);
+					const SlabMedium *medium = flag_neeDir ? &params.medium(0) : &params.medium(nbLayers - 2);
 					
 					Spectrum throughput_refract = sampleRefraction(_bRec, bsdf_nee, frame_nee,
 						_bRec.wo, wo_refract, refractPdf, refractPdf_re);
 
 					if (!throughput_refract.isZero()) {
-						Intersection its_nee;
-						Ray ray_nee = Ray(path[i].p, -wo_refract, 0.0);
-						if (!rayIntersect(ray_nee, its_nee)) {
-							cout << "[GY]: Warning in layeredBSDF::evaluatePdf6" << endl;
+						if (!walker.leave(curLayer, -wo_refract, nbLayers)) {
+							reportAnomaly(EDegenerateSegment);
 							break;
 						}
 						Spectrum value(0.0);
-						if (mode == 1) value = medium->evalTransmittance(Ray(ray_nee, 0.0, its_nee.t), sampler);
-						if (mode == 2) medium->eval(Ray(its_nee.p, wo_refract, 0.0, its_nee.t, 0.0), mRec);
+						if (mode == 1) value = medium->evalTransmittance(-wo_refract, walker.t);
+						if (mode == 2) medium->eval(wo_refract, walker.t, mRec);
 
 						if (!value.isZero()) {
 							BSDFSamplingRecord bRec(_bRec);
 							bRec.mode = EImportance;
-							bRec.wi = frame.toLocal(path[i].wi);
+							bRec.wi = frame.toLocal(path.wi[i]);
 							bRec.wo = frame.toLocal(-wo_refract);
 							Spectrum bsdfVal;
 							if (mode == 1) bsdfVal = bsdf->eval(bRec);
 							const Float bsdfPdf = bsdf->pdf(bRec);
 							const Float weight = miWeight(refractPdf, bsdfPdf);
 							if (m_MISenable) {
-								if (mode == 1) Li += path[i].thru0 * bsdfVal * value * throughput_refract * weight;
+								if (mode == 1) Li += path.thru0[i] * bsdfVal * value * throughput_refract * weight;
 								if (mode == 2) pdf += bsdfPdf * mRec.pdfFailure * refractPdf_re / refractPdf * weight;
 							}
 							else {
-								if (mode == 1) Li += path[i].thru0 * bsdfVal * value * throughput_refract;
+								if (mode == 1) Li += path.thru0[i] * bsdfVal * value * throughput_refract;
 								if (mode == 2) pdf += bsdfPdf * mRec.pdfFailure * refractPdf_re / refractPdf;
 							}
 						}
@@ -915,28 +1465,25 @@ public:
 					// Indirect
 					if (m_MISenable) {
 
-						Ray ray = Ray(path[i].p, path[i].wo, 0.0);
-
-						bool isEmitter = false;
-						if (!rayIntersectAndLookForEmitter(ray, its, flag_neeDir, isEmitter)) {
+						if (!walker.leave(curLayer, path.wo[i], nbLayers)) {
 							// cout << "[GY]: Warning in layeredBSDF::evaluatePdf8" << endl;
 							break;
 						}
 
-						if (isEmitter) {
-							const BSDF *bsdf = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[m_nbLayers - 1].get();
-							const Frame frame = flag_neeDir ? frames[0] : frames[m_nbLayers - 1];
+						if (walker.interface == exitInterface) {
+							const BSDF *bsdf = flag_neeDir ? m_bsdfs[0].get() : m_bsdfs[nbLayers - 1].get();
+							const Frame frame = flag_neeDir ? params.frame(0) : params.frame(nbLayers - 1);
 
 							Spectrum refractVal = evaluateRefraction(_bRec, bsdf, frame,
-								_bRec.wo, its.wi, refractPdf, refractPdf_re);
+								_bRec.wo, -walker.d, refractPdf, refractPdf_re);
 
 							if (!refractVal.isZero()) {
 								Spectrum value;
-								if (mode == 1) value = medium->evalTransmittance(Ray(ray, 0.0, its.t), sampler);
-								if (mode == 2) medium->eval(Ray(ray.o, ray.d, 0.0, its.t, 0.0), mRec);
+								if (mode == 1) value = medium->evalTransmittance(walker.d, walker.t);
+								if (mode == 2) medium->eval(walker.d, walker.t, mRec);
 
-								const Float weight = miWeight(path[i].vpdf[0], refractPdf);
-								if (mode == 1) Li += path[i].thru1 * value * refractVal * weight;
+								const Float weight = miWeight(path.vpdf[i][0], refractPdf);
+								if (mode == 1) Li += path.thru1[i] * value * refractVal * weight;
 								if (mode == 2) pdf += refractPdf_re * mRec.pdfFailure * weight;
 							}
 						}
@@ -945,6 +1492,11 @@ public:
 			}
 		}
 
+		if (mode == 1 && Li.isNaN()) {
+			reportAnomaly(ENaNThroughput);
+			Li = Spectrum(0.0);
+		}
+
 		if (mode == 1) {
 			_val = Li;
 			_pdf = 0.0;
@@ -955,14 +1507,86 @@ public:
 		}
 	}
 
+	/**
+	 * Connection prepass of \ref bidirEvaluation(): for a vertex at depth \c z1
+	 * of the left sub-path, store the medium layer through which it connects
+	 * to each of the \c count right vertices at depths \c z2, or -1 if the
+	 * pair cannot be connected. Only depths are compared, so the loop has no
+	 * branches and vectorizes over the contiguous depths of the right sub-path.
+	 */
+	static void connectionPrepass(Float z1, bool surf1, int layer1,
+		const Float *z2, size_t count, int *connectMedium) {
+		/* An interface vertex reaches the two adjacent media (but not itself),
+		   a medium vertex only reaches the interfaces of its own layer */
+		const Float lo = surf1 ? z1 - 1 - Epsilon : std::floor(z1) - Epsilon;
+		const Float hi = surf1 ? z1 + 1 + Epsilon : std::ceil(z1) + Epsilon;
+		const Float minDist = surf1 ? Epsilon : Float(-1);
+		const int layerAbove = surf1 ? layer1 - 1 : layer1;
+
+		for (size_t j = 0; j < count; ++j) {
+			const Float dz = z2[j] - z1;
+			/* Non-short-circuit '&' keeps the loop body free of branches */
+			const bool valid = (z2[j] > lo) & (z2[j] < hi) & (std::abs(dz) > minDist);
+			const int layer = dz >= 0 ? layerAbove : layer1;
+			connectMedium[j] = valid ? layer : -1;
+		}
+	}
+
+	/**
+	 * Media that a vertex can connect through: the layer of a medium vertex
+	 * (\c hi = -1), or the layers above (\c lo) and below (\c hi) an
+	 * interface vertex, where -1 marks the outside of the stack.
+	 */
+	static inline void adjacentMedia(bool surf, int layer, int nbMedia, int &lo, int &hi) {
+		lo = surf ? layer - 1 : layer;
+		hi = surf && layer < nbMedia ? layer : -1;
+	}
+
+	/**
+	 * Sort the first \c count vertices of \c path by the media they are
+	 * adjacent to (a counting sort, so linear in \c count). The vertices of
+	 * medium \c m are <tt>vertices[start[m] .. start[m+1])</tt>, in order.
+	 */
+	static void sortByMedium(const SubPath &path, size_t count, int nbMedia,
+		std::vector<uint32_t> &vertices, std::vector<uint32_t> &start) {
+		int lo, hi;
+		start.assign(nbMedia + 1, 0);
+		for (size_t j = 0; j < count; ++j) {
+			adjacentMedia(path.surf[j] != 0, path.layerID[j], nbMedia, lo, hi);
+			if (lo >= 0) ++start[lo + 1];
+			if (hi >= 0) ++start[hi + 1];
+		}
+		for (int m = 0; m < nbMedia; ++m)
+			start[m + 1] += start[m];
+		vertices.resize(start[nbMedia]);
+		for (size_t j = 0; j < count; ++j) {
+			adjacentMedia(path.surf[j] != 0, path.layerID[j], nbMedia, lo, hi);
+			if (lo >= 0) vertices[start[lo]++] = (uint32_t) j;
+			if (hi >= 0) vertices[start[hi]++] = (uint32_t) j;
+		}
+		/* The fill advanced every start to the end of its medium */
+		for (int m = nbMedia; m > 0; --m)
+			start[m] = start[m - 1];
+		start[0] = 0;
+	}
+
+	template <int N>
 	void bidirEvaluation(const BSDFSamplingRecord &_bRec,
-		const std::vector<Frame> &frames, const ref_vector<Medium> &mediums,
-		const std::vector<PathInfo> path_L, const std::vector<Float> ratio_L, const std::vector<Float> ratioPdf_L,
-		const std::vector<PathInfo> path_R, const std::vector<Float> ratio_R, const std::vector<Float> ratioPdf_R,
-		const int mode, Spectrum &_val, Float &_pdf) const {
+		const LayerParams &params,
+		const SubPath &subPath_L, const SubPath &subPath_R,
+		const int mode, Spectrum &_val, Float &_pdf,
+		const size_t len_L = std::numeric_limits<size_t>::max(),
+		const size_t len_R = std::numeric_limits<size_t>::max()) const {
+		const int nbLayers = layerCount<N>();
 
 		Assert(_bRec.sampler);
 
+		const SubPath &path_L = subPath_L;
+		const std::vector<Float> &ratio_L = subPath_L.ratio;
+		const SubPath &path_R = subPath_R;
+		const std::vector<Float> &ratio_R = subPath_R.ratio;
+		const std::vector<Float> &ratioPdf_R = subPath_R.ratioPdf;
+
 		// Bi-directional start
 		bool flag_type = _bRec.wi.z * _bRec.wo.z > 0; // 1:reflection  0:transmission
 		bool flag_incidentDir = _bRec.wi.z > 0; // 1: from top surface  0: from bottom surface
@@ -979,7 +1603,7 @@ public:
 		_val = Spectrum(0.0);
 		_pdf = 0.0;
 
-		const Frame frame_wo = _bRec.wo.z > 0 ? frames[0] : frames[m_nbLayers - 1];
+		const Frame frame_wo = _bRec.wo.z > 0 ? params.frame(0) : params.frame(nbLayers - 1);
 		if (_bRec.wo.z * frame_wo.toLocal(_bRec.wo).z <= 0) return;
 
 		Spectrum Li0(0.0);
@@ -990,209 +1614,267 @@ public:
 		if (flag_type) {
 			bRec.wo = frame_wo.toLocal(_bRec.wo);
 			bRec.wi = frame_wo.toLocal(_bRec.wi);
-			if (mode == 1) Li0 += flag_incidentDir ? m_bsdfs[0]->eval(bRec) : m_bsdfs[m_nbLayers - 1]->eval(bRec);
-			if (mode == 2) pdf0 += flag_incidentDir ? m_bsdfs[0]->pdf(bRec) : m_bsdfs[m_nbLayers - 1]->pdf(bRec);
+			if (mode == 1) Li0 += flag_incidentDir ? m_bsdfs[0]->eval(bRec) : m_bsdfs[nbLayers - 1]->eval(bRec);
+			if (mode == 2) pdf0 += flag_incidentDir ? m_bsdfs[0]->pdf(bRec) : m_bsdfs[nbLayers - 1]->pdf(bRec);
 		}
 
 		//if (!flag_type) {
 		//	cout << "PATHLLLLLLLLLLLL:" << endl;
 		//	for (size_t i = 0; i < path_L.size(); ++i)
-		//		cout << path_L[i].p.z << "|" << path_L[i].wi.z << "|" << path_L[i].wo.z << "|" << path_L[i].surf << "|" << path_L[i].layerID << endl;
+		//		cout << path_L.z[i] << "|" << path_L.wi[i].z << "|" << path_L.wo[i].z << "|" << path_L.surf[i] << "|" << path_L.layerID[i] << endl;
 		//	cout << "PATHRRRRRRRRRRRR:" << endl;
 		//	for (size_t i = 0; i < path_R.size(); ++i)
-		//		cout << path_R[i].p.z << "|" << path_R[i].wi.z << "|" << path_R[i].wo.z << "|" << path_R[i].surf << "|" << path_R[i].layerID << endl;
+		//		cout << path_R.z[i] << "|" << path_R.wi[i].z << "|" << path_R.wo[i].z << "|" << path_R.surf[i] << "|" << path_R.layerID[i] << endl;
 		//}
 
-		for (size_t i = 0; i < (mode == 1 || m_stochPdfDepth < 0 ? path_L.size() : std::min(path_L.size(), size_t(m_stochPdfDepth))); ++i) {
-			for (size_t j = 0; j < (mode == 1 || m_stochPdfDepth < 0 ? path_R.size() : std::min(size_t(m_stochPdfDepth) - i, path_R.size())); ++j) {
-	
-				bool validConnection = false;
-				int id_L = path_L[i].layerID;
-				int id_R = path_R[j].layerID;
-				int id_connectMedium;
-
-				Float z1 = path_L[i].p.z;
-				Float z2 = path_R[j].p.z;
-				if (path_L[i].surf) {
-					if (z2 > z1 - 1 - Epsilon && z2 < z1 + 1 + Epsilon && std::abs(z1 - z2) > Epsilon) {
-						validConnection = true;
-						if (z1 > z2)
-							id_connectMedium = id_L;
-						else
-							id_connectMedium = id_L - 1;
-					}
+		const size_t size_L = std::min(path_L.size(), len_L);
+		const size_t size_R = std::min(path_R.size(), len_R);
+		const size_t end_L = mode == 1 || m_stochPdfDepth < 0 ? size_L : std::min(size_L, size_t(m_stochPdfDepth));
+		Scratch &scratch = getScratch();
+		std::vector<ConnectPair> &pairs = scratch.connectPairs;
+		pairs.clear();
+
+		if (m_maxConnections > 0 && end_L * size_R > (size_t) m_maxConnections) {
+			/* Connection budget: draw maxConnections pairs directly instead of
+			   enumerating all of them. The left vertex i is uniform, the right
+			   vertex j uniform among the right vertices adjacent to a medium of
+			   i. Weighting every draw by 1 / (maxConnections * p(i, j)) keeps the
+			   estimate unbiased (Hansen-Hurwitz) at a cost that is linear in the
+			   sub-path lengths. Draws that cannot connect contribute nothing */
+			const int nbMedia = nbLayers - 1;
+			const std::vector<uint32_t> &vertices = scratch.mediumVertices;
+			const std::vector<uint32_t> &start = scratch.mediumVerticesStart;
+			sortByMedium(path_R, size_R, nbMedia, scratch.mediumVertices, scratch.mediumVerticesStart);
+
+			const size_t K = (size_t) m_maxConnections;
+			for (size_t k = 0; k < K; ++k) {
+				const size_t i = std::min((size_t) (_bRec.sampler->next1D() * end_L), end_L - 1);
+				const size_t end_R = mode == 1 || m_stochPdfDepth < 0 ? size_R : std::min(size_t(m_stochPdfDepth) - i, size_R);
+
+				/* Right vertices of each adjacent medium with j < end_R */
+				int lo, hi;
+				adjacentMedia(path_L.surf[i] != 0, path_L.layerID[i], nbMedia, lo, hi);
+				const uint32_t *first[2] = { NULL, NULL };
+				size_t count[2] = { 0, 0 };
+				const int media[2] = { lo, hi };
+				for (int side = 0; side < 2; ++side) {
+					if (media[side] < 0)
+						continue;
+					first[side] = &vertices[0] + start[media[side]];
+					count[side] = std::lower_bound(first[side], &vertices[0] + start[media[side] + 1],
+						(uint32_t) end_R) - first[side];
 				}
-				else {
-					if (z2 > std::floor(z1) - Epsilon && z2 < std::ceil(z1) + Epsilon) {
-						validConnection = true;
-						id_connectMedium = id_L;
-					}
+				const size_t candidates = count[0] + count[1];
+				if (candidates == 0)
+					continue;
+
+				const size_t u = std::min((size_t) (_bRec.sampler->next1D() * candidates), candidates - 1);
+				const uint32_t j = u < count[0] ? first[0][u] : first[1][u - count[0]];
+
+				int medium;
+				connectionPrepass(path_L.z[i], path_L.surf[i] != 0, path_L.layerID[i], &path_R.z[j], 1, &medium);
+				if (medium >= 0)
+					pairs.push_back(ConnectPair((uint32_t) i, j, medium, (Float) (end_L * candidates) / (Float) K));
+			}
+		}
+		else {
+			std::vector<int> &connectMedium = scratch.connectMedium;
+			connectMedium.resize(size_R);
+			for (size_t i = 0; i < end_L; ++i) {
+				const size_t end_R = mode == 1 || m_stochPdfDepth < 0 ? size_R : std::min(size_t(m_stochPdfDepth) - i, size_R);
+				if (end_R == 0)
+					continue;
+				connectionPrepass(path_L.z[i], path_L.surf[i] != 0, path_L.layerID[i], &path_R.z[0], end_R, &connectMedium[0]);
+				for (size_t j = 0; j < end_R; ++j) {
+					if (connectMedium[j] >= 0)
+						pairs.push_back(ConnectPair((uint32_t) i, (uint32_t) j, connectMedium[j]));
 				}
+			}
+		}
 
-				if (validConnection) {
-					Spectrum f(0.0), funcVal(0.0);
-					Float w, t, f_pdf;
-					Vector2 pdf_LL, pdf_RR;
-					Frame frame;
-
-					// sample from left
-					frame = frames[id_R];
-
-					if (!path_R[j].surf || (path_R[j].wi.z*frame.toLocal(path_R[j].wi).z > 0 && -path_L[i].wo.z*frame.toLocal(-path_L[i].wo).z > 0)) {
-						t = (path_R[j].p.z - path_L[i].p.z) / path_L[i].wo.z;
-						if (t > Epsilon) {
-							const Medium *medium = mediums[id_connectMedium].get();
-							medium->eval(Ray(Point(0.0, 0.0, path_L[i].p.z), path_L[i].wo, 0.0, t, 0.0), mRec);
-							mRec.pdfSuccess /= std::abs(path_L[i].wo.z);
-							mRec.pdfSuccessRev /= std::abs(path_L[i].wo.z);
-
-							if (path_R[j].surf) {
-								const BSDF *bsdf = m_bsdfs[id_R].get();
-								bRec_R.wi = frame.toLocal(path_R[j].wi);
-								bRec_R.wo = frame.toLocal(-path_L[i].wo);
-								if (mode == 1) {
-									funcVal = bsdf->eval(bRec_R);
-									funcVal *= std::abs((bRec_R.wi.z / bRec_R.wo.z)*(-path_L[i].wo.z / path_R[j].wi.z));
-								}
-								pdf_RR[0] = bsdf->pdf(bRec_R);
-								BSDFSamplingRecord bRec_R_reverse(bRec_R);
-								bRec_R_reverse.reverse();
-								pdf_RR[1] = bsdf->pdf(bRec_R_reverse);
-							}
-							else {
-								const PhaseFunction *phase = mediums[id_R].get()->getPhaseFunction();
-								if (j == 0) fprintf(stderr, "Badness i: 0\n");
-								pRec.wi = path_R[j].wi;
-								pRec.wo = -path_L[i].wo;
-								if (mode == 1) {
-									funcVal = Spectrum(phase->eval(pRec));
-								}
-								pdf_RR[0] = phase->pdf(pRec);
-								PhaseFunctionSamplingRecord pRec_reverse(pRec);
-								pRec_reverse.reverse();
-								pdf_RR[1] = phase->pdf(pRec_reverse);
+		const size_t nbConnections = pairs.size();
+		for (size_t c = 0; c < nbConnections; ++c) {
+			const size_t i = pairs[c].i, j = pairs[c].j;
+			const int id_connectMedium = pairs[c].medium;
+			const Float pairWeight = pairs[c].weight;
+
+			const int id_L = path_L.layerID[i];
+			const int id_R = path_R.layerID[j];
+			Spectrum f(0.0), funcVal(0.0);
+			Float w, t, f_pdf;
+			Vector2 pdf_LL, pdf_RR;
+			Frame frame;
+
+			// sample from left
+			frame = params.frame(id_R);
+
+			if (!path_R.surf[j] || (path_R.wi[j].z*frame.toLocal(path_R.wi[j]).z > 0 && -path_L.wo[i].z*frame.toLocal(-path_L.wo[i]).z > 0)) {
+				t = (path_R.z[j] - path_L.z[i]) / path_L.wo[i].z;
+				if (t > Epsilon) {
+					const SlabMedium *medium = &params.medium(id_connectMedium);
+					medium->eval(path_L.wo[i], t, mRec);
+					mRec.pdfSuccess /= std::abs(path_L.wo[i].z);
+					mRec.pdfSuccessRev /= std::abs(path_L.wo[i].z);
+
+					if (path_R.surf[j]) {
+						const BSDF *bsdf = m_bsdfs[id_R].get();
+						bRec_R.wi = frame.toLocal(path_R.wi[j]);
+						bRec_R.wo = frame.toLocal(-path_L.wo[i]);
+						bRec_R.typeMask = j == 0 && path_R.entered ? BSDF::ETransmission : _bRec.typeMask;
+						if (mode == 1) {
+							funcVal = bsdf->eval(bRec_R);
+							funcVal *= std::abs((bRec_R.wi.z / bRec_R.wo.z)*(-path_L.wo[i].z / path_R.wi[j].z));
+						}
+						pdf_RR[0] = bsdf->pdf(bRec_R);
+						BSDFSamplingRecord bRec_R_reverse(bRec_R);
+						bRec_R_reverse.reverse();
+						bRec_R_reverse.typeMask = _bRec.typeMask;
+						pdf_RR[1] = bsdf->pdf(bRec_R_reverse);
+					}
+					else {
+						const PhaseFunction *phase = params.medium(id_R).getPhaseFunction();
+						if (j == 0) reportAnomaly(EMediumSubPathStart);
+						pRec.wi = path_R.wi[j];
+						pRec.wo = -path_L.wo[i];
+						if (mode == 1) {
+							funcVal = Spectrum(phase->eval(pRec));
+						}
+						pdf_RR[0] = phase->pdf(pRec);
+						PhaseFunctionSamplingRecord pRec_reverse(pRec);
+						pRec_reverse.reverse();
+						pdf_RR[1] = phase->pdf(pRec_reverse);
+					}
+					pdf_RR *= path_R.pSurvival[j];
+
+					if (mode == 2 || !funcVal.isZero()) {
+						if (mode == 1) f = path_L.thru1[i] * path_R.thru0[j] * funcVal * mRec.transmittance / std::abs(path_L.wo[i].z);
+						if (mode == 2) f_pdf = (path_R.surf[j] ? mRec.pdfFailure : mRec.pdfSuccess) * pdf_RR[1] * (j ? ratioPdf_R[j - 1] * (path_R.epdf[j][1] / path_R.epdf[j][0]) : Float(1.0));
+
+						w = Float(1.0) + pdf_RR[0] / (path_L.vpdf[i][0] * path_L.pSurvival[i]);
+
+						if (i) {
+							w += ratio_L[i] * (path_L.surf[i] ? mRec.pdfFailure : mRec.pdfSuccessRev) * pdf_RR[0];
+						}
+						if (j) {
+							w += (path_R.surf[j] ? mRec.pdfFailure : mRec.pdfSuccess) / path_R.epdf[j][0] *
+								(Float(1.0) + pdf_RR[1] / path_R.vpdf[j - 1][0]);
+							w += ratio_R[j - 1] * (path_R.surf[j] ? mRec.pdfFailure : mRec.pdfSuccess) * pdf_RR[1] * path_R.epdf[j][1] / path_R.epdf[j][0];
+						}
+						//if (!boost::math::isnormal(w)) {
+						//	fprintf(stderr, "WTF (i): %lf\n", w);
+						//}
+						if (mode == 1) {
+							Float etas = 1.0;
+							if ((flag_incidentDir && flag_type) || (!flag_incidentDir && !flag_type)) {
+								for (int e = 0; e < id_connectMedium + 1; ++e)
+									etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
+								etas = Float(1.0) / etas;
 							}
-							pdf_RR *= path_R[j].pSurvival;
-
-							if (mode == 2 || !funcVal.isZero()) {
-								if (mode == 1) f = path_L[i].thru1 * path_R[j].thru0 * funcVal * mRec.transmittance / std::abs(path_L[i].wo.z);
-								if (mode == 2) f_pdf = (path_R[j].surf ? mRec.pdfFailure : mRec.pdfSuccess) * pdf_RR[1] * (j ? ratioPdf_R[j - 1] * (path_R[j].epdf[1] / path_R[j].epdf[0]) : Float(1.0));
-
-								w = Float(1.0) + pdf_RR[0] / (path_L[i].vpdf[0] * path_L[i].pSurvival);
-
-								if (i) {
-									w += ratio_L[i] * (path_L[i].surf ? mRec.pdfFailure : mRec.pdfSuccessRev) * pdf_RR[0];
-								}
-								if (j) {
-									w += (path_R[j].surf ? mRec.pdfFailure : mRec.pdfSuccess) / path_R[j].epdf[0] *
-										(Float(1.0) + pdf_RR[1] / path_R[j - 1].vpdf[0]);
-									w += ratio_R[j - 1] * (path_R[j].surf ? mRec.pdfFailure : mRec.pdfSuccess) * pdf_RR[1] * path_R[j].epdf[1] / path_R[j].epdf[0];
-								}
-								//if (!boost::math::isnormal(w)) {
-								//	fprintf(stderr, "WTF (i): %lf\n", w);
-								//}
-								if (mode == 1) {
-									Float etas = 1.0;
-									if ((flag_incidentDir && flag_type) || (!flag_incidentDir && !flag_type)) {
-										for (int e = 0; e < id_connectMedium + 1; ++e)
-											etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
-										etas = Float(1.0) / etas;
-									}
-									else if ((flag_incidentDir && !flag_type) || (!flag_incidentDir && flag_type)) {
-										for (int e = id_connectMedium + 1; e < m_nbLayers; ++e)
-											etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
-									}
-									else
-										;
-									Li += f / w * etas;
-								}
-								if (mode == 2) pdf += f_pdf / w;
+							else if ((flag_incidentDir && !flag_type) || (!flag_incidentDir && flag_type)) {
+								for (int e = id_connectMedium + 1; e < nbLayers; ++e)
+									etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
 							}
+							else
+								;
+							Li += f / w * (etas * pairWeight);
 						}
+						if (mode == 2) pdf += f_pdf / w * pairWeight;
 					}
+				}
+			}
 
-					// sample from right
-					frame = frames[id_L];
-
-					if (!path_L[i].surf || (path_L[i].wi.z*frame.toLocal(path_L[i].wi).z > 0 && -path_R[j].wo.z*frame.toLocal(-path_R[j].wo).z > 0)) {
-
-						t = (path_R[j].p.z - path_L[i].p.z) / -path_R[j].wo.z;
-						if (t > Epsilon) {
-							const Medium *medium = mediums[id_connectMedium].get();
-							medium->eval(Ray(Point(0.0, 0.0, path_L[i].p.z), -path_R[j].wo, 0.0, t, 0.0), mRec);
-							mRec.pdfSuccess /= std::abs(path_R[j].wo.z);
-							mRec.pdfSuccessRev /= std::abs(path_R[j].wo.z);
-
-							if (path_L[i].surf) {
-								const BSDF *bsdf = m_bsdfs[id_L].get();
-								bRec_L.wi = frame.toLocal(path_L[i].wi);
-								bRec_L.wo = frame.toLocal(-path_R[j].wo);
-								if (mode == 1) funcVal = bsdf->eval(bRec_L);
-								pdf_LL[0] = bsdf->pdf(bRec_L);
-								BSDFSamplingRecord bRec_L_reverse(bRec_L);
-								bRec_L_reverse.reverse();
-								pdf_LL[1] = bsdf->pdf(bRec_L_reverse);
-							}
-							else {
-								const PhaseFunction *phase = mediums[id_L].get()->getPhaseFunction();
-								if (i == 0) fprintf(stderr, "Badness j: 0\n");
-								pRec.wi = path_L[i].wi;
-								pRec.wo = -path_R[j].wo;
-								if (mode == 1) funcVal = Spectrum(phase->eval(pRec));
-								pdf_LL[0] = phase->pdf(pRec);
-								PhaseFunctionSamplingRecord pRec_reverse(pRec);
-								pRec_reverse.reverse();
-								pdf_LL[1] = phase->pdf(pRec_reverse);
+			// sample from right
+			frame = params.frame(id_L);
+
+			if (!path_L.surf[i] || (path_L.wi[i].z*frame.toLocal(path_L.wi[i]).z > 0 && -path_R.wo[j].z*frame.toLocal(-path_R.wo[j]).z > 0)) {
+
+				t = (path_R.z[j] - path_L.z[i]) / -path_R.wo[j].z;
+				if (t > Epsilon) {
+					const SlabMedium *medium = &params.medium(id_connectMedium);
+					medium->eval(-path_R.wo[j], t, mRec);
+					mRec.pdfSuccess /= std::abs(path_R.wo[j].z);
+					mRec.pdfSuccessRev /= std::abs(path_R.wo[j].z);
+
+					if (path_L.surf[i]) {
+						const BSDF *bsdf = m_bsdfs[id_L].get();
+						bRec_L.wi = frame.toLocal(path_L.wi[i]);
+						bRec_L.wo = frame.toLocal(-path_R.wo[j]);
+						bRec_L.typeMask = i == 0 && path_L.entered ? BSDF::ETransmission : _bRec.typeMask;
+						if (mode == 1) funcVal = bsdf->eval(bRec_L);
+						pdf_LL[0] = bsdf->pdf(bRec_L);
+						BSDFSamplingRecord bRec_L_reverse(bRec_L);
+						bRec_L_reverse.reverse();
+						bRec_L_reverse.typeMask = _bRec.typeMask;
+						pdf_LL[1] = bsdf->pdf(bRec_L_reverse);
+					}
+					else {
+						const PhaseFunction *phase = params.medium(id_L).getPhaseFunction();
+						if (i == 0) reportAnomaly(EMediumSubPathStart);
+						pRec.wi = path_L.wi[i];
+						pRec.wo = -path_R.wo[j];
+						if (mode == 1) funcVal = Spectrum(phase->eval(pRec));
+						pdf_LL[0] = phase->pdf(pRec);
+						PhaseFunctionSamplingRecord pRec_reverse(pRec);
+						pRec_reverse.reverse();
+						pdf_LL[1] = phase->pdf(pRec_reverse);
+					}
+					pdf_LL *= path_L.pSurvival[i];
+
+					if (mode == 2 || !funcVal.isZero()) {
+						if (mode == 1) f = path_L.thru0[i] * path_R.thru1[j] * funcVal * mRec.transmittance / std::abs(path_R.wo[j].z);
+						if (mode == 2) f_pdf = pdf_LL[0] * (path_R.surf[j] ? mRec.pdfFailure : mRec.pdfSuccessRev) * ratioPdf_R[j];
+
+						w = Float(1.0) + pdf_LL[0] / path_R.vpdf[j][0];
+
+						if (j) {
+							w += ratio_R[j] * (path_R.surf[j] ? mRec.pdfFailure : mRec.pdfSuccessRev)*pdf_LL[0];
+						}
+						if (i) {
+							w += (path_L.surf[i] ? mRec.pdfFailure : mRec.pdfSuccess) / path_L.epdf[i][0] *
+								(Float(1.0) + pdf_LL[1] / path_L.vpdf[i - 1][0]);
+							w += ratio_L[i - 1] * (path_L.surf[i] ? mRec.pdfFailure : mRec.pdfSuccess)*pdf_LL[1] * path_L.epdf[i][1] / path_L.epdf[i][0];
+						}
+						//if (!boost::math::isnormal(w)) {
+						//	fprintf(stderr, "WTF (j): %lf\n", w);
+						//}
+						if (mode == 1) {
+							Float etas = 1.0;
+							if ((flag_incidentDir && flag_type) || (!flag_incidentDir && !flag_type)) {
+								for (int e = 0; e < id_connectMedium + 1; ++e)
+									etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
+								etas = Float(1.0) / etas;
 							}
-							pdf_LL *= path_L[i].pSurvival;
-
-							if (mode == 2 || !funcVal.isZero()) {
-								if (mode == 1) f = path_L[i].thru0 * path_R[j].thru1 * funcVal * mRec.transmittance / std::abs(path_R[j].wo.z);
-								if (mode == 2) f_pdf = pdf_LL[0] * (path_R[j].surf ? mRec.pdfFailure : mRec.pdfSuccessRev) * ratioPdf_R[j];
-
-								w = Float(1.0) + pdf_LL[0] / path_R[j].vpdf[0];
-
-								if (j) {
-									w += ratio_R[j] * (path_R[j].surf ? mRec.pdfFailure : mRec.pdfSuccessRev)*pdf_LL[0];
-								}
-								if (i) {
-									w += (path_L[i].surf ? mRec.pdfFailure : mRec.pdfSuccess) / path_L[i].epdf[0] *
-										(Float(1.0) + pdf_LL[1] / path_L[i - 1].vpdf[0]);
-									w += ratio_L[i - 1] * (path_L[i].surf ? mRec.pdfFailure : mRec.pdfSuccess)*pdf_LL[1] * path_L[i].epdf[1] / path_L[i].epdf[0];
-								}
-								//if (!boost::math::isnormal(w)) {
-								//	fprintf(stderr, "WTF (j): %lf\n", w);
-								//}
-								if (mode == 1) {
-									Float etas = 1.0;
-									if ((flag_incidentDir && flag_type) || (!flag_incidentDir && !flag_type)) {
-										for (int e = 0; e < id_connectMedium + 1; ++e)
-											etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
-										etas = Float(1.0) / etas;
-									}
-									else if ((flag_incidentDir && !flag_type) || (!flag_incidentDir && flag_type)) {
-										for (int e = id_connectMedium + 1; e < m_nbLayers; ++e)
-											etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
-									}
-									else
-										;
-									Li += f / w * etas;
-								}
-								if (mode == 2) pdf += f_pdf / w;
+							else if ((flag_incidentDir && !flag_type) || (!flag_incidentDir && flag_type)) {
+								for (int e = id_connectMedium + 1; e < nbLayers; ++e)
+									etas *= (m_bsdfs[e]->getEta()*m_bsdfs[e]->getEta());
 							}
+							else
+								;
+							Li += f / w * (etas * pairWeight);
 						}
+						if (mode == 2) pdf += f_pdf / w * pairWeight;
 					}
 				}
 			}
 		}
 
+		avgConnectedPairs.incrementBase();
+		avgConnectedPairs += nbConnections;
+
+		if (mode == 1 && Li.isNaN()) {
+			reportAnomaly(ENaNThroughput);
+			Li = Spectrum(0.0);
+		}
+
 		if (mode == 1) _val = Li0 + Li * std::abs(_bRec.wo.z);
 		if (mode == 2) _pdf = pdf0 + pdf + m_diffusePdf;
 
 		//cout << Li.toString() << endl;
 	}
 
-	Float pdfTRT(const BSDFSamplingRecord &_bRec, const std::vector<Frame> &frames, const ref_vector<Medium> &mediums) const {
+	template <int N>
+	Float pdfTRT(const BSDFSamplingRecord &_bRec, const LayerParams &params) const {
+		const int nbLayers = layerCount<N>();
 		Assert(_bRec.sampler);
 		Sampler *sampler = _bRec.sampler;
 
@@ -1203,39 +1885,40 @@ public:
 		BSDFSamplingRecord bRecPdf(_bRec);
 		//bRecPdf.typeMask = BSDF::ETransmission;
 
-		std::vector<int> wi_id, wo_id;
-		wi_id.resize(m_nbLayers);
-		wo_id.resize(m_nbLayers);
+		Scratch &scratch = getScratch();
+		std::vector<int> &wi_id = scratch.trtWiID, &wo_id = scratch.trtWoID;
+		wi_id.resize(nbLayers);
+		wo_id.resize(nbLayers);
 
-		std::vector<Vector> wi,wo;
-		wi.resize(m_nbLayers);
-		wo.resize(m_nbLayers);
+		std::vector<Vector> &wi = scratch.trtWi, &wo = scratch.trtWo;
+		wi.resize(nbLayers);
+		wo.resize(nbLayers);
 
-		std::vector<Float> ratio;
-		ratio.resize(m_nbLayers);
+		std::vector<Float> &ratio = scratch.trtRatio;
+		ratio.assign(nbLayers, Float(0.0));
+
+		for (int i = 0; i < nbLayers; ++i) {
+			wi_id[i] = _bRec.wi.z > 0 ? i : nbLayers - i - 1;
+			wo_id[i] = _bRec.wo.z > 0 ? i : nbLayers - i - 1;
+		}
 
-		if (_bRec.wi.z > 0)	for (int i = 0; i < m_nbLayers; ++i) wi_id.push_back(i); 
-		if (_bRec.wi.z < 0)	for (int i = 0; i < m_nbLayers; ++i) wi_id.push_back(m_nbLayers - i - 1);
-		if (_bRec.wo.z > 0) for (int i = 0; i < m_nbLayers; ++i) wo_id.push_back(i);
-		if (_bRec.wo.z < 0) for (int i = 0; i < m_nbLayers; ++i) wo_id.push_back(m_nbLayers - i - 1);
-		
 		wi[0] = _bRec.wi;
 		wo[0] = _bRec.wo;
 		ratio[0] = 1.0;
 
-		for (int i = 0; i < m_nbLayers-1; ++i) {
+		for (int i = 0; i < nbLayers-1; ++i) {
 			// wi
-			bRec.wi = frames[wi_id[i]].toLocal(wi[i]);
+			bRec.wi = params.frame(wi_id[i]).toLocal(wi[i]);
 			if (bRec.wi.z * wi[i].z <= 0) return 0.0;
 			m_bsdfs[wi_id[i]]->sample(bRec, sampler->next2D());
-			wi[i + 1] = -frames[wi_id[i]].toWorld(bRec.wo);
+			wi[i + 1] = -params.frame(wi_id[i]).toWorld(bRec.wo);
 			if (-wi[i+1].z * bRec.wo.z <= 0) return 0.0;
 
 			// wo
-			bRec.wi = frames[wo_id[i]].toLocal(wo[i]);
+			bRec.wi = params.frame(wo_id[i]).toLocal(wo[i]);
 			if (bRec.wi.z * wo[i].z <= 0) return 0.0;
 			m_bsdfs[wo_id[i]]->sample(bRec, sampler->next2D());
-			wo[i + 1] = -frames[wo_id[i]].toWorld(bRec.wo);
+			wo[i + 1] = -params.frame(wo_id[i]).toWorld(bRec.wo);
 			if (-wo[i + 1].z * bRec.wo.z <= 0) return 0.0;
 
 			// ratio from wo
@@ -1243,21 +1926,21 @@ public:
 			bRec.reverse();
 			Float pdf1 = m_bsdfs[wo_id[i]]->pdf(bRec);
 			
-			const Medium *medium = wo[i].z > 0 ? mediums[i].get() : mediums[m_nbLayers-2-i].get();
+			const SlabMedium *medium = wo[i].z > 0 ? &params.medium(i) : &params.medium(nbLayers-2-i);
 			MediumSamplingRecord mRec;
 			Float t = Float(1.0) / std::abs(wo[i+1].z);
-			medium->eval(Ray(Point(0, 0, 0), wo[i + 1], 0.0, t, 0.0), mRec);
+			medium->eval(wo[i + 1], t, mRec);
 			mRec.pdfFailure = 1.0;
 
 			if(pdf0 > Epsilon) ratio[i + 1] = ratio[i] * mRec.pdfFailure * pdf1 / pdf0;
 		}
 
-		for (int i = 1; i < m_nbLayers; ++i) {
+		for (int i = 1; i < nbLayers; ++i) {
 			//cout << "wi" << i << ":" << wi[i].toString() << endl;
 			//cout << "wo" << i << ":" << wo[i].toString() << endl;
 			if (wi[i].z > 0 && wo[i].z > 0) {
-				bRecPdf.wi = frames[wi_id[i]].toLocal(wi[i]);
-				bRecPdf.wo = frames[wi_id[i]].toLocal(wo[i]);
+				bRecPdf.wi = params.frame(wi_id[i]).toLocal(wi[i]);
+				bRecPdf.wo = params.frame(wi_id[i]).toLocal(wo[i]);
 				pdf += m_bsdfs[wi_id[i]]->pdf(bRecPdf) * ratio[i];
 				//cout << "pdf" << i << ":" << m_bsdfs[wi_id[i]]->pdf(bRecPdf) << endl;
 			}
@@ -1271,9 +1954,42 @@ public:
 
 	}
 
+	/**
+	 * Number of leading vertices of a value sub-path that are distributed like
+	 * the sub-path a stochastic pdf estimator would generate itself. A walk
+	 * bounded by stochPdfDepth is a prefix of an unbounded one, and through
+	 * the purely absorbing media of "bidirStochTRT" an analog walk always
+	 * terminates at its first medium event.
+	 */
+	size_t pdfPrefix(const SubPath &subPath) const {
+		size_t len = subPath.size();
+		if (m_stochPdfDepth >= 0)
+			len = std::min(len, (size_t) m_stochPdfDepth);
+		if (m_pdfMode == "bidirStochTRT" && m_bidir && m_bidirUseAnalog) {
+			for (size_t i = 0; i < len; ++i) {
+				if (!subPath.surf[i]) {
+					len = i;
+					break;
+				}
+			}
+		}
+		return len;
+	}
+
+	/**
+	 * Estimate the pdf of sampling _bRec.wo (mode 1), bRec.wo (mode 2) or both
+	 * (mode 3). When given, \c forward and \c backward are the sub-paths of the
+	 * value estimate for _bRec.wi and bRec.wo. Their prefixes replace the first
+	 * iteration's walks of the eval pdf, whose direction bRec.wo is fixed. The
+	 * pdf of the sampled direction _bRec.wo always uses an independent forward
+	 * walk: the walk that generated _bRec.wo is conditioned on it, so reusing
+	 * it there would bias the estimate.
+	 */
+	template <int N>
 	void pdfEvaluation(const BSDFSamplingRecord &_bRec, const BSDFSamplingRecord &bRec,
-		const std::vector<Frame> &frames, const ref_vector<Medium> &mediums,
-		const int mode, Float &samplePdf, Float &evalPdf) const {
+		const LayerParams &params,
+		const int mode, Float &samplePdf, Float &evalPdf,
+		const SubPath *forward = NULL, const SubPath *backward = NULL) const {
 
 		if (m_pdfMode == "const") {
 			samplePdf = m_diffusePdf;
@@ -1285,72 +2001,63 @@ public:
 			for (int i = 0; i < m_pdfRepetitive; ++i) {
 				Float _samplePdf = 0.0;
 				Float _evalPdf = 0.0;
-				if (mode == 1 || mode == 3) _samplePdf = pdfTRT(_bRec, frames, mediums);
-				if (mode == 2 || mode == 3)	_evalPdf = pdfTRT(bRec, frames, mediums);
+				if (mode == 1 || mode == 3) _samplePdf = pdfTRT<N>(_bRec, params);
+				if (mode == 2 || mode == 3)	_evalPdf = pdfTRT<N>(bRec, params);
 				samplePdf += _samplePdf;
 				evalPdf += _evalPdf;
 			}
 			samplePdf /= m_pdfRepetitive;
 			evalPdf /= m_pdfRepetitive;
 		}
-		else if (m_pdfMode == "bidirStochTRT") {
-			ref_vector<Medium> mediumsForPdf;
-			setParametersPdf(_bRec, mediumsForPdf);
-			samplePdf = 0.0;
-			evalPdf = 0.0;
-			for (int i = 0; i < m_pdfRepetitive; ++i) {
-				BSDFSamplingRecord bRec_tmp(_bRec);
-				std::vector<PathInfo> path, path_R_sample, path_R_eval;
-				std::vector<Float> ratio, ratio_R_sample, ratio_R_eval;
-				std::vector<Float> ratioPdf, ratioPdf_R_sample, ratioPdf_R_eval;
-				generatePath(bRec_tmp, frames, mediumsForPdf, m_stochPdfDepth, path, ratio, ratioPdf, false, true);
-
-				Float _samplePdf = 0.0;
-				Float _evalPdf = 0.0;
-				if (mode == 1 || mode == 3) {
-					bRec_tmp.wi = _bRec.wo;
-					generatePath(bRec_tmp, frames, mediumsForPdf, m_stochPdfDepth, path_R_sample, ratio_R_sample, ratioPdf_R_sample, true, true);
-					Spectrum sampleVal(0.0);
-					bidirEvaluation(_bRec, frames, mediumsForPdf, path, ratio, ratioPdf, path_R_sample, ratio_R_sample, ratioPdf_R_sample, 2, sampleVal, _samplePdf);
-				}
-				if (mode == 2 || mode == 3) {
-					bRec_tmp.wi = bRec.wo;
-					generatePath(bRec_tmp, frames, mediumsForPdf, m_stochPdfDepth, path_R_eval, ratio_R_eval, ratioPdf_R_eval, true, true);
-					Spectrum evalVal(0.0);
-					bidirEvaluation(bRec, frames, mediumsForPdf, path, ratio, ratioPdf, path_R_eval, ratio_R_eval, ratioPdf_R_eval, 2, evalVal, _evalPdf);
-				}
-				samplePdf += _samplePdf;
-				evalPdf += _evalPdf;
+		else if (m_pdfMode == "bidirStochTRT" || m_pdfMode == "bidirStoch") {
+			Scratch &scratch = getScratch();
+			const LayerParams *paramsForPdf = &params;
+			if (m_pdfMode == "bidirStochTRT") {
+				setParametersPdf(params, scratch.pdfParams);
+				paramsForPdf = &scratch.pdfParams;
 			}
-			samplePdf /= m_pdfRepetitive;
-			evalPdf /= m_pdfRepetitive;
-		}
-		else if (m_pdfMode == "bidirStoch") {
-			
+
+			/* Value walks cut short by Russian roulette are not distributed like
+			   the (roulette-free) pdf walks */
+			if (m_rrDepth >= 0)
+				forward = backward = NULL;
+
+			const size_t all = std::numeric_limits<size_t>::max();
 			samplePdf = 0.0;
 			evalPdf = 0.0;
 			for (int i = 0; i < m_pdfRepetitive; ++i) {
 				BSDFSamplingRecord bRec_tmp(_bRec);
-				std::vector<PathInfo> path, path_R_sample, path_R_eval;
-				std::vector<Float> ratio, ratio_R_sample, ratio_R_eval;
-				std::vector<Float> ratioPdf, ratioPdf_R_sample, ratioPdf_R_eval;
-				generatePath(bRec_tmp, frames, mediums, m_stochPdfDepth, path, ratio, ratioPdf, false, true);
 
 				Float _samplePdf = 0.0;
 				Float _evalPdf = 0.0;
+				if (!(i == 0 && forward && mode == 2))
+					generatePath<N>(bRec_tmp, *paramsForPdf, m_stochPdfDepth, scratch.pdfForward, false, true, false, false);
+
 				if (mode == 1 || mode == 3) {
 					bRec_tmp.wi = _bRec.wo;
-					generatePath(bRec_tmp, frames, mediums, m_stochPdfDepth, path_R_sample, ratio_R_sample, ratioPdf_R_sample, true, true);
-					
+					generatePath<N>(bRec_tmp, *paramsForPdf, m_stochPdfDepth, scratch.pdfSample, true, true, false, false);
 					Spectrum sampleVal(0.0);
-					bidirEvaluation(_bRec, frames, mediums, path, ratio, ratioPdf, path_R_sample, ratio_R_sample, ratioPdf_R_sample, 2, sampleVal, _samplePdf);
+					bidirEvaluation<N>(_bRec, *paramsForPdf, scratch.pdfForward, scratch.pdfSample, 2, sampleVal, _samplePdf, all, all);
 				}
 				if (mode == 2 || mode == 3) {
-					bRec_tmp.wi = bRec.wo;
-					generatePath(bRec_tmp, frames, mediums, m_stochPdfDepth, path_R_eval, ratio_R_eval, ratioPdf_R_eval, true, true);
-					
+					const SubPath *path = &scratch.pdfForward;
+					size_t len = all;
+					if (i == 0 && forward) {
+						path = forward;
+						len = pdfPrefix(*forward);
+					}
+					const SubPath *path_R = &scratch.pdfEval;
+					size_t len_R = all;
+					if (i == 0 && backward) {
+						path_R = backward;
+						len_R = pdfPrefix(*backward);
+					}
+					else {
+						bRec_tmp.wi = bRec.wo;
+						generatePath<N>(bRec_tmp, *paramsForPdf, m_stochPdfDepth, scratch.pdfEval, true, true, false, false);
+					}
 					Spectrum evalVal(0.0);
-					bidirEvaluation(bRec, frames, mediums, path, ratio, ratioPdf, path_R_eval, ratio_R_eval, ratioPdf_R_eval, 2, evalVal, _evalPdf);
+					bidirEvaluation<N>(bRec, *paramsForPdf, *path, *path_R, 2, evalVal, _evalPdf, len, len_R);
 				}
 				samplePdf += _samplePdf;
 				evalPdf += _evalPdf;
@@ -1358,13 +2065,11 @@ public:
 			samplePdf /= m_pdfRepetitive;
 			evalPdf /= m_pdfRepetitive;
 		}
-		else {
-			cout << "[GY]: Pdf Mode _" << m_pdfMode << "_ is not implement" << endl;
-		}
 
 	}
 
-	void evalAndSample(BSDFSamplingRecord &_bRec, Spectrum &evalVal, Float &evalPdf, Spectrum &sampleVal, Float &samplePdf,
+	template <int N, bool Textured>
+	void evalAndSampleImpl(BSDFSamplingRecord &_bRec, Spectrum &evalVal, Float &evalPdf, Spectrum &sampleVal, Float &samplePdf,
 		const Point2 &nextSample, EMeasure measure) const {
 		Assert(_bRec.sampler);
 	
@@ -1372,9 +2077,9 @@ public:
 		const BSDFSamplingRecord bRec(_bRec);
 		BSDFSamplingRecord bRec_tmp(_bRec);
 
-		std::vector<Frame> frames;
-		ref_vector<Medium> mediums;
-		setParameters(bRec, frames, mediums);
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<N, Textured>(bRec, params);
 
 		Float evalPdf_tmp = 0.0; 
 		
@@ -1388,18 +2093,14 @@ public:
 			}
 			else {
 				// sample 
-				{
-					std::vector<PathInfo> path;
-					std::vector<Float> ratio, ratioPdf;
-					sampleVal = generatePath(_bRec, frames, mediums, -1, path, ratio, ratioPdf, false, false);
-				}
+				sampleVal = generatePath<N>(_bRec, params, -1, scratch.forward, false, false);
 				// sample pdf
 				{
 					if (sampleVal.isZero()) {
 						samplePdf = 0.0;
 					}
 					else {
-						pdfEvaluation(_bRec, bRec, frames, mediums, 1, samplePdf, evalPdf_tmp);
+						pdfEvaluation<N>(_bRec, bRec, params, 1, samplePdf, evalPdf_tmp);
 					}
 				}
 			}
@@ -1408,42 +2109,39 @@ public:
 			{
 				// eval, sample, wo, (eval pdf)
 				if (m_bidir) {
-					std::vector<PathInfo> path;
-					std::vector<Float> ratio, ratioPdf;
-					sampleVal = generatePath(_bRec, frames, mediums, -1, path, ratio, ratioPdf, false, true);
+					sampleVal = generatePath<N>(_bRec, params, -1, scratch.forward, false, true);
 
-					// backward sample
-					std::vector<PathInfo> path_R;
-					std::vector<Float> ratio_R, ratioPdf_R;
+					// backward sample (only used for the value, so it may skip the outer reflection)
 					bRec_tmp.wi = bRec.wo;
-					generatePath(bRec_tmp, frames, mediums, -1, path_R, ratio_R, ratioPdf_R, true, true);
+					generatePath<N>(bRec_tmp, params, -1, scratch.backward, true, true, m_analyticTop);
 
-					bidirEvaluation(bRec, frames, mediums, path, ratio, ratioPdf, path_R, ratio_R, ratioPdf_R, 1, evalVal, evalPdf_tmp);
+					bidirEvaluation<N>(bRec, params, scratch.forward, scratch.backward, 1, evalVal, evalPdf_tmp);
 				}
 				else {
-					std::vector<PathInfo> path;
-					std::vector<Float> ratio, ratioPdf;
-					sampleVal = generatePath(_bRec, frames, mediums, -1, path, ratio, ratioPdf, false, false);
-					unidirEvaluation(bRec, frames, mediums, path, 1, evalVal, evalPdf_tmp);
+					sampleVal = generatePath<N>(_bRec, params, -1, scratch.forward, false, m_fusedPdf);
+					unidirEvaluation<N>(bRec, params, scratch.forward, 1, evalVal, evalPdf_tmp);
 				}
 			}
 			{
-				// sample pdf, eval pdf
-				pdfEvaluation(_bRec, bRec, frames, mediums, 3, samplePdf, evalPdf);
+				// sample pdf, eval pdf (the latter reusing the sub-paths of the value estimate)
+				pdfEvaluation<N>(_bRec, bRec, params, 3, samplePdf, evalPdf,
+					m_fusedPdf ? &scratch.forward : NULL,
+					m_fusedPdf && m_bidir && !scratch.backward.entered ? &scratch.backward : NULL);
 			}
 		}
 
 		if (evalPdf < 0) {
-			cout << "[GY]: eval pdf < 0" << endl;
+			reportAnomaly(ENegativePdf);
 			evalPdf = 0.0;
 		}
 		if (samplePdf < 0) {
-			cout << "[GY]: sample pdf < 0" << endl;
+			reportAnomaly(ENegativePdf);
 			samplePdf = 0.0;
 		}
 	}
 
-	Float pdf(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+	template <int N, bool Textured>
+	Float pdfImpl(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
 		Assert(_bRec.sampler);
 
 		const BSDFSamplingRecord bRec_tmp(_bRec);
@@ -1452,75 +2150,70 @@ public:
 			return 0.0;
 		}
 
-		std::vector<Frame> frames;
-		ref_vector<Medium> mediums;
-		setParameters(_bRec, frames, mediums);
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<N, Textured>(_bRec, params);
 
 		
 		Float pdf_return = 0.0, pdf_tmp = 0.0;
-		pdfEvaluation(_bRec, bRec_tmp, frames, mediums, 1, pdf_return, pdf_tmp);
+		pdfEvaluation<N>(_bRec, bRec_tmp, params, 1, pdf_return, pdf_tmp);
 	
 		return pdf_return;
 	}
 
-	Spectrum sample(BSDFSamplingRecord &_bRec, const Point2 &sample) const {
+	template <int N, bool Textured>
+	Spectrum sampleImpl(BSDFSamplingRecord &_bRec, const Point2 &sample) const {
 		Assert(_bRec.sampler);
 
 		if (!(BSDF::getType() & BSDF::ETransmission) && (Frame::cosTheta(_bRec.wi) <= 0)) {
 			return Spectrum(0.0);
 		}
 
-		std::vector<Frame> frames;
-		ref_vector<Medium> mediums;
-		setParameters(_bRec, frames, mediums);
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<N, Textured>(_bRec, params);
 
 		Spectrum sampleVal(0.0);
 
-		{
-			std::vector<PathInfo> path;
-			std::vector<Float> ratio, ratioPdf;
-			sampleVal = generatePath(_bRec, frames, mediums, -1, path, ratio, ratioPdf, false, false);
-		}
+		sampleVal = generatePath<N>(_bRec, params, -1, scratch.forward, false, false);
 
 		return sampleVal;
 	}
 
-	Spectrum sample(BSDFSamplingRecord &_bRec, Float &_pdf, const Point2 &sample) const {
+	template <int N, bool Textured>
+	Spectrum samplePdfImpl(BSDFSamplingRecord &_bRec, Float &_pdf, const Point2 &sample) const {
 		Assert(_bRec.sampler);
 
 		if (!(BSDF::getType() & BSDF::ETransmission) && (Frame::cosTheta(_bRec.wi) <= 0)) {
 			return Spectrum(0.0);
 		}
 
-		std::vector<Frame> frames;
-		ref_vector<Medium> mediums;
-		setParameters(_bRec, frames, mediums);
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<N, Textured>(_bRec, params);
 		
 		Spectrum sampleVal(0.0);
 
-		{
-			std::vector<PathInfo> path;
-			std::vector<Float> ratio, ratioPdf;
-			sampleVal = generatePath(_bRec, frames, mediums, -1, path, ratio, ratioPdf, false, false);
-		}
+		sampleVal = generatePath<N>(_bRec, params, -1, scratch.forward, false, false);
 
 		{
 			Float evalPdf = 0.0;
-			pdfEvaluation(_bRec, _bRec, frames, mediums, 1, _pdf, evalPdf);
+			pdfEvaluation<N>(_bRec, _bRec, params, 1, _pdf, evalPdf);
 		}
 
 		return sampleVal;
 	}
 
-	Spectrum eval(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+	template <int N, bool Textured>
+	Spectrum evalImpl(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
 		Assert(_bRec.sampler);
 
 		BSDFSamplingRecord bRec(_bRec);
 		BSDFSamplingRecord bRec_tmp(_bRec);
 
-		std::vector<Frame> frames;
-		ref_vector<Medium> mediums;
-		setParameters(bRec, frames, mediums);
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<N, Textured>(bRec, params);
 
 		Spectrum evalVal(0.0);
 
@@ -1532,29 +2225,467 @@ public:
 		else {
 			Float evalPdf_tmp = 0;
 			if (m_bidir) {
-				std::vector<PathInfo> path;
-				std::vector<Float> ratio, ratioPdf;
-				generatePath(bRec, frames, mediums, -1, path, ratio, ratioPdf, false, true);
+				generatePath<N>(bRec, params, -1, scratch.forward, false, true, m_analyticTop);
 
 				// backward sample
-				std::vector<PathInfo> path_R;
-				std::vector<Float> ratio_R, ratioPdf_R;
 				bRec_tmp.wi = _bRec.wo;
-				generatePath(bRec_tmp, frames, mediums, -1, path_R, ratio_R, ratioPdf_R, true, true);
+				generatePath<N>(bRec_tmp, params, -1, scratch.backward, true, true, m_analyticTop);
 
-				bidirEvaluation(_bRec, frames, mediums, path, ratio, ratioPdf, path_R, ratio_R, ratioPdf_R, 1, evalVal, evalPdf_tmp);
+				bidirEvaluation<N>(_bRec, params, scratch.forward, scratch.backward, 1, evalVal, evalPdf_tmp);
 			}
 			else {
-				std::vector<PathInfo> path;
-				std::vector<Float> ratio, ratioPdf;
-				generatePath(bRec, frames, mediums, -1, path, ratio, ratioPdf, false, false);
-				unidirEvaluation(_bRec, frames, mediums, path, 1, evalVal, evalPdf_tmp);
+				generatePath<N>(bRec, params, -1, scratch.forward, false, false, m_analyticTop);
+				unidirEvaluation<N>(_bRec, params, scratch.forward, 1, evalVal, evalPdf_tmp);
 			}
 		}
 
 		return evalVal;
 	}
 
+	/* ==================================================================== */
+	/*                   Kernel selection and dispatch                       */
+	/* ==================================================================== */
+
+	typedef Spectrum (MultiLayeredBSDF::*EvalKernel)(const BSDFSamplingRecord &, EMeasure) const;
+	typedef Float (MultiLayeredBSDF::*PdfKernel)(const BSDFSamplingRecord &, EMeasure) const;
+	typedef Spectrum (MultiLayeredBSDF::*SampleKernel)(BSDFSamplingRecord &, const Point2 &) const;
+	typedef Spectrum (MultiLayeredBSDF::*SamplePdfKernel)(BSDFSamplingRecord &, Float &, const Point2 &) const;
+	typedef void (MultiLayeredBSDF::*EvalAndSampleKernel)(BSDFSamplingRecord &, Spectrum &, Float &,
+		Spectrum &, Float &, const Point2 &, EMeasure) const;
+
+	template <int N, bool Textured> void setKernels() {
+		m_evalKernel = &MultiLayeredBSDF::evalImpl<N, Textured>;
+		m_pdfKernel = &MultiLayeredBSDF::pdfImpl<N, Textured>;
+		m_sampleKernel = &MultiLayeredBSDF::sampleImpl<N, Textured>;
+		m_samplePdfKernel = &MultiLayeredBSDF::samplePdfImpl<N, Textured>;
+		m_evalAndSampleKernel = &MultiLayeredBSDF::evalAndSampleImpl<N, Textured>;
+	}
+
+	/**
+	 * Resolve the layer count and the presence of textures into one of the
+	 * specialized kernels. Two- and three-layer stacks get a fixed layer count,
+	 * other stacks use the dynamic (N = 0) instantiation. Untextured stacks
+	 * also have their frames and media resolved once here.
+	 */
+	void configureKernels() {
+		const bool textured = (m_flag_normals | m_flag_sigmaTs | m_flag_densities
+			| m_flag_albedos | m_flag_orientations) != 0;
+
+		Intersection its;
+		its.uv = Point2(0.0);
+		BSDFSamplingRecord bRec(its, NULL);
+		LayerParams params;
+		setParameters<0, true>(bRec, params);
+		m_constFrames.resize(m_nbLayers);
+		m_constMediums.resize(m_nbLayers - 1);
+		for (int l = 0; l < m_nbLayers; ++l)
+			m_constFrames[l] = params.frame(l);
+		for (int l = 0; l < m_nbLayers - 1; ++l)
+			m_constMediums[l] = params.medium(l);
+
+		switch (m_nbLayers) {
+			case 2: if (textured) setKernels<2, true>(); else setKernels<2, false>(); break;
+			case 3: if (textured) setKernels<3, true>(); else setKernels<3, false>(); break;
+			default: if (textured) setKernels<0, true>(); else setKernels<0, false>(); break;
+		}
+	}
+
+	void evalAndSample(BSDFSamplingRecord &_bRec, Spectrum &evalVal, Float &evalPdf, Spectrum &sampleVal, Float &samplePdf,
+		const Point2 &nextSample, EMeasure measure) const {
+		++evalAndSampleCalls;
+		if (m_baked) {
+			const BSDFSamplingRecord bRec(_bRec);
+			evalVal = evalBaked(bRec, measure);
+			evalPdf = pdfBaked(bRec, measure);
+			sampleVal = sampleBaked(_bRec, samplePdf, nextSample);
+			return;
+		}
+		(this->*m_evalAndSampleKernel)(_bRec, evalVal, evalPdf, sampleVal, samplePdf, nextSample, measure);
+	}
+
+	Float pdf(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+		++pdfCalls;
+		if (m_baked)
+			return pdfBaked(_bRec, measure);
+		return (this->*m_pdfKernel)(_bRec, measure);
+	}
+
+	Spectrum sample(BSDFSamplingRecord &_bRec, const Point2 &sample) const {
+		++sampleCalls;
+		if (m_baked) {
+			Float pdf;
+			return sampleBaked(_bRec, pdf, sample);
+		}
+		return (this->*m_sampleKernel)(_bRec, sample);
+	}
+
+	Spectrum sample(BSDFSamplingRecord &_bRec, Float &_pdf, const Point2 &sample) const {
+		++sampleCalls;
+		if (m_baked)
+			return sampleBaked(_bRec, _pdf, sample);
+		return (this->*m_samplePdfKernel)(_bRec, _pdf, sample);
+	}
+
+	Spectrum eval(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+		++evalCalls;
+		if (m_baked)
+			return evalBaked(_bRec, measure);
+		return (this->*m_evalKernel)(_bRec, measure);
+	}
+
+	/* ==================================================================== */
+	/*                 Tabulated ("baked") evaluation                        */
+	/* ==================================================================== */
+
+	/**
+	 * Without textures, with flat shading normals and with isotropic layers,
+	 * the response of the stack only depends on (cos(theta_i), cos(theta_o),
+	 * phi_o - phi_i). In that case the random walk is replaced by a table of
+	 * cell averages that is filled once by histogramming sampled walks.
+	 *
+	 * Walks that leave the stack right after their first vertex (i.e. the
+	 * reflection off the outer interface) are not tabulated: the outer BSDF is
+	 * queried directly instead, so that specular highlights stay sharp.
+	 */
+	bool canBake() const {
+		for (int l = 0; l < m_nbLayers; ++l) {
+			if (hasFlag(m_flag_normals, l) || normalize(m_vector_normals[l]).z < 1 - Epsilon) {
+				Log(EWarn, "Layer %i has a perturbed shading normal, disabling the baked mode.", l);
+				return false;
+			}
+			if (m_bsdfs[l]->getType() & (BSDF::EAnisotropic | BSDF::ESpatiallyVarying)) {
+				Log(EWarn, "Layer %i has an anisotropic or spatially varying BSDF, disabling the baked mode.", l);
+				return false;
+			}
+		}
+		for (int l = 0; l < m_nbLayers - 1; ++l) {
+			if (hasFlag(m_flag_sigmaTs, l) || hasFlag(m_flag_densities, l) || hasFlag(m_flag_albedos, l) || hasFlag(m_flag_orientations, l)) {
+				Log(EWarn, "Medium %i is textured, disabling the baked mode.", l);
+				return false;
+			}
+			if (hasFlag(m_flag_aniso, l) && std::abs(normalize(m_vector_orientations[l]).z) < 1 - Epsilon) {
+				Log(EWarn, "Medium %i is not rotationally symmetric, disabling the baked mode.", l);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	inline int bakedCosCount() const {
+		return m_bakedCosMin < 0 ? 2 * m_bakedCosRes : m_bakedCosRes;
+	}
+
+	inline Float bakedCellSolidAngle() const {
+		/* Cells cover phi_d and -phi_d */
+		return (1 - m_bakedCosMin) / bakedCosCount() * (Float) M_PI / m_bakedPhiRes * 2;
+	}
+
+	/// Cell-centered linear interpolation coordinate along one table axis
+	static inline void bakedCoord(Float x, Float xMin, Float xMax, int n, int &idx, Float &alpha) {
+		Float pos = (x - xMin) / (xMax - xMin) * n - Float(0.5);
+		idx = math::clamp(math::floorToInt(pos), 0, n - 2);
+		alpha = math::clamp(pos - idx, (Float) 0, (Float) 1);
+	}
+
+	/// Azimuthal difference folded into [0, pi]
+	static inline Float bakedPhiD(const Vector &wi, const Vector &wo) {
+		Float phiD = std::abs(std::atan2(wo.y, wo.x) - std::atan2(wi.y, wi.x));
+		return phiD > M_PI ? Float(2 * M_PI) - phiD : phiD;
+	}
+
+	inline const BSDF *bakedOuterBSDF(const Vector &wi) const {
+		return wi.z > 0 ? m_bsdfs[0].get() : m_bsdfs[m_nbLayers - 1].get();
+	}
+
+	/// Probability of sampling the outer interface instead of the table
+	inline Float bakedOuterProb(const Vector &wi) const {
+		int idx; Float alpha;
+		bakedCoord(wi.z, m_bakedCosMin, 1, bakedCosCount(), idx, alpha);
+		return (1 - alpha) * m_bakedOuterProb[idx] + alpha * m_bakedOuterProb[idx + 1];
+	}
+
+	Spectrum bakedLookup(const Vector &wi, const Vector &wo) const {
+		if (wi.z < m_bakedCosMin || wo.z < m_bakedCosMin)
+			return Spectrum(0.0);
+
+		const int nCos = bakedCosCount();
+		int i, j, k;
+		Float a, b, c;
+		bakedCoord(wi.z, m_bakedCosMin, 1, nCos, i, a);
+		bakedCoord(wo.z, m_bakedCosMin, 1, nCos, j, b);
+		bakedCoord(bakedPhiD(wi, wo), 0, (Float) M_PI, m_bakedPhiRes, k, c);
+
+		Spectrum result(0.0);
+		for (int di = 0; di < 2; ++di) {
+			for (int dj = 0; dj < 2; ++dj) {
+				const Spectrum *row = &m_bakedValue[((i + di) * nCos + j + dj) * m_bakedPhiRes + k];
+				Float weight = (di ? a : 1 - a) * (dj ? b : 1 - b);
+				result += (row[0] * (1 - c) + row[1] * c) * weight;
+			}
+		}
+		return result;
+	}
+
+	Float bakedTablePdf(const Vector &wi, const Vector &wo) const {
+		if (wi.z < m_bakedCosMin || wo.z < m_bakedCosMin)
+			return 0.0;
+
+		const int nCos = bakedCosCount();
+		int idx; Float alpha;
+		bakedCoord(wi.z, m_bakedCosMin, 1, nCos, idx, alpha);
+		int j = std::min((int) ((wo.z - m_bakedCosMin) / (1 - m_bakedCosMin) * nCos), nCos - 1);
+		int k = std::min((int) (bakedPhiD(wi, wo) * INV_PI * m_bakedPhiRes), m_bakedPhiRes - 1);
+		size_t cell = (size_t) (j * m_bakedPhiRes + k);
+
+		Float pdf = 0.0;
+		if (m_bakedCDF[idx].getSum() > 0)
+			pdf += (1 - alpha) * m_bakedCDF[idx][cell];
+		if (m_bakedCDF[idx + 1].getSum() > 0)
+			pdf += alpha * m_bakedCDF[idx + 1][cell];
+		return pdf / bakedCellSolidAngle();
+	}
+
+	bool bakedTableSample(const Vector &wi, Vector &wo, Point2 sample, Sampler *sampler) const {
+		const int nCos = bakedCosCount();
+		int idx; Float alpha;
+		bakedCoord(wi.z, m_bakedCosMin, 1, nCos, idx, alpha);
+		const DiscreteDistribution &cdf = m_bakedCDF[sampler->next1D() < alpha ? idx + 1 : idx];
+		if (cdf.getSum() == 0)
+			return false;
+
+		Float cellPdf;
+		size_t cell = cdf.sampleReuse(sample.x, cellPdf);
+		int j = (int) (cell / m_bakedPhiRes), k = (int) (cell % m_bakedPhiRes);
+
+		Float cosThetaO = m_bakedCosMin + (j + sample.x) * (1 - m_bakedCosMin) / nCos;
+		Float phiD = (k + sample.y) * (Float) M_PI / m_bakedPhiRes;
+		if (sampler->next1D() < 0.5f)
+			phiD = -phiD;
+		Float phiO = std::atan2(wi.y, wi.x) + phiD;
+		Float sinThetaO = math::safe_sqrt(1 - cosThetaO * cosThetaO);
+		wo = Vector(sinThetaO * std::cos(phiO), sinThetaO * std::sin(phiO), cosThetaO);
+		return true;
+	}
+
+	Spectrum evalBaked(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+		if (_bRec.wi.z < m_bakedCosMin || _bRec.wo.z < m_bakedCosMin)
+			return Spectrum(0.0);
+
+		BSDFSamplingRecord bRec(_bRec);
+		bRec.typeMask = BSDF::EReflection;
+		Spectrum result = bakedOuterBSDF(_bRec.wi)->eval(bRec, measure);
+		if (measure == ESolidAngle)
+			result += bakedLookup(_bRec.wi, _bRec.wo);
+		return result;
+	}
+
+	Float pdfBaked(const BSDFSamplingRecord &_bRec, EMeasure measure) const {
+		if (_bRec.wi.z < m_bakedCosMin || _bRec.wo.z < m_bakedCosMin)
+			return 0.0;
+
+		BSDFSamplingRecord bRec(_bRec);
+		bRec.typeMask = BSDF::EReflection;
+		Float q = bakedOuterProb(_bRec.wi);
+		Float pdf = q * bakedOuterBSDF(_bRec.wi)->pdf(bRec, measure);
+		if (measure == ESolidAngle)
+			pdf += (1 - q) * bakedTablePdf(_bRec.wi, _bRec.wo);
+		return pdf;
+	}
+
+	Spectrum sampleBaked(BSDFSamplingRecord &_bRec, Float &_pdf, const Point2 &sample) const {
+		Assert(_bRec.sampler);
+		_pdf = 0.0;
+		if (_bRec.wi.z < m_bakedCosMin)
+			return Spectrum(0.0);
+		Float q = bakedOuterProb(_bRec.wi);
+
+		if (_bRec.sampler->next1D() < q) {
+			BSDFSamplingRecord bRec(_bRec);
+			bRec.typeMask = BSDF::EReflection;
+			Float outerPdf;
+			Spectrum weight = bakedOuterBSDF(_bRec.wi)->sample(bRec, outerPdf, sample);
+			if (weight.isZero())
+				return Spectrum(0.0);
+
+			_bRec.wo = bRec.wo;
+			_bRec.eta = 1.0;
+			_bRec.sampledComponent = bRec.sampledComponent;
+			_bRec.sampledType = bRec.sampledType;
+
+			if (bRec.sampledType & (BSDF::EDelta | BSDF::EDelta1D)) {
+				_pdf = q * outerPdf;
+				return weight / q;
+			}
+		}
+		else {
+			if (!bakedTableSample(_bRec.wi, _bRec.wo, sample, _bRec.sampler))
+				return Spectrum(0.0);
+
+			bool reflection = _bRec.wi.z * _bRec.wo.z > 0;
+			_bRec.eta = reflection ? Float(1.0) : (_bRec.wo.z < 0 ? m_eta : m_invEta);
+			_bRec.sampledComponent = 0;
+			_bRec.sampledType = reflection ? BSDF::EGlossyReflection : BSDF::EGlossyTransmission;
+		}
+
+		_pdf = pdfBaked(_bRec, ESolidAngle);
+		if (_pdf == 0)
+			return Spectrum(0.0);
+		return evalBaked(_bRec, ESolidAngle) / _pdf;
+	}
+
+	/**
+	 * 64-bit FNV-1a hash of everything the baked table depends on. The layer
+	 * BSDFs contribute through \c toString(), which must therefore list every
+	 * parameter that affects their response (e.g. the film of the thin-film BSDFs)
+	 */
+	uint64_t bakedKey() const {
+		std::ostringstream oss;
+		oss << sizeof(Float) << ' ' << SPECTRUM_SAMPLES << ' ' << m_nbLayers << ' '
+			<< m_bakedCosRes << ' ' << m_bakedPhiRes << ' ' << m_bakedSamples << ' ' << m_bakedCosMin << ' '
+			<< m_bidir << ' ' << m_bidirUseAnalog << ' ' << m_maxSurvivalProb << ' ' << m_multiLayerSupport << ' '
+			<< m_rrDepth << ' ' << m_rrMaxSurvival << endl;
+		for (int l = 0; l < m_nbLayers; ++l)
+			oss << m_bsdfs[l]->toString() << endl;
+		for (int l = 0; l < m_nbLayers - 1; ++l) {
+			oss << hasFlag(m_flag_aniso, l) << ' ' << m_spectrum_sigmaTs[l].toString() << ' ' << m_float_densities[l] << ' '
+				<< m_spectrum_albedos[l].toString() << ' ' << m_vector_orientations[l].toString() << endl;
+			if (m_phaseFunctions[l])
+				oss << m_phaseFunctions[l]->toString() << endl;
+		}
+
+		std::string str = oss.str();
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < str.length(); ++i) {
+			hash ^= (uint8_t) str[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	bool loadBaked(const fs::path &path, uint64_t key) {
+		if (!fs::exists(path))
+			return false;
+
+		ref<FileStream> stream = new FileStream(path, FileStream::EReadOnly);
+		if (stream->readUInt() != MTS_MULTILAYERED_BAKED_MAGIC || stream->readULong() != key) {
+			Log(EWarn, "Baked table \"%s\" is stale, rebuilding it.", path.string().c_str());
+			return false;
+		}
+
+		const int nCos = bakedCosCount();
+		std::vector<Float> values(nCos * nCos * m_bakedPhiRes * SPECTRUM_SAMPLES);
+		stream->readFloatArray(&values[0], values.size());
+		m_bakedValue.resize(nCos * nCos * m_bakedPhiRes);
+		for (size_t i = 0; i < m_bakedValue.size(); ++i)
+			m_bakedValue[i] = Spectrum(&values[i * SPECTRUM_SAMPLES]);
+
+		m_bakedOuterProb.resize(nCos);
+		stream->readFloatArray(&m_bakedOuterProb[0], nCos);
+		return true;
+	}
+
+	void saveBaked(const fs::path &path, uint64_t key) const {
+		const int nCos = bakedCosCount();
+		std::vector<Float> values(m_bakedValue.size() * SPECTRUM_SAMPLES);
+		for (size_t i = 0; i < m_bakedValue.size(); ++i)
+			for (int c = 0; c < SPECTRUM_SAMPLES; ++c)
+				values[i * SPECTRUM_SAMPLES + c] = m_bakedValue[i][c];
+
+		ref<FileStream> stream = new FileStream(path, FileStream::ETruncWrite);
+		stream->writeUInt(MTS_MULTILAYERED_BAKED_MAGIC);
+		stream->writeULong(key);
+		stream->writeFloatArray(&values[0], values.size());
+		stream->writeFloatArray(&m_bakedOuterProb[0], nCos);
+	}
+
+	/// Fill the table by histogramming sampled random walks
+	void bake() {
+		const int nCos = bakedCosCount();
+		const Float cellSolidAngle = bakedCellSolidAngle();
+
+		ref<Sampler> sampler = static_cast<Sampler *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Sampler), Properties("independent")));
+
+		Intersection its;
+		its.p = Point(0.0);
+		its.uv = Point2(0.0);
+		BSDFSamplingRecord bRec(its, sampler, ERadiance);
+
+		Scratch &scratch = getScratch();
+		LayerParams &params = scratch.params;
+		setParameters<0, true>(bRec, params);
+
+		m_bakedValue.assign(nCos * nCos * m_bakedPhiRes, Spectrum(0.0));
+		m_bakedOuterProb.assign(nCos, Float(0.0));
+
+		for (int i = 0; i < nCos; ++i) {
+			Float cosThetaI = m_bakedCosMin + (i + Float(0.5)) * (1 - m_bakedCosMin) / nCos;
+			Vector wi(math::safe_sqrt(1 - cosThetaI * cosThetaI), 0, cosThetaI);
+			Spectrum *slice = &m_bakedValue[i * nCos * m_bakedPhiRes];
+
+			Float outer = 0.0;
+			for (int s = 0; s < m_bakedSamples; ++s) {
+				bRec.wi = wi;
+				Spectrum weight = generatePath<0>(bRec, params, -1, scratch.forward, false, false);
+				if (weight.isZero() || !weight.isValid())
+					continue;
+
+				if (scratch.forward.size() == 1 && bRec.wi.z * bRec.wo.z > 0) {
+					outer += weight.getLuminance();
+					continue;
+				}
+				if (bRec.wo.z < m_bakedCosMin)
+					continue;
+
+				int j = std::min((int) ((bRec.wo.z - m_bakedCosMin) / (1 - m_bakedCosMin) * nCos), nCos - 1);
+				int k = std::min((int) (bakedPhiD(wi, bRec.wo) * INV_PI * m_bakedPhiRes), m_bakedPhiRes - 1);
+				slice[j * m_bakedPhiRes + k] += weight;
+			}
+
+			for (int c = 0; c < nCos * m_bakedPhiRes; ++c)
+				slice[c] /= m_bakedSamples * cellSolidAngle;
+			m_bakedOuterProb[i] = outer / m_bakedSamples;
+		}
+	}
+
+	void configureBaked() {
+		m_bakedCosMin = BSDF::hasComponent(BSDF::ETransmission) ? Float(-1.0) : Float(0.0);
+
+		uint64_t key = bakedKey();
+		fs::path cachePath;
+		bool loaded = false;
+		if (!m_bakedCache.empty()) {
+			cachePath = Thread::getThread()->getFileResolver()->resolve(m_bakedCache);
+			loaded = loadBaked(cachePath, key);
+		}
+
+		if (!loaded) {
+			cout << "[GY]: Baking " << bakedCosCount() << "x" << bakedCosCount() << "x" << m_bakedPhiRes
+				 << " table with " << m_bakedSamples << " walks per incident bin" << endl;
+			bake();
+			if (!m_bakedCache.empty())
+				saveBaked(cachePath, key);
+		}
+		else {
+			cout << "[GY]: Loaded baked table from " << cachePath.string() << endl;
+		}
+
+		/* Sampling CDFs and the outer/table selection probabilities */
+		const int nCos = bakedCosCount();
+		const Float cellSolidAngle = bakedCellSolidAngle();
+		m_bakedCDF.resize(nCos);
+		for (int i = 0; i < nCos; ++i) {
+			DiscreteDistribution &cdf = m_bakedCDF[i];
+			cdf.clear();
+			cdf.reserve(nCos * m_bakedPhiRes);
+			for (int c = 0; c < nCos * m_bakedPhiRes; ++c)
+				cdf.append(std::max((Float) 0, m_bakedValue[i * nCos * m_bakedPhiRes + c].getLuminance()) * cellSolidAngle);
+			Float tableAlbedo = cdf.normalize();
+			Float outerAlbedo = m_bakedOuterProb[i];
+			m_bakedOuterProb[i] = outerAlbedo + tableAlbedo > 0 ? outerAlbedo / (outerAlbedo + tableAlbedo) : Float(0.0);
+		}
+	}
+
 	Float getEta() const {
 		return m_eta;
 	}
@@ -1584,27 +2715,27 @@ public:
 		else if (child->getClass()->derivesFrom(MTS_CLASS(Texture2D))) {
 			if (prefix == "normal_tex") {
 				std::cout << "[GY]: layer " << index + 1 << " of " << m_nbLayers << " :: surface :: normal(texture)" << std::endl;
-				m_flag_normals[index] = true;
+				m_flag_normals |= 1u << index;
 				m_texture_normals[index] = static_cast<Texture2D *>(child);
 			}
 			else if (prefix == "sigmaT_tex") {
 				std::cout << "[GY]: layer " << index + 1 << " of " << m_nbLayers << " :: medium :: sigmaT(texture)" << std::endl;
-				m_flag_sigmaTs[index] = true;
+				m_flag_sigmaTs |= 1u << index;
 				m_texture_sigmaTs[index] = static_cast<Texture2D *>(child);
 			}
 			else if (prefix == "density_tex") {
 				std::cout << "[GY]: layer " << index + 1 << " of " << m_nbLayers << " :: medium :: density(texture)" << std::endl;
-				m_flag_densities[index] = true;
+				m_flag_densities |= 1u << index;
 				m_texture_densities[index] = static_cast<Texture2D *>(child);
 			}
 			else if (prefix == "albedo_tex") {
 				std::cout << "[GY]: layer " << index + 1 << " of " << m_nbLayers << " :: medium :: albedo(texture)" << std::endl;
-				m_flag_albedos[index] = true;
+				m_flag_albedos |= 1u << index;
 				m_texture_albedos[index] = static_cast<Texture2D *>(child);
 			}
 			else if (prefix == "orientation_tex") {
 				std::cout << "[GY]: layer " << index + 1 << " of " << m_nbLayers << " :: medium :: orientation(texture)" << std::endl;
-				m_flag_orientations[index] = true;
+				m_flag_orientations |= 1u << index;
 				m_texture_orientations[index] = static_cast<Texture2D *>(child);
 			}
 			else
@@ -1627,11 +2758,16 @@ public:
 private:
 	int m_maxDepth;
 	Float m_maxSurvivalProb;
+	int m_rrDepth;
+	Float m_rrMaxSurvival;
 
 	bool m_MISenable;
 	bool m_multiLayerSupport;
 	bool m_bidirUseAnalog;
 	bool m_bidir;
+	bool m_fusedPdf;
+	bool m_analyticTop;
+	int m_maxConnections;
 	std::string m_pdfMode;
 	int m_stochPdfDepth;
 	int m_pdfRepetitive;
@@ -1641,30 +2777,54 @@ private:
 	int m_nbLayers;
 		
 	ref_vector<BSDF> m_bsdfs;
-	std::vector<ref_vector<Medium>> m_mediums, m_pdfMediums;
 	ref_vector<PhaseFunction> m_phaseFunctions;
+
+	mutable ThreadLocal<Scratch> m_scratch;
+	mutable std::atomic<bool> m_anomalyReported[EWalkAnomalyCount];
+
+	EvalKernel m_evalKernel;
+	PdfKernel m_pdfKernel;
+	SampleKernel m_sampleKernel;
+	SamplePdfKernel m_samplePdfKernel;
+	EvalAndSampleKernel m_evalAndSampleKernel;
+	std::vector<Frame> m_constFrames;
+	std::vector<SlabMedium> m_constMediums;
+
+	bool m_useAtlas;
+	int m_atlasResolution;
+	size_t m_atlasMaxMemory;                      // in bytes
+	uint32_t m_atlasMask;                         // layers with an atlas
+	std::vector<LayerAtlas> m_atlas;
+
+	bool m_baked;
+	int m_bakedCosRes, m_bakedPhiRes, m_bakedSamples;
+	std::string m_bakedCache;
+	Float m_bakedCosMin;
+	std::vector<Spectrum> m_bakedValue;           // [cosThetaI][cosThetaO][phiD]
+	std::vector<DiscreteDistribution> m_bakedCDF; // one per cosThetaI bin
+	std::vector<Float> m_bakedOuterProb;
 	
 	std::vector<Spectrum> m_spectrum_sigmaTs;
 	ref_vector<Texture2D> m_texture_sigmaTs;
-	std::vector<bool> m_flag_sigmaTs;
+	uint32_t m_flag_sigmaTs;
 
 	std::vector<Float> m_float_densities;
 	ref_vector<Texture2D> m_texture_densities;
-	std::vector<bool> m_flag_densities;
+	uint32_t m_flag_densities;
 
 	std::vector<Spectrum> m_spectrum_albedos;
 	ref_vector<Texture2D> m_texture_albedos;
-	std::vector<bool> m_flag_albedos;
+	uint32_t m_flag_albedos;
 
 	std::vector<Vector> m_vector_orientations;
 	ref_vector<Texture2D> m_texture_orientations;
-	std::vector<bool> m_flag_orientations;
+	uint32_t m_flag_orientations;
 
-	std::vector<bool> m_flag_aniso;
+	uint32_t m_flag_aniso;
 	
 	std::vector<Vector> m_vector_normals;
 	ref_vector<Texture2D> m_texture_normals;
-	std::vector<bool> m_flag_normals;
+	uint32_t m_flag_normals;
 };
 
 
@@ -21,6 +21,7 @@
 #include <mitsuba/hw/basicshader.h>
 #include "microfacet.h"
 #include "ior.h"
+#include "thinfilm.h"
 
 MTS_NAMESPACE_BEGIN
 
@@ -201,7 +202,20 @@ public:
         
 
 
-        m_thickness = props.getFloat("thickness", 400);
+        /* Film thickness in nanometers, either constant or a texture */
+        m_thickness = new ConstantFloatTexture(props.getFloat("thickness", 400));
+
+        /* Tabulate the film reflectance at configure() time instead of
+           evaluating the interference terms for every query */
+        m_filmTable = props.getBoolean("filmTable", true);
+        m_filmTableError = props.getFloat("filmTableError", 1e-3f);
+        m_filmModel = lookupFilmModel(props);
+
+        if (m_filmModel == ThinFilmTable::ESpectral && !m_filmTable) {
+            Log(EWarn, "The spectral film model is only available through "
+                "the lookup table, ignoring filmTable=false");
+            m_filmTable = true;
+        }
 
         if (intIOR < 0 || extIOR < 0 || intIOR == extIOR)
             Log(EError, "The interior and exterior indices of "
@@ -229,7 +243,14 @@ public:
         m_alphaV = static_cast<Texture *>(manager->getInstance(stream));
         m_specularReflectance = static_cast<Texture *>(manager->getInstance(stream));
         m_specularTransmittance = static_cast<Texture *>(manager->getInstance(stream));
+        m_thickness = static_cast<Texture *>(manager->getInstance(stream));
         m_eta = stream->readFloat();
+        extIOR = stream->readFloat();
+        mediumIOR = stream->readFloat();
+        intIOR = stream->readFloat();
+        m_filmTable = stream->readBool();
+        m_filmModel = (ThinFilmTable::EModel) stream->readInt();
+        m_filmTableError = stream->readFloat();
         m_invEta = 1 / m_eta;
 
         configure();
@@ -249,7 +270,14 @@ public:
         manager->serialize(stream, m_alphaV.get());
         manager->serialize(stream, m_specularReflectance.get());
         manager->serialize(stream, m_specularTransmittance.get());
+        manager->serialize(stream, m_thickness.get());
         stream->writeFloat(m_eta);
+        stream->writeFloat(extIOR);
+        stream->writeFloat(mediumIOR);
+        stream->writeFloat(intIOR);
+        stream->writeBool(m_filmTable);
+        stream->writeInt(m_filmModel);
+        stream->writeFloat(m_filmTableError);
     }
 
     void configure() {
@@ -257,7 +285,15 @@ public:
         if (m_alphaU != m_alphaV)
             extraFlags |= EAnisotropic;
 
-        if (!m_alphaU->isConstant() || !m_alphaV->isConstant())
+        /* A constant thickness gives a table over the incident angle only.
+           Otherwise, the table spans the range of the thickness texture */
+        m_thicknessMin = m_thickness->getMinimum().min();
+        m_thicknessMax = m_thickness->getMaximum().max();
+        if (m_thicknessMin < 0)
+            Log(EError, "The film thickness must be nonnegative!");
+
+        if (!m_alphaU->isConstant() || !m_alphaV->isConstant()
+                || m_thicknessMax > m_thicknessMin)
             extraFlags |= ESpatiallyVarying;
 
         m_components.clear();
@@ -278,108 +314,86 @@ public:
             m_alphaU->usesRayDifferentials() ||
             m_alphaV->usesRayDifferentials() ||
             m_specularReflectance->usesRayDifferentials() ||
-            m_specularTransmittance->usesRayDifferentials();
+            m_specularTransmittance->usesRayDifferentials() ||
+            m_thickness->usesRayDifferentials();
+
+        if (m_filmTable) {
+            m_filmTableExt = ThinFilmTable(extIOR, mediumIOR, intIOR,
+                m_thicknessMin, m_thicknessMax, m_filmModel, m_filmTableError);
+            m_filmTableInt = ThinFilmTable(intIOR, mediumIOR, extIOR,
+                m_thicknessMin, m_thicknessMax, m_filmModel, m_filmTableError);
+        }
 
         BSDF::configure();
     }
 
-    Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
-        if (measure != ESolidAngle || Frame::cosTheta(bRec.wi) == 0)
-            return Spectrum(0.0f);
-
-        /* Determine the type of interaction */
-        bool reflect = Frame::cosTheta(bRec.wi)
-            * Frame::cosTheta(bRec.wo) > 0;
-
-        Vector H;
-        if (reflect) {
-            /* Stop if this component was not requested */
-            if ((bRec.component != -1 && bRec.component != 0)
-                || !(bRec.typeMask & EGlossyReflection))
-                return Spectrum(0.0f);
-
-            /* Calculate the reflection half-vector */
-            H = normalize(bRec.wo+bRec.wi);
+    /**
+     * \brief RGB thin-film reflectance and transmittance of a microfacet
+     * for an incident cosine on either side of the interface
+     *
+     * \c cosThetaT follows the convention of \ref fresnelDielectricExt()
+     * and is zero under total internal reflection.
+     */
+    inline void evalThinFilm(Float cosThetaI, Float thickness,
+            Float *R, Float *T, Float &cosThetaT) const {
+        Float cos0 = std::abs(cosThetaI);
+
+        if (m_filmTable) {
+            const ThinFilmTable &table = cosThetaI > 0 ? m_filmTableExt : m_filmTableInt;
+            table.eval(cos0, thickness, R, T);
+            cosThetaT = table.cosThetaT(cos0);
         } else {
-            /* Stop if this component was not requested */
-            if ((bRec.component != -1 && bRec.component != 1)
-                || !(bRec.typeMask & EGlossyTransmission))
-                return Spectrum(0.0f);
+            Float n0 = cosThetaI > 0 ? extIOR : intIOR,
+                  n2 = cosThetaI > 0 ? intIOR : extIOR;
 
-            /* Calculate the transmission half-vector */
-            Float eta = Frame::cosTheta(bRec.wi) > 0
-                ? m_eta : m_invEta;
-
-            H = normalize(bRec.wi + bRec.wo*eta);
+            if (m_filmModel == ThinFilmTable::EFourier) {
+                ThinFilmReflectanceFourier(&cos0, 1, thickness, n0, mediumIOR, n2, R, &cosThetaT);
+                for (int i=0; i<ThinFilmTable::Channels; ++i)
+                    T[i] = 1 - R[i];
+            } else {
+                ThinFilmTransmissionRGB(&cos0, 1, thickness, n0, mediumIOR, n2, T, &cosThetaT);
+                for (int i=0; i<ThinFilmTable::Channels; ++i)
+                    R[i] = 1 - T[i];
+            }
         }
 
-        /* Ensure that the half-vector points into the
-           same hemisphere as the macrosurface normal */
-        H *= math::signum(Frame::cosTheta(H));
+        if (cosThetaI > 0)
+            cosThetaT = -cosThetaT;
+    }
 
-        /* Construct the microfacet distribution matching the
-           roughness values at the current surface position. */
-        MicrofacetDistribution distr(
+    /// Construct the microfacet distribution matching the roughness values at \c its
+    inline MicrofacetDistribution getDistribution(const Intersection &its) const {
+        return MicrofacetDistribution(
             m_type,
-            m_alphaU->eval(bRec.its).average(),
-            m_alphaV->eval(bRec.its).average(),
+            m_alphaU->eval(its).average(),
+            m_alphaV->eval(its).average(),
             m_sampleVisible
         );
+    }
 
-        /* Evaluate the microfacet normal distribution */
-        const Float D = distr.eval(H);
-        if (D == 0)
-            return Spectrum(0.0f);
-
-        /* Fresnel factor */
-        //const Float F = fresnelDielectricExt(dot(bRec.wi, H), m_eta);
-        float r, g, b;
-        
-        if(Frame::cosTheta(bRec.wi) > 0){
-            r = ThinFilmReflectance(dot(bRec.wi, H), 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-            g = ThinFilmReflectance(dot(bRec.wi, H), 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-            b = ThinFilmReflectance(dot(bRec.wi, H), 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-        }else{
-            r = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-            g = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-            b = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-        }
-        
-
-        Float F = (r + g + b) / Float(3.0f);
-
-        /* Smith's shadow-masking function */
-        const Float G = distr.G(bRec.wi, bRec.wo, H);
-
-        if (reflect) {
-            /* Calculate the total amount of reflection */
-            Float value = F * D * G /
-                (4.0f * std::abs(Frame::cosTheta(bRec.wi)));
-
-            return m_specularReflectance->eval(bRec.its) * value;
-        } else {
-            Float eta = Frame::cosTheta(bRec.wi) > 0.0f ? m_eta : m_invEta;
-
-            /* Calculate the total amount of transmission */
-            Float sqrtDenom = dot(bRec.wi, H) + eta * dot(bRec.wo, H);
-            Float value = ((1 - F) * D * G * eta * eta
-                * dot(bRec.wi, H) * dot(bRec.wo, H)) /
-                (Frame::cosTheta(bRec.wi) * sqrtDenom * sqrtDenom);
-
-            /* Missing term in the original paper: account for the solid angle
-               compression when tracing radiance -- this is necessary for
-               bidirectional methods */
-            Float factor = (bRec.mode == ERadiance)
-                ? (Frame::cosTheta(bRec.wi) > 0 ? m_invEta : m_eta) : 1.0f;
-
-            return m_specularTransmittance->eval(bRec.its)
-                * std::abs(value * factor * factor);
-        }
+    /// Film thickness at \c its, skipping the texture lookup when it is constant
+    inline Float getThickness(const Intersection &its) const {
+        if (m_thicknessMax == m_thicknessMin)
+            return m_thicknessMin;
+        return m_thickness->eval(its).average();
     }
 
-    Float pdf(const BSDFSamplingRecord &bRec, EMeasure measure) const {
-        if (measure != ESolidAngle)
-            return 0.0f;
+    /**
+     * \brief Shared implementation of \ref eval() and \ref pdf()
+     *
+     * Fills in \c value and/or \c pdf (either may be \c NULL), so that a
+     * combined query computes the half-vector and the thin-film terms once.
+     */
+    void evalAndPdf(const BSDFSamplingRecord &bRec, EMeasure measure,
+            const MicrofacetDistribution &distr, Float thickness,
+            Spectrum *value, Float *pdf) const {
+        if (value)
+            *value = Spectrum(0.0f);
+        if (pdf)
+            *pdf = 0.0f;
+
+        if (measure != ESolidAngle || Frame::cosTheta(bRec.wi) == 0)
+            return;
 
         /* Determine the type of interaction */
         bool hasReflection   = ((bRec.component == -1 || bRec.component == 0)
@@ -389,28 +403,21 @@ public:
              reflect         = Frame::cosTheta(bRec.wi)
                              * Frame::cosTheta(bRec.wo) > 0;
 
-        Vector H;
-        Float dwh_dwo;
+        /* Stop if this component was not requested */
+        if (reflect ? !hasReflection : !hasTransmission)
+            return;
 
+        Vector H;
+        Float eta = 1.0f, dwh_dwo;
         if (reflect) {
-            /* Zero probability if this component was not requested */
-            if ((bRec.component != -1 && bRec.component != 0)
-                || !(bRec.typeMask & EGlossyReflection))
-                return 0.0f;
-
             /* Calculate the reflection half-vector */
             H = normalize(bRec.wo+bRec.wi);
 
             /* Jacobian of the half-direction mapping */
             dwh_dwo = 1.0f / (4.0f * dot(bRec.wo, H));
         } else {
-            /* Zero probability if this component was not requested */
-            if ((bRec.component != -1 && bRec.component != 1)
-                || !(bRec.typeMask & EGlossyTransmission))
-                return 0.0f;
-
             /* Calculate the transmission half-vector */
-            Float eta = Frame::cosTheta(bRec.wi) > 0
+            eta = Frame::cosTheta(bRec.wi) > 0
                 ? m_eta : m_invEta;
 
             H = normalize(bRec.wi + bRec.wo*eta);
@@ -424,179 +431,68 @@ public:
            same hemisphere as the macrosurface normal */
         H *= math::signum(Frame::cosTheta(H));
 
-        /* Construct the microfacet distribution matching the
-           roughness values at the current surface position. */
-        MicrofacetDistribution sampleDistr(
-            m_type,
-            m_alphaU->eval(bRec.its).average(),
-            m_alphaV->eval(bRec.its).average(),
-            m_sampleVisible
-        );
-
-        /* Trick by Walter et al.: slightly scale the roughness values to
-           reduce importance sampling weights. Not needed for the
-           Heitz and D'Eon sampling technique. */
-        if (!m_sampleVisible)
-            sampleDistr.scaleAlpha(1.2f - 0.2f * std::sqrt(
-                std::abs(Frame::cosTheta(bRec.wi))));
-
-        /* Evaluate the microfacet model sampling density function */
-        Float prob = sampleDistr.pdf(math::signum(Frame::cosTheta(bRec.wi)) * bRec.wi, H);
-
-        if (hasTransmission && hasReflection) {
-            //Float F = fresnelDielectricExt(dot(bRec.wi, H), m_eta);
-            float r, g, b;
-        
-            if(Frame::cosTheta(bRec.wi) > 0){
-                r = ThinFilmReflectance(dot(bRec.wi, H), 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-                g = ThinFilmReflectance(dot(bRec.wi, H), 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-                b = ThinFilmReflectance(dot(bRec.wi, H), 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-            }else{
-                r = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-                g = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-                b = ThinFilmReflectance(std::abs(dot(bRec.wi, H)), 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-            }
-            
-
-            Float F = (r + g + b) / Float(3.0f);
-            
-            prob *= reflect ? F : (1-F);
-        }
-
-        return std::abs(prob * dwh_dwo);
-    }
-
-    Spectrum sample(BSDFSamplingRecord &bRec, const Point2 &_sample) const {
-        Point2 sample(_sample);
-
-        bool hasReflection = ((bRec.component == -1 || bRec.component == 0)
-                              && (bRec.typeMask & EGlossyReflection)),
-             hasTransmission = ((bRec.component == -1 || bRec.component == 1)
-                              && (bRec.typeMask & EGlossyTransmission)),
-             sampleReflection = hasReflection;
-
-        if (!hasReflection && !hasTransmission)
-            return Spectrum(0.0f);
-
-        /* Construct the microfacet distribution matching the
-           roughness values at the current surface position. */
-        MicrofacetDistribution distr(
-            m_type,
-            m_alphaU->eval(bRec.its).average(),
-            m_alphaV->eval(bRec.its).average(),
-            m_sampleVisible
-        );
-
-        /* Trick by Walter et al.: slightly scale the roughness values to
-           reduce importance sampling weights. Not needed for the
-           Heitz and D'Eon sampling technique. */
-        MicrofacetDistribution sampleDistr(distr);
-        if (!m_sampleVisible)
-            sampleDistr.scaleAlpha(1.2f - 0.2f * std::sqrt(
-                std::abs(Frame::cosTheta(bRec.wi))));
-
-        /* Sample M, the microfacet normal */
-        Float microfacetPDF;
-        const Normal m = sampleDistr.sample(math::signum(Frame::cosTheta(bRec.wi)) * bRec.wi, sample, microfacetPDF);
-        if (microfacetPDF == 0)
-            return Spectrum(0.0f);
-
-        Float cosThetaT;
-        //Float F = fresnelDielectricExt(dot(bRec.wi, m), cosThetaT, m_eta);
-        float r, g, b;
-        
-        if(Frame::cosTheta(bRec.wi) > 0){
-            r = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-            g = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-            b = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-        }else{
-            r = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)), cosThetaT, 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-            g = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)),  cosThetaT, 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-            b = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)),  cosThetaT, 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-            cosThetaT = -cosThetaT;
-        }
-        
-
-        Float F = (r + g + b) / Float(3.0f);
-        Spectrum weight(1.0f);
+        /* Evaluate the microfacet normal distribution */
+        const Float D = value ? distr.eval(H) : 0.0f;
+        bool needsFilm = (value && D != 0) || (pdf && hasReflection && hasTransmission);
 
-        if (hasReflection && hasTransmission) {
-            if (bRec.sampler->next1D() > F)
-                sampleReflection = false;
-        } else {
-            weight = Spectrum(hasReflection ? F : (1-F));
+        /* Fresnel factor */
+        Float F = 0.0f;
+        if (needsFilm) {
+            Float R[SPECTRUM_SAMPLES], T[SPECTRUM_SAMPLES], cosThetaT;
+            evalThinFilm(dot(bRec.wi, H), thickness, R, T, cosThetaT);
+            F = (R[0] + R[1] + R[2]) / Float(3.0f);
         }
 
-        if (sampleReflection) {
-            /* Perfect specular reflection based on the microfacet normal */
-            Float RGB[SPECTRUM_SAMPLES];
-            RGB[0] = r;
-            RGB[1] = g;
-            RGB[2] = b;
-
-            Spectrum spec(RGB);
-            bRec.wo = reflect(bRec.wi, m);
-            bRec.eta = 1.0f;
-            bRec.sampledComponent = 0;
-            bRec.sampledType = EGlossyReflection;
+        if (value && D != 0) {
+            /* Smith's shadow-masking function */
+            const Float G = distr.G(bRec.wi, bRec.wo, H);
 
-            /* Side check */
-            if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) <= 0)
-                return Spectrum(0.0f);
+            if (reflect) {
+                /* Calculate the total amount of reflection */
+                Float result = F * D * G /
+                    (4.0f * std::abs(Frame::cosTheta(bRec.wi)));
 
-            weight *= m_specularReflectance->eval(bRec.its) * (spec/F);
-        } else {
-            Float RGB[SPECTRUM_SAMPLES];
-
-            if(Frame::cosTheta(bRec.wi) > 0){ // estamos chocando por el exterior del material
-                r = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-                g = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-                b = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-            }else{ // estamos chocando por el interior del material
-                r = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-                g = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-                b = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-                cosThetaT = -cosThetaT;
+                *value = m_specularReflectance->eval(bRec.its) * result;
+            } else {
+                /* Calculate the total amount of transmission */
+                Float sqrtDenom = dot(bRec.wi, H) + eta * dot(bRec.wo, H);
+                Float result = ((1 - F) * D * G * eta * eta
+                    * dot(bRec.wi, H) * dot(bRec.wo, H)) /
+                    (Frame::cosTheta(bRec.wi) * sqrtDenom * sqrtDenom);
+
+                /* Missing term in the original paper: account for the solid angle
+                   compression when tracing radiance -- this is necessary for
+                   bidirectional methods */
+                Float factor = (bRec.mode == ERadiance)
+                    ? (Frame::cosTheta(bRec.wi) > 0 ? m_invEta : m_eta) : 1.0f;
+
+                *value = m_specularTransmittance->eval(bRec.its)
+                    * std::abs(result * factor * factor);
             }
-            
+        }
 
-            RGB[0] = r;
-            RGB[1] = g;
-            RGB[2] = b;
+        if (pdf) {
+            /* Trick by Walter et al.: slightly scale the roughness values to
+               reduce importance sampling weights. Not needed for the
+               Heitz and D'Eon sampling technique. */
+            MicrofacetDistribution sampleDistr(distr);
+            if (!m_sampleVisible)
+                sampleDistr.scaleAlpha(1.2f - 0.2f * std::sqrt(
+                    std::abs(Frame::cosTheta(bRec.wi))));
 
-            Spectrum spec(RGB);
-            if (cosThetaT == 0)
-                return Spectrum(0.0f);
-            
+            /* Evaluate the microfacet model sampling density function */
+            Float prob = sampleDistr.pdf(math::signum(Frame::cosTheta(bRec.wi)) * bRec.wi, H);
 
-            /* Perfect specular transmission based on the microfacet normal */
-            bRec.wo = refract(bRec.wi, m, m_eta, cosThetaT);
-            bRec.eta = cosThetaT < 0 ? m_eta : m_invEta;
-            bRec.sampledComponent = 1;
-            bRec.sampledType = EGlossyTransmission;
-
-            /* Side check */
-            if (Frame::cosTheta(bRec.wi) * Frame::cosTheta(bRec.wo) >= 0)
-                return Spectrum(0.0f);
+            if (hasTransmission && hasReflection)
+                prob *= reflect ? F : (1-F);
 
-            /* Radiance must be scaled to account for the solid angle compression
-               that occurs when crossing the interface. */
-            Float factor = (bRec.mode == ERadiance)
-                ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
-
-            weight *= m_specularTransmittance->eval(bRec.its) * (spec/(1-F));
+            *pdf = std::abs(prob * dwh_dwo);
         }
-
-        if (m_sampleVisible)
-            weight *= distr.smithG1(bRec.wo, m);
-        else
-            weight *= std::abs(distr.eval(m) * distr.G(bRec.wi, bRec.wo, m)
-                * dot(bRec.wi, m) / (microfacetPDF * Frame::cosTheta(bRec.wi)));
-
-        return weight;
     }
 
-    Spectrum sample(BSDFSamplingRecord &bRec, Float &pdf, const Point2 &_sample) const {
+    /// Shared implementation of the \ref sample() variants and \ref evalAndSample()
+    Spectrum sample(BSDFSamplingRecord &bRec, Float &pdf, const Point2 &_sample,
+            const MicrofacetDistribution &distr, Float thickness) const {
         Point2 sample(_sample);
 
         bool hasReflection = ((bRec.component == -1 || bRec.component == 0)
@@ -608,15 +504,6 @@ public:
         if (!hasReflection && !hasTransmission)
             return Spectrum(0.0f);
 
-        /* Construct the microfacet distribution matching the
-           roughness values at the current surface position. */
-        MicrofacetDistribution distr(
-            m_type,
-            m_alphaU->eval(bRec.its).average(),
-            m_alphaV->eval(bRec.its).average(),
-            m_sampleVisible
-        );
-
         /* Trick by Walter et al.: slightly scale the roughness values to
            reduce importance sampling weights. Not needed for the
            Heitz and D'Eon sampling technique. */
@@ -633,22 +520,10 @@ public:
         pdf = microfacetPDF;
 
         Float cosThetaT;
-        //Float F = fresnelDielectricExt(dot(bRec.wi, m), cosThetaT, m_eta);
-        float r, g, b;
-        
-        if(Frame::cosTheta(bRec.wi) > 0){
-            r = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-            g = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-            b = ThinFilmReflectanceExt(dot(bRec.wi, m), cosThetaT, 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-        }else{
-            r = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)), cosThetaT, 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-            g = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)),  cosThetaT, 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-            b = ThinFilmReflectanceExt(std::abs(dot(bRec.wi, m)),  cosThetaT, 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-            cosThetaT = -cosThetaT;
-        }
-        
+        Float R[SPECTRUM_SAMPLES], T[SPECTRUM_SAMPLES];
+        evalThinFilm(dot(bRec.wi, m), thickness, R, T, cosThetaT);
 
-        Float F = (r + g + b) / Float(3.0f);
+        Float F = (R[0] + R[1] + R[2]) / Float(3.0f);
         Spectrum weight(1.0f);
 
         if (hasReflection && hasTransmission) {
@@ -665,12 +540,7 @@ public:
         Float dwh_dwo;
         if (sampleReflection) {
             /* Perfect specular reflection based on the microfacet normal */
-            Float RGB[SPECTRUM_SAMPLES];
-            RGB[0] = r;
-            RGB[1] = g;
-            RGB[2] = b;
-
-            Spectrum spec(RGB);
+            Spectrum spec(R);
             bRec.wo = reflect(bRec.wi, m);
             bRec.eta = 1.0f;
             bRec.sampledComponent = 0;
@@ -685,25 +555,7 @@ public:
             /* Jacobian of the half-direction mapping */
             dwh_dwo = 1.0f / (4.0f * dot(bRec.wo, m));
         } else {
-            Float RGB[SPECTRUM_SAMPLES];
-
-            if(Frame::cosTheta(bRec.wi) > 0){ // estamos chocando por el exterior del material
-                r = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 650.0, m_thickness, extIOR, mediumIOR, intIOR);
-                g = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 510.0, m_thickness, extIOR, mediumIOR, intIOR);
-                b = ThinFilmTransmissionExt(dot(bRec.wi, m), cosThetaT, 475.0, m_thickness, extIOR, mediumIOR, intIOR);
-            }else{ // estamos chocando por el interior del material
-                r = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 650.0, m_thickness, intIOR, mediumIOR, extIOR);
-                g = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 510.0, m_thickness, intIOR, mediumIOR, extIOR);
-                b = ThinFilmTransmissionExt(std::abs(dot(bRec.wi, m)), cosThetaT, 475.0, m_thickness, intIOR, mediumIOR, extIOR);
-                cosThetaT = -cosThetaT;
-            }
-            
-
-            RGB[0] = r;
-            RGB[1] = g;
-            RGB[2] = b;
-
-            Spectrum spec(RGB);
+            Spectrum spec(T);
             if (cosThetaT == 0)
                 return Spectrum(0.0f);
 
@@ -718,11 +570,12 @@ public:
                 return Spectrum(0.0f);
 
             /* Radiance must be scaled to account for the solid angle compression
-               that occurs when crossing the interface. */
+               that occurs when crossing the interface (as in eval()). */
             Float factor = (bRec.mode == ERadiance)
                 ? (cosThetaT < 0 ? m_invEta : m_eta) : 1.0f;
 
-            weight *= m_specularTransmittance->eval(bRec.its) * (spec/(1-F));
+            weight *= m_specularTransmittance->eval(bRec.its)
+                * (spec/(1-F)) * (factor * factor);
 
             /* Jacobian of the half-direction mapping */
             Float sqrtDenom = dot(bRec.wi, m) + bRec.eta * dot(bRec.wo, m);
@@ -740,6 +593,50 @@ public:
         return weight;
     }
 
+    Spectrum eval(const BSDFSamplingRecord &bRec, EMeasure measure) const {
+        Spectrum value;
+        evalAndPdf(bRec, measure, getDistribution(bRec.its),
+            getThickness(bRec.its), &value, NULL);
+        return value;
+    }
+
+    Spectrum eval(const BSDFSamplingRecord &bRec, Float &pdf, EMeasure measure) const {
+        Spectrum value;
+        evalAndPdf(bRec, measure, getDistribution(bRec.its),
+            getThickness(bRec.its), &value, &pdf);
+        return value;
+    }
+
+    Float pdf(const BSDFSamplingRecord &bRec, EMeasure measure) const {
+        Float pdf;
+        evalAndPdf(bRec, measure, getDistribution(bRec.its),
+            getThickness(bRec.its), NULL, &pdf);
+        return pdf;
+    }
+
+    Spectrum sample(BSDFSamplingRecord &bRec, const Point2 &sample) const {
+        Float pdf;
+        return RoughDielectric::sample(bRec, pdf, sample,
+            getDistribution(bRec.its), getThickness(bRec.its));
+    }
+
+    Spectrum sample(BSDFSamplingRecord &bRec, Float &pdf, const Point2 &sample) const {
+        return RoughDielectric::sample(bRec, pdf, sample,
+            getDistribution(bRec.its), getThickness(bRec.its));
+    }
+
+    void evalAndSample(BSDFSamplingRecord &bRec, Spectrum &evalVal, Float &evalPdf,
+            Spectrum &sampleVal, Float &samplePdf, const Point2 &nextSample,
+            EMeasure measure) const {
+        /* Both queries share the intersection, hence the texture lookups */
+        MicrofacetDistribution distr = getDistribution(bRec.its);
+        Float thickness = getThickness(bRec.its);
+
+        const BSDFSamplingRecord evalRec(bRec);
+        evalAndPdf(evalRec, measure, distr, thickness, &evalVal, &evalPdf);
+        sampleVal = RoughDielectric::sample(bRec, samplePdf, nextSample, distr, thickness);
+    }
+
     void addChild(const std::string &name, ConfigurableObject *child) {
         if (child->getClass()->derivesFrom(MTS_CLASS(Texture))) {
             if (name == "alpha")
@@ -752,6 +649,8 @@ public:
                 m_specularReflectance = static_cast<Texture *>(child);
             else if (name == "specularTransmittance")
                 m_specularTransmittance = static_cast<Texture *>(child);
+            else if (name == "thickness")
+                m_thickness = static_cast<Texture *>(child);
             else
                 BSDF::addChild(name, child);
         } else {
@@ -804,6 +703,13 @@ public:
             << "  eta = " << m_eta << "," << endl
             << "  alphaU = " << indent(m_alphaU->toString()) << "," << endl
             << "  alphaV = " << indent(m_alphaV->toString()) << "," << endl
+            << "  extIOR = " << extIOR << "," << endl
+            << "  mediumIOR = " << mediumIOR << "," << endl
+            << "  intIOR = " << intIOR << "," << endl
+            << "  thickness = " << indent(m_thickness->toString()) << "," << endl
+            << "  filmTable = " << m_filmTable << "," << endl
+            << "  filmModel = " << filmModelName(m_filmModel) << "," << endl
+            << "  filmTableError = " << m_filmTableError << "," << endl
             << "  specularReflectance = " << indent(m_specularReflectance->toString()) << "," << endl
             << "  specularTransmittance = " << indent(m_specularTransmittance->toString()) << endl
             << "]";
@@ -824,7 +730,12 @@ private:
     //Thin-film properties
     Spectrum m_eta1, m_eta2;
     Float extIOR, mediumIOR, intIOR;
-    Float m_thickness, m_thickness_variation;
+    ref<Texture> m_thickness;
+    Float m_thicknessMin, m_thicknessMax, m_thickness_variation;
+    ThinFilmTable m_filmTableExt, m_filmTableInt;
+    ThinFilmTable::EModel m_filmModel;
+    Float m_filmTableError;
+    bool m_filmTable;
 };
 
 /* Fake glass shader -- it is really hopeless to visualize
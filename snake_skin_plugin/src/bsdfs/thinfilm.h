@@ -0,0 +1,167 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__THINFILM_H)
+#define __THINFILM_H
+
+#include <mitsuba/core/properties.h>
+#include <mitsuba/core/fstream.h>
+#include <boost/algorithm/string.hpp>
+#include <cstdlib>
+
+/// File header of cached thin-film tables
+#define MTS_THINFILM_CACHE_MAGIC 0x4C465454
+
+/// Layout version of cached thin-film tables, bump when the file contents change
+#define MTS_THINFILM_CACHE_VERSION 1
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Look up the conversion of the thin-film spectrum to RGB
+ *
+ * Accepts \c rgb (interference at the three channel wavelengths),
+ * \c spectral (CIE-integrated spectrum, only available through
+ * \ref ThinFilmTable) and \c fourier (antialiased Airy summation, see
+ * \ref ThinFilmReflectanceFourier()).
+ */
+inline ThinFilmTable::EModel lookupFilmModel(const Properties &props,
+        const std::string &paramName = "filmModel",
+        const std::string &defaultValue = "rgb") {
+    std::string name = boost::to_lower_copy(
+        props.getString(paramName, defaultValue));
+
+    if (name == "rgb")
+        return ThinFilmTable::EPointSampled;
+    else if (name == "spectral")
+        return ThinFilmTable::ESpectral;
+    else if (name == "fourier")
+        return ThinFilmTable::EFourier;
+
+    SLog(EError, "Specified an invalid film model \"%s\", must be "
+        "\"rgb\", \"spectral\" or \"fourier\"!", name.c_str());
+    return ThinFilmTable::EPointSampled;
+}
+
+/// Name of a film model, as accepted by \ref lookupFilmModel()
+inline std::string filmModelName(ThinFilmTable::EModel model) {
+    switch (model) {
+        case ThinFilmTable::EPointSampled: return "rgb";
+        case ThinFilmTable::ESpectral: return "spectral";
+        case ThinFilmTable::EFourier: return "fourier";
+        default: return "unknown";
+    }
+}
+
+/// Print a list of film parameters, e.g. for \c toString()
+inline std::string filmListString(const std::vector<Float> &values) {
+    std::ostringstream oss;
+    oss << "[";
+    for (size_t i=0; i<values.size(); ++i)
+        oss << (i > 0 ? ", " : "") << values[i];
+    oss << "]";
+    return oss.str();
+}
+
+/**
+ * \brief Parse a comma or space separated list of film parameters
+ *
+ * Used by the multilayer film plugins, e.g.
+ * <tt>&lt;string name="filmIOR" value="1.38, 2.3"/&gt;</tt>.
+ */
+inline std::vector<Float> lookupFilmList(const Properties &props,
+        const std::string &paramName) {
+    std::vector<std::string> tokens = tokenize(
+        props.getString(paramName, ""), ", \t");
+    std::vector<Float> values(tokens.size());
+
+    for (size_t i=0; i<tokens.size(); ++i) {
+        char *end_ptr = NULL;
+        values[i] = (Float) std::strtod(tokens[i].c_str(), &end_ptr);
+        if (*end_ptr != '\0')
+            SLog(EError, "Could not parse the entry \"%s\" of \"%s\"!",
+                tokens[i].c_str(), paramName.c_str());
+    }
+
+    return values;
+}
+
+/**
+ * \brief Look up a film table in an on-disk cache, or build and store it
+ *
+ * The cache file is named after a hash of \c key, and also stores the key
+ * itself to reject hash collisions. \c key must therefore describe all
+ * the parameters that the table depends on. Files written with another
+ * layout version are rebuilt. An empty \c cacheDir disables the cache.
+ */
+template <typename Builder> ThinFilmTable cachedFilmTable(const std::string &cacheDir,
+        const std::string &key, const Builder &build) {
+    if (cacheDir.empty())
+        return build();
+
+    /* 64-bit FNV-1a hash of the key */
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i<key.length(); ++i)
+        hash = (hash ^ (uint8_t) key[i]) * 1099511628211ULL;
+
+    fs::path path = fs::path(cacheDir) / formatString("thinfilm_%016llx.tbl",
+        (unsigned long long) hash);
+
+    if (fs::exists(path)) {
+        try {
+            ref<FileStream> stream = new FileStream(path, FileStream::EReadOnly);
+            if (stream->readUInt() != MTS_THINFILM_CACHE_MAGIC
+                    || stream->readUInt() != MTS_THINFILM_CACHE_VERSION) {
+                SLog(EInfo, "Rebuilding the outdated thin-film table \"%s\"",
+                    path.string().c_str());
+            } else if (stream->readString() == key) {
+                SLog(EDebug, "Loading the thin-film table \"%s\"", path.string().c_str());
+                return ThinFilmTable(stream);
+            }
+        } catch (const std::exception &ex) {
+            SLog(EWarn, "Could not read the thin-film table \"%s\": %s",
+                path.string().c_str(), ex.what());
+        }
+    }
+
+    ThinFilmTable table = build();
+
+    try {
+        /* Write to a temporary file first, concurrent renders may share the cache */
+        fs::create_directories(path.parent_path());
+        fs::path tmpPath = fs::unique_path(path.string() + ".%%%%%%%%");
+        {
+            ref<FileStream> stream = new FileStream(tmpPath, FileStream::ETruncWrite);
+            stream->writeUInt(MTS_THINFILM_CACHE_MAGIC);
+            stream->writeUInt(MTS_THINFILM_CACHE_VERSION);
+            stream->writeString(key);
+            table.serialize(stream);
+        }
+        fs::rename(tmpPath, path);
+    } catch (const std::exception &ex) {
+        SLog(EWarn, "Could not write the thin-film table \"%s\": %s",
+            path.string().c_str(), ex.what());
+    }
+
+    return table;
+}
+
+MTS_NAMESPACE_END
+
+#endif /* __THINFILM_H */
@@ -22,10 +22,12 @@
 #include <mitsuba/core/quad.h>
 #include <mitsuba/core/sse.h>
 #include <mitsuba/core/frame.h>
+#include <mitsuba/core/stream.h>
 #include <boost/bind.hpp>
 #include <stdarg.h>
 #include <iomanip>
 #include <errno.h>
+#include <complex>
 
 #if defined(__OSX__)
 #include <sys/sysctl.h>
@@ -836,6 +838,663 @@ Float ThinFilmReflectanceExt(Float cos0, Float &cosThetaT_, Float lambda, Float
     return std::min(1.0, std::max(0.0, 1.0 - I_t));
 }
 
+void ThinFilmTransmission(const Float *cos0, size_t nCos, const Float *lambda, size_t nLambda,
+        Float thickness, Float n0, Float n1, Float n2, Float *T, Float *cosThetaT) {
+    /* Cosines are processed in packets; the wavelength-independent terms of
+       a packet are stored as arrays so that the loop over the packet reads and
+       writes them unit-stride. T is laid out per cosine, so the results of a
+       wavelength are then copied out with a stride of nLambda */
+    const size_t PacketSize = 16;
+    Float phase[PacketSize], ratio[PacketSize], result[PacketSize];
+    Float Bs2[PacketSize], Bp2[PacketSize], as[PacketSize], ap[PacketSize];
+
+    const Float delta = (n1 >= n0 ? 0.0f : (Float) M_PI) + (n1 >= n2 ? 0.0f : (Float) M_PI);
+    const Float eta01 = (n0 / n1) * (n0 / n1), eta12 = (n1 / n2) * (n1 / n2);
+
+    for (size_t start=0; start<nCos; start += PacketSize) {
+        size_t count = std::min(PacketSize, nCos - start);
+
+        for (size_t i=0; i<count; ++i) {
+            Float c0 = cos0[start + i];
+
+            /* Snell's law through both interfaces (written in terms of the
+               squared cosines to stay accurate at grazing angles) */
+            Float cos1Sqr = 1 - eta01 + eta01 * c0 * c0;
+            Float cos2Sqr = 1 - eta12 + eta12 * cos1Sqr;
+            Float c1 = std::sqrt(std::max((Float) 0, cos1Sqr));
+            Float c2 = std::sqrt(std::max((Float) 0, cos2Sqr));
+            bool valid = cos1Sqr >= 0 && cos2Sqr >= 0;
+
+            if (cosThetaT)
+                cosThetaT[start + i] = valid ? c2 : 0.0f;
+
+            /* Fresnel amplitudes of the two interfaces */
+            Float bs = ts(n0, n1, c0, c1) * ts(n1, n2, c1, c2);
+            Float bp = tp(n0, n1, c0, c1) * tp(n1, n2, c1, c2);
+            as[i] = rs(n1, n0, c1, c0) * rs(n1, n2, c1, c2);
+            ap[i] = rp(n1, n0, c1, c0) * rp(n1, n2, c1, c2);
+            Bs2[i] = bs * bs;
+            Bp2[i] = bp * bp;
+
+            /* Energy conservation ratio (zero removes invalid entries) */
+            ratio[i] = valid ? (n2 * c2) / (n0 * c0) : 0.0f;
+            phase[i] = 4 * M_PI * n1 * thickness * c1;
+        }
+
+        for (size_t j=0; j<nLambda; ++j) {
+            Float invLambda = 1 / lambda[j];
+            Float *dest = T + start * nLambda + j;
+
+            for (size_t i=0; i<count; ++i) {
+                Float cosPhi = std::cos(phase[i] * invLambda + delta);
+                Float transmitted_s = Bs2[i] / (as[i] * as[i] - 2 * as[i] * cosPhi + 1);
+                Float transmitted_p = Bp2[i] / (ap[i] * ap[i] - 2 * ap[i] * cosPhi + 1);
+                Float value = ratio[i] * (transmitted_s + transmitted_p) * 0.5f;
+
+                result[i] = std::min((Float) 1, std::max((Float) 0, value));
+            }
+
+            for (size_t i=0; i<count; ++i)
+                dest[i * nLambda] = result[i];
+        }
+    }
+}
+
+/// Reflectance and phase shift of a dielectric interface for p- and s-polarized light
+static void fresnelPolarized(Float cosThetaI, Float n1, Float n2, Float *R, Float *phi) {
+    Float eta = n1 / n2;
+    Float sinThetaI2 = 1 - cosThetaI * cosThetaI;
+    Float sinThetaT2 = eta * eta * sinThetaI2;
+
+    if (sinThetaT2 > 1) {
+        /* Total internal reflection only shifts the phase */
+        Float root = std::sqrt(sinThetaI2 - 1 / (eta * eta));
+        R[0] = R[1] = 1;
+        phi[0] = 2 * std::atan(-eta * eta * root / cosThetaI);
+        phi[1] = 2 * std::atan(-root / cosThetaI);
+        return;
+    }
+
+    Float cosThetaT = std::sqrt(1 - sinThetaT2);
+    Float rp = (n2 * cosThetaI - n1 * cosThetaT) / (n2 * cosThetaI + n1 * cosThetaT);
+    Float rs = (n1 * cosThetaI - n2 * cosThetaT) / (n1 * cosThetaI + n2 * cosThetaT);
+
+    R[0] = rp * rp;
+    R[1] = rs * rs;
+    phi[0] = rp < 0 ? (Float) M_PI : 0.0f;
+    phi[1] = rs < 0 ? (Float) M_PI : 0.0f;
+}
+
+/**
+ * Fourier transform of the CIE 1931 XYZ matching functions (fitted by
+ * Gaussians) evaluated at an optical path difference given in nanometers
+ */
+static void evalSensitivity(Float opd, Float shift, Float *xyz) {
+    const Float val[3] = { 5.4856e-13f, 4.4201e-13f, 5.2481e-13f };
+    const Float pos[3] = { 1.6810e+06f, 1.7953e+06f, 2.2084e+06f };
+    const Float var[3] = { 4.3278e+09f, 9.3046e+09f, 6.6121e+09f };
+    Float phase = 2 * M_PI * opd * 1e-9f;
+
+    for (int i=0; i<3; ++i)
+        xyz[i] = val[i] * std::sqrt(2 * M_PI * var[i]) * std::cos(pos[i] * phase + shift)
+            * std::exp(-var[i] * phase * phase);
+
+    /* Secondary lobe of the X matching function */
+    xyz[0] += 9.7470e-14f * std::sqrt(2 * M_PI * 4.5282e+09f)
+        * std::cos(2.2399e+06f * phase + shift) * std::exp(-4.5282e+09f * phase * phase);
+
+    for (int i=0; i<3; ++i)
+        xyz[i] /= 1.0685e-7f;
+}
+
+/// Convert CIE XYZ to linear sRGB (ITU-R BT.709 primaries, D65 white point)
+static void xyzToLinearRGB(const Float *xyz, Float *rgb) {
+    rgb[0] =  3.240479f * xyz[0] - 1.537150f * xyz[1] - 0.498535f * xyz[2];
+    rgb[1] = -0.969256f * xyz[0] + 1.875991f * xyz[1] + 0.041556f * xyz[2];
+    rgb[2] =  0.055648f * xyz[0] - 0.204043f * xyz[1] + 1.057311f * xyz[2];
+}
+
+void ThinFilmReflectanceFourier(const Float *cos0, size_t nCos, Float thickness,
+        Float n0, Float n1, Float n2, Float *R, Float *cosThetaT) {
+    /* Terms of the Airy summation beyond this order are negligible */
+    const int order = 3;
+
+    /* The DC term of the expansion doubles as the color of white */
+    Float xyz[3], white[3];
+    evalSensitivity(0, 0, xyz);
+    xyzToLinearRGB(xyz, white);
+
+    const Float eta02 = (n0 / n2) * (n0 / n2), eta01 = (n0 / n1) * (n0 / n1);
+
+    /* Extra phase shift of ThinFilmTransmission(), kept so that both models
+       agree (this one converges to the spectral table) */
+    const Float delta = (n1 >= n0 ? 0.0f : (Float) M_PI) + (n1 >= n2 ? 0.0f : (Float) M_PI);
+
+    for (size_t i=0; i<nCos; ++i) {
+        Float c0 = cos0[i], *rgb = R + 3 * i;
+
+        if (cosThetaT) {
+            Float cos2Sqr = 1 - eta02 + eta02 * c0 * c0;
+            cosThetaT[i] = cos2Sqr > 0 ? std::sqrt(cos2Sqr) : 0.0f;
+        }
+
+        /* Total internal reflection at the first interface */
+        Float cos1Sqr = 1 - eta01 + eta01 * c0 * c0;
+        if (cos1Sqr <= 0) {
+            rgb[0] = rgb[1] = rgb[2] = 1;
+            continue;
+        }
+        Float c1 = std::sqrt(cos1Sqr);
+
+        /* Reflectances and phase shifts of both interfaces (p, s) */
+        Float R12[2], phi12[2], R23[2], phi23[2];
+        fresnelPolarized(c0, n0, n1, R12, phi12);
+        fresnelPolarized(c1, n1, n2, R23, phi23);
+
+        Float opd = 2 * n1 * thickness * c1;
+        Float sum[3] = { 0, 0, 0 };
+
+        for (int p=0; p<2; ++p) {
+            Float T121 = 1 - R12[p];
+            Float phi2 = (Float) M_PI - phi12[p] + phi23[p] + delta;
+            Float R123 = R12[p] * R23[p], r123 = std::sqrt(R123);
+            Float Rs = R123 < 1 ? T121 * T121 * R23[p] / (1 - R123) : 0.0f;
+
+            /* m = 0 */
+            Float C0 = R12[p] + Rs;
+            Float Cm = Rs - T121;
+            for (int ch=0; ch<3; ++ch)
+                sum[ch] += 0.5f * C0 * xyz[ch];
+
+            /* m > 0: pairs of Dirac peaks in the Fourier domain */
+            Float Sm[3];
+            for (int m=1; m<=order; ++m) {
+                Cm *= r123;
+                evalSensitivity(m * opd, m * phi2, Sm);
+                for (int ch=0; ch<3; ++ch)
+                    sum[ch] += Cm * Sm[ch];
+            }
+        }
+
+        xyzToLinearRGB(sum, rgb);
+        for (int ch=0; ch<3; ++ch)
+            rgb[ch] = std::min((Float) 1, std::max((Float) 0, rgb[ch] / white[ch]));
+    }
+}
+
+const Float ThinFilmTable::Wavelengths[ThinFilmTable::Channels] = { 650.0f, 510.0f, 475.0f };
+
+void ThinFilmStackTransmission(const Float *cos0, size_t nCos, const Float *lambda,
+        size_t nLambda, Float n0, const Float *n, const Float *thickness, size_t nLayers,
+        Float n2, Float *T, Float *cosThetaT) {
+    typedef std::complex<double> Complex;
+    const Complex I(0, 1);
+
+    std::vector<Complex> cosLayer(nLayers);
+
+    for (size_t i=0; i<nCos; ++i) {
+        double c0 = cos0[i], sin0Sqr = 1 - c0 * c0;
+
+        /* Refracted cosines; imaginary inside films under total internal reflection */
+        for (size_t l=0; l<nLayers; ++l)
+            cosLayer[l] = std::sqrt(Complex(1 - sin0Sqr * (n0 / n[l]) * (n0 / n[l])));
+
+        double cos2Sqr = 1 - sin0Sqr * (n0 / n2) * (n0 / n2);
+        if (cosThetaT)
+            cosThetaT[i] = cos2Sqr > 0 ? (Float) std::sqrt(cos2Sqr) : 0.0f;
+
+        if (cos2Sqr <= 0 || c0 <= 0) {
+            for (size_t j=0; j<nLambda; ++j)
+                T[i * nLambda + j] = 0.0f;
+            continue;
+        }
+        double c2 = std::sqrt(cos2Sqr);
+
+        for (size_t j=0; j<nLambda; ++j) {
+            double transmitted = 0;
+
+            for (int pol=0; pol<2; ++pol) {
+                /* Tilted admittances: n cos (s-polarized) or n / cos (p-polarized) */
+                double eta0 = pol == 0 ? n0 * c0 : n0 / c0;
+                double eta2 = pol == 0 ? n2 * c2 : n2 / c2;
+
+                Complex m11(1), m12(0), m21(0), m22(1);
+                for (size_t l=0; l<nLayers; ++l) {
+                    double nl = n[l];
+                    Complex eta = pol == 0 ? nl * cosLayer[l] : nl / cosLayer[l];
+                    Complex delta = 2 * M_PI * nl * (double) thickness[l] * cosLayer[l] / (double) lambda[j];
+                    Complex c = std::cos(delta), s = std::sin(delta);
+
+                    /* Multiply with the characteristic matrix of the film */
+                    Complex a11 = c, a12 = I * s / eta, a21 = I * eta * s, a22 = c;
+                    Complex t11 = m11 * a11 + m12 * a21, t12 = m11 * a12 + m12 * a22;
+                    Complex t21 = m21 * a11 + m22 * a21, t22 = m21 * a12 + m22 * a22;
+                    m11 = t11; m12 = t12; m21 = t21; m22 = t22;
+                }
+
+                Complex denom = eta0 * m11 + eta0 * eta2 * m12 + m21 + eta2 * m22;
+                transmitted += 0.5 * (eta2 / eta0) * std::norm(2 * eta0 / denom);
+            }
+
+            T[i * nLambda + j] = (Float) std::min(1.0, std::max(0.0, transmitted));
+        }
+    }
+}
+
+void ThinFilmReflectanceConductor(const Float *cos0, size_t nCos, const Float *lambda,
+        size_t nLambda, Float thickness, Float n0, Float n1, const Float *eta2,
+        const Float *k2, Float *R) {
+    typedef std::complex<double> Complex;
+    const Complex I(0, 1);
+    const double eta0 = n0, eta1 = n1;
+
+    for (size_t i=0; i<nCos; ++i) {
+        double c0 = std::max(0.0, std::min(1.0, (double) cos0[i]));
+        double sin0Sqr = 1 - c0 * c0;
+
+        /* Refracted cosine in the film, imaginary under total internal reflection */
+        Complex c1 = std::sqrt(Complex(1 - sin0Sqr * (eta0 / eta1) * (eta0 / eta1)));
+
+        /* Fresnel amplitudes of the upper interface (s and p) */
+        Complex r01s = (eta0 * c0 - eta1 * c1) / (eta0 * c0 + eta1 * c1);
+        Complex r01p = (eta1 * c0 - eta0 * c1) / (eta1 * c0 + eta0 * c1);
+
+        for (size_t j=0; j<nLambda; ++j) {
+            Complex n2(eta2[j], k2[j]);
+            Complex c2 = std::sqrt(1.0 - sin0Sqr * (eta0 * eta0) / (n2 * n2));
+
+            /* Complex Fresnel amplitudes of the film/conductor interface */
+            Complex r12s = (eta1 * c1 - n2 * c2) / (eta1 * c1 + n2 * c2);
+            Complex r12p = (n2 * c1 - eta1 * c2) / (n2 * c1 + eta1 * c2);
+
+            /* Round trip through the film */
+            Complex phase = std::exp(I * (4 * M_PI * eta1 * (double) thickness / (double) lambda[j]) * c1);
+
+            Complex rs = (r01s + r12s * phase) / (1.0 + r01s * r12s * phase);
+            Complex rp = (r01p + r12p * phase) / (1.0 + r01p * r12p * phase);
+
+            R[i * nLambda + j] = (Float) std::min(1.0,
+                0.5 * (std::norm(rs) + std::norm(rp)));
+        }
+    }
+}
+
+ThinFilmTable::ThinFilmTable() : m_model(EPointSampled), m_n0(1), m_n1(1), m_n2(1),
+    m_eta2(1), m_etaCritical2(1), m_critical(false), m_thicknessMin(0), m_thicknessMax(0),
+    m_invThicknessStep(0), m_thicknessVariation(0), m_cosRes(0), m_thicknessRes(0),
+    m_averageNodes(1), m_error(0) { }
+
+ThinFilmTable::ThinFilmTable(Float n0, Float n1, Float n2, Float thicknessMin,
+        Float thicknessMax, EModel model, Float maxError, size_t maxEntries,
+        Float thicknessVariation)
+    : m_model(model), m_n0(n0), m_n1(n1), m_n2(n2), m_eta2((n0 / n2) * (n0 / n2)),
+      m_thicknessMin(thicknessMin), m_thicknessMax(std::max(thicknessMin, thicknessMax)),
+      m_thicknessVariation(std::max((Float) 0, thicknessVariation)), m_averageNodes(1) {
+    if (m_thicknessVariation > 0) {
+        /* Simpson's rule with a phase step of pi/16 at the shortest
+           wavelength, i.e. 32 nodes per interference fringe */
+        Float step = Wavelengths[Channels-1] / (64 * n1);
+        m_averageNodes = 2 * (size_t) std::ceil(m_thicknessVariation / step) + 1;
+    }
+
+    /* The single film model has no transmission as soon as any of the two
+       interfaces reflects totally */
+    init(n0 / std::min(n1, n2), n1 * (m_thicknessMax + m_thicknessVariation),
+        maxError, maxEntries);
+}
+
+ThinFilmTable::ThinFilmTable(Float n0, const std::vector<Float> &n,
+        const std::vector<Float> &thickness, Float n2, EModel model,
+        Float maxError, size_t maxEntries)
+    : m_stackIOR(n), m_stackThickness(thickness), m_model(model), m_n0(n0), m_n1(1),
+      m_n2(n2), m_eta2((n0 / n2) * (n0 / n2)), m_thicknessMin(0), m_thicknessMax(0),
+      m_thicknessVariation(0), m_averageNodes(1) {
+    if (n.empty())
+        SLog(EError, "ThinFilmTable: the film stack is empty!");
+    if (n.size() != thickness.size())
+        SLog(EError, "ThinFilmTable: got %i indices of refraction for %i films!",
+            (int) n.size(), (int) thickness.size());
+    if (model == EFourier)
+        SLog(EError, "ThinFilmTable: the Fourier model only supports single films!");
+
+    Float opticalThickness = 0;
+    for (size_t l=0; l<n.size(); ++l)
+        opticalThickness += n[l] * thickness[l];
+
+    /* Light can tunnel through thin films under total internal reflection,
+       only the last medium bounds the transmission */
+    init(n0 / n2, opticalThickness, maxError, maxEntries);
+}
+
+ThinFilmTable::ThinFilmTable(Float n0, Float n1, const std::vector<Float> &baseLambda,
+        const std::vector<Float> &baseEta, const std::vector<Float> &baseK,
+        Float thicknessMin, Float thicknessMax, EModel model, Float maxError,
+        size_t maxEntries)
+    : m_baseLambda(baseLambda), m_baseEta(baseEta), m_baseK(baseK), m_model(model),
+      m_n0(n0), m_n1(n1), m_n2(1), m_eta2(0), m_thicknessMin(thicknessMin),
+      m_thicknessMax(std::max(thicknessMin, thicknessMax)), m_thicknessVariation(0),
+      m_averageNodes(1) {
+    if (baseLambda.empty() || baseEta.size() != baseLambda.size()
+            || baseK.size() != baseLambda.size())
+        SLog(EError, "ThinFilmTable: the conductor data must have one "
+            "eta and k value per wavelength!");
+    if (model == EFourier)
+        SLog(EError, "ThinFilmTable: the Fourier model does not support conductors!");
+
+    /* Nothing is transmitted into the conductor, and the table is
+       parameterized by the incident cosine */
+    init(1, n1 * m_thicknessMax, maxError, maxEntries);
+}
+
+ThinFilmTable::ThinFilmTable(Stream *stream) {
+    m_model = (EModel) stream->readInt();
+    m_n0 = stream->readFloat();
+    m_n1 = stream->readFloat();
+    m_n2 = stream->readFloat();
+    m_eta2 = stream->readFloat();
+    m_etaCritical2 = stream->readFloat();
+    m_critical = stream->readBool();
+    m_thicknessMin = stream->readFloat();
+    m_thicknessMax = stream->readFloat();
+    m_invThicknessStep = stream->readFloat();
+    m_thicknessVariation = stream->readFloat();
+    m_cosRes = stream->readSize();
+    m_thicknessRes = stream->readSize();
+    m_averageNodes = stream->readSize();
+    m_error = stream->readFloat();
+    m_data.resize(m_cosRes * m_thicknessRes * Channels);
+    if (!m_data.empty())
+        stream->readSingleArray(&m_data[0], m_data.size());
+}
+
+void ThinFilmTable::serialize(Stream *stream) const {
+    stream->writeInt(m_model);
+    stream->writeFloat(m_n0);
+    stream->writeFloat(m_n1);
+    stream->writeFloat(m_n2);
+    stream->writeFloat(m_eta2);
+    stream->writeFloat(m_etaCritical2);
+    stream->writeBool(m_critical);
+    stream->writeFloat(m_thicknessMin);
+    stream->writeFloat(m_thicknessMax);
+    stream->writeFloat(m_invThicknessStep);
+    stream->writeFloat(m_thicknessVariation);
+    stream->writeSize(m_cosRes);
+    stream->writeSize(m_thicknessRes);
+    stream->writeSize(m_averageNodes);
+    stream->writeFloat(m_error);
+    if (!m_data.empty())
+        stream->writeSingleArray(&m_data[0], m_data.size());
+}
+
+void ThinFilmTable::init(Float etaCritical, Float opticalThickness,
+        Float maxError, size_t maxEntries) {
+    m_etaCritical2 = etaCritical * etaCritical;
+    m_critical = etaCritical > 1;
+
+    if (m_model == ESpectral) {
+        /* Sample the spectrum finely enough to follow the interference
+           fringes of the thickest film at the shortest wavelength */
+        const Float lambdaMin = 360, lambdaMax = 830;
+        Float step = std::min((Float) 5, lambdaMin * lambdaMin
+            / (16 * std::max(opticalThickness, (Float) 1)));
+        size_t nLambda = (size_t) std::ceil((lambdaMax - lambdaMin) / step) + 1;
+
+        m_lambda.resize(nLambda);
+        for (size_t k=0; k<nLambda; ++k)
+            m_lambda[k] = lambdaMin + k * (lambdaMax - lambdaMin) / (nLambda - 1);
+
+        /* The piecewise linear spectrum through the samples is a sum of hat
+           functions, and the conversion to RGB is linear: precompute the RGB
+           color of every hat function once */
+        m_rgbWeights.resize(nLambda * Channels);
+        Float white[Channels] = { 0, 0, 0 };
+        for (size_t k=0; k<nLambda; ++k) {
+            InterpolatedSpectrum hat(nLambda);
+            for (size_t l=0; l<nLambda; ++l)
+                hat.append(m_lambda[l], l == k ? 1.0f : 0.0f);
+
+            Spectrum rgb;
+            rgb.fromContinuousSpectrum(hat);
+            for (int ch=0; ch<Channels; ++ch) {
+                m_rgbWeights[k * Channels + ch] = rgb[ch];
+                white[ch] += rgb[ch];
+            }
+        }
+
+        for (size_t k=0; k<nLambda; ++k)
+            for (int ch=0; ch<Channels; ++ch)
+                m_rgbWeights[k * Channels + ch] /= white[ch];
+    }
+
+    /* Start from a grid on which the phase of the film changes by roughly
+       pi/4 per cell along the cosine and the thickness axes */
+    const Float phaseRate = 4 * M_PI / Wavelengths[Channels-1];
+    const Float cellPhase = M_PI / 4;
+
+    m_cosRes = std::max((size_t) 32, (size_t) std::ceil(
+        phaseRate * opticalThickness / cellPhase) + 1);
+    m_thicknessRes = m_thicknessMax > m_thicknessMin ? std::max((size_t) 2,
+        (size_t) std::ceil(phaseRate * m_n1 * (m_thicknessMax - m_thicknessMin) / cellPhase) + 1) : 1;
+
+    while (true) {
+        build();
+
+        Float cosError, thicknessError;
+        m_error = measureError(cosError, thicknessError);
+        if (m_error <= maxError)
+            break;
+
+        /* Refine the axes that are responsible for the error */
+        bool refineCos = cosError > maxError
+            && 2 * m_cosRes * m_thicknessRes <= maxEntries;
+        bool refineThickness = thicknessError > maxError
+            && 2 * m_cosRes * m_thicknessRes <= maxEntries;
+
+        if (refineCos && refineThickness
+                && 4 * m_cosRes * m_thicknessRes > maxEntries)
+            refineThickness = thicknessError > cosError;
+
+        if (!refineCos && !refineThickness) {
+            SLog(EWarn, "ThinFilmTable: reached %i entries with an interpolation "
+                "error of %f (target: %f)", (int) (m_cosRes * m_thicknessRes),
+                m_error, maxError);
+            break;
+        }
+
+        if (refineCos)
+            m_cosRes = 2 * m_cosRes - 1;
+        if (refineThickness)
+            m_thicknessRes = 2 * m_thicknessRes - 1;
+    }
+}
+
+Float ThinFilmTable::thicknessAt(size_t j) const {
+    return m_thicknessRes > 1 ? m_thicknessMin + j
+        * (m_thicknessMax - m_thicknessMin) / (m_thicknessRes - 1) : m_thicknessMin;
+}
+
+Float ThinFilmTable::cosAt(size_t i) const {
+    /* The energy ratio is undefined at grazing incidence: use the limit */
+    return std::max(fromAxis(i / (Float) (m_cosRes - 1)), (Float) 1e-4f);
+}
+
+void ThinFilmTable::evalRow(const Float *cos0, size_t nCos, Float thickness, Float *T) const {
+    if (m_averageNodes == 1) {
+        evalFilm(cos0, nCos, thickness, T);
+        return;
+    }
+
+    /* Average over the thickness distribution with Simpson's rule */
+    std::vector<Float> node(nCos * Channels);
+    Float thicknessMin = std::max((Float) 0, thickness - m_thicknessVariation),
+          step = (thickness + m_thicknessVariation - thicknessMin) / (m_averageNodes - 1);
+    for (size_t i=0; i<nCos * Channels; ++i)
+        T[i] = 0.0f;
+
+    for (size_t k=0; k<m_averageNodes; ++k) {
+        evalFilm(cos0, nCos, thicknessMin + k * step, &node[0]);
+
+        Float weight = (k == 0 || k == m_averageNodes - 1) ? 1 : (k % 2 == 1 ? 4 : 2);
+        weight /= 3 * (m_averageNodes - 1);
+        for (size_t i=0; i<nCos * Channels; ++i)
+            T[i] += weight * node[i];
+    }
+}
+
+void ThinFilmTable::evalFilm(const Float *cos0, size_t nCos, Float thickness, Float *T) const {
+    bool stack = !m_stackIOR.empty();
+
+    if (m_model == EFourier) {
+        ThinFilmReflectanceFourier(cos0, nCos, thickness, m_n0, m_n1, m_n2, T);
+        for (size_t i=0; i<nCos * Channels; ++i)
+            T[i] = 1 - T[i];
+        return;
+    }
+
+    /* Point-sampled RGB is a spectrum of three samples without conversion */
+    bool spectral = m_model == ESpectral;
+    size_t nLambda = spectral ? m_lambda.size() : (size_t) Channels;
+    const Float *lambda = spectral ? &m_lambda[0] : Wavelengths;
+    std::vector<Float> spectrum;
+    Float *dest = T;
+    if (spectral) {
+        spectrum.resize(nCos * nLambda);
+        dest = &spectrum[0];
+    }
+
+    if (!m_baseLambda.empty()) {
+        /* Interpolate the conductor data at the evaluated wavelengths */
+        std::vector<Float> eta(nLambda), k(nLambda);
+        for (size_t j=0; j<nLambda; ++j) {
+            size_t idx = std::lower_bound(m_baseLambda.begin(), m_baseLambda.end(),
+                lambda[j]) - m_baseLambda.begin();
+            if (idx == 0 || idx == m_baseLambda.size()) {
+                idx = std::min(idx, m_baseLambda.size() - 1);
+                eta[j] = m_baseEta[idx];
+                k[j] = m_baseK[idx];
+            } else {
+                Float t = (lambda[j] - m_baseLambda[idx-1])
+                    / (m_baseLambda[idx] - m_baseLambda[idx-1]);
+                eta[j] = (1 - t) * m_baseEta[idx-1] + t * m_baseEta[idx];
+                k[j] = (1 - t) * m_baseK[idx-1] + t * m_baseK[idx];
+            }
+        }
+
+        ThinFilmReflectanceConductor(cos0, nCos, lambda, nLambda, thickness,
+            m_n0, m_n1, &eta[0], &k[0], dest);
+        for (size_t i=0; i<nCos * nLambda; ++i)
+            dest[i] = 1 - dest[i];
+    } else if (stack) {
+        ThinFilmStackTransmission(cos0, nCos, lambda, nLambda, m_n0, &m_stackIOR[0],
+            &m_stackThickness[0], m_stackIOR.size(), m_n2, dest);
+    } else {
+        ThinFilmTransmission(cos0, nCos, lambda, nLambda,
+            thickness, m_n0, m_n1, m_n2, dest);
+    }
+
+    if (!spectral)
+        return;
+
+    for (size_t i=0; i<nCos; ++i) {
+        Float rgb[Channels] = { 0, 0, 0 };
+        const Float *value = &spectrum[i * nLambda];
+        for (size_t k=0; k<nLambda; ++k)
+            for (int ch=0; ch<Channels; ++ch)
+                rgb[ch] += value[k] * m_rgbWeights[k * Channels + ch];
+
+        /* Saturated fringes can leave the RGB gamut */
+        for (int ch=0; ch<Channels; ++ch)
+            T[i * Channels + ch] = std::min((Float) 1, std::max((Float) 0, rgb[ch]));
+    }
+}
+
+void ThinFilmTable::build() {
+    m_data.resize(m_cosRes * m_thicknessRes * Channels);
+    m_invThicknessStep = m_thicknessRes > 1
+        ? (m_thicknessRes - 1) / (m_thicknessMax - m_thicknessMin) : 0.0f;
+
+    std::vector<Float> cos0(m_cosRes), T(m_cosRes * Channels);
+    for (size_t i=0; i<m_cosRes; ++i)
+        cos0[i] = cosAt(i);
+
+    for (size_t j=0; j<m_thicknessRes; ++j) {
+        evalRow(&cos0[0], m_cosRes, thicknessAt(j), &T[0]);
+        std::copy(T.begin(), T.end(), m_data.begin() + j * m_cosRes * Channels);
+    }
+}
+
+Float ThinFilmTable::measureError(Float &cosError, Float &thicknessError) const {
+    std::vector<Float> cosNode(m_cosRes), cosMid(m_cosRes - 1);
+    std::vector<Float> reference(m_cosRes * Channels);
+    Float T[Channels];
+    cosError = thicknessError = 0;
+
+    for (size_t i=0; i<m_cosRes; ++i) {
+        cosNode[i] = cosAt(i);
+        if (i + 1 < m_cosRes)
+            cosMid[i] = fromAxis((i + (Float) 0.5f) / (m_cosRes - 1));
+    }
+
+    for (size_t j=0; j<m_thicknessRes; ++j) {
+        /* Midpoints of the cells along the cosine axis */
+        Float thickness = thicknessAt(j);
+        evalRow(&cosMid[0], cosMid.size(), thickness, &reference[0]);
+        for (size_t i=0; i<cosMid.size(); ++i) {
+            evalTransmittance(cosMid[i], thickness, T);
+            for (int ch=0; ch<Channels; ++ch)
+                cosError = std::max(cosError,
+                    std::abs(T[ch] - reference[i * Channels + ch]));
+        }
+
+        /* Midpoints of the cells along the thickness axis */
+        if (j + 1 < m_thicknessRes) {
+            Float thicknessMid = (thickness + thicknessAt(j + 1)) / 2;
+            evalRow(&cosNode[0], cosNode.size(), thicknessMid, &reference[0]);
+            for (size_t i=0; i<cosNode.size(); ++i) {
+                evalTransmittance(cosNode[i], thicknessMid, T);
+                for (int ch=0; ch<Channels; ++ch)
+                    thicknessError = std::max(thicknessError,
+                        std::abs(T[ch] - reference[i * Channels + ch]));
+            }
+        }
+    }
+
+    return std::max(cosError, thicknessError);
+}
+
+void ThinFilmTable::evalTransmittance(Float cos0, Float thickness, Float *T) const {
+    Float x = toAxis(math::clamp(cos0, (Float) 0, (Float) 1));
+    if (x < 0) {
+        /* Total internal reflection */
+        for (int ch=0; ch<Channels; ++ch)
+            T[ch] = 0.0f;
+        return;
+    }
+
+    x *= m_cosRes - 1;
+    size_t i = std::min((size_t) x, m_cosRes - 2);
+    Float fx = x - i;
+
+    size_t j = 0;
+    Float fy = 0;
+    if (m_thicknessRes > 1) {
+        Float y = math::clamp((thickness - m_thicknessMin) * m_invThicknessStep,
+            (Float) 0, (Float) (m_thicknessRes - 1));
+        j = std::min((size_t) y, m_thicknessRes - 2);
+        fy = y - j;
+    }
+
+    const float *row0 = &m_data[(j * m_cosRes + i) * Channels];
+    const float *row1 = m_thicknessRes > 1 ? row0 + m_cosRes * Channels : row0;
+
+    for (int ch=0; ch<Channels; ++ch) {
+        Float t0 = (1 - fx) * row0[ch] + fx * row0[ch + Channels];
+        Float t1 = (1 - fx) * row1[ch] + fx * row1[ch + Channels];
+        T[ch] = (1 - fy) * t0 + fy * t1;
+    }
+}
+
 Float fresnelDielectric(Float cosThetaI, Float cosThetaT, Float eta) {
     if (EXPECT_NOT_TAKEN(eta == 1))
         return 0.0f;
@@ -0,0 +1,447 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/render/bsdf.h>
+#include <mitsuba/render/sampler.h>
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/timer.h>
+#include <mitsuba/core/warp.h>
+#include <mitsuba/core/statistics.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief BSDF microbenchmark (mtsutil bsdfbench)
+ *
+ * Creates a BSDF plugin from <tt>name=value</tt> pairs and runs eval(),
+ * sample(), pdf() and evalAndSample() over a fixed set of random queries.
+ * The following numbers are reported:
+ *
+ * - the single-threaded cost of every entry point in ns/call,
+ * - the net heap growth per call (glibc only, see \ref heapInUse()),
+ * - the query throughput with 1, 2, 4, ... threads and the resulting speed-up,
+ * - the relative variance of the (possibly stochastic) eval() and pdf()
+ *   estimates, multiplied by their cost ("variance per unit time").
+ *
+ * The -w preset makes the media of 'multilayered' dense and weakly absorbing,
+ * so that the random walks get deep (50+ vertices) and the cost of the
+ * bidirectional connections dominates.
+ */
+class BSDFBench : public Utility {
+public:
+	enum EEntryPoint {
+		EEval = 0,
+		ESample,
+		EPdf,
+		EEvalAndSample,
+		EEntryPointCount
+	};
+
+	/// One benchmark query, generated up front so that all runs see the same inputs
+	struct Query {
+		Vector wi, wo;
+		Point2 uv, sample;
+	};
+
+	void help() {
+		cout << "Syntax: mtsutil bsdfbench [options] <plugin> [name=value ...] [slot:plugin ...] [slot.name=value ...]" << endl
+			<< "Options/Arguments:" << endl
+			<< "   -h             Display this help text" << endl << endl
+			<< "   -n count       Number of queries per entry point (default: 100000)" << endl << endl
+			<< "   -d dist        Direction distribution: cosine, uniform or grazing (default: cosine)" << endl
+			<< "                  'cosine' and 'grazing' only cover the upper hemisphere, 'uniform' also" << endl
+			<< "                  produces transmission and bottom incidence queries" << endl << endl
+			<< "   -p count       Maximum number of threads of the scaling test (default: all cores)" << endl << endl
+			<< "   -k count       Number of direction pairs of the variance test (default: 16)" << endl << endl
+			<< "   -m count       Estimates per direction pair of the variance test (default: 256)" << endl << endl
+			<< "   -w             Deep walks: media of 'multilayered' without an explicit sigmaT_<i> or" << endl
+			<< "                  albedo_<i> get sigmaT_<i>=32 and albedo_<i>=0.999" << endl << endl
+			<< "   -s             Print the statistics counters (e.g. the average random walk depth)" << endl << endl
+			<< "Values are parsed as booleans (true/false), integers, floats (with a decimal point)," << endl
+			<< "RGB spectra (r,g,b), vectors (vector:x,y,z) or strings, in that order. Nested objects" << endl
+			<< "are created with slot:plugin and parametrized with slot.name=value, e.g." << endl << endl
+			<< "   mtsutil bsdfbench multilayered nbLayers=3 sigmaT_0=2.0 albedo_0=0.9,0.8,0.7 \\" << endl
+			<< "       surface_0:roughdielectricThinFilm surface_0.alpha=0.1 surface_2:diffuse" << endl << endl
+			<< "Missing surface_<i> layers of 'multilayered' default to 'dielectric', except for the" << endl
+			<< "last one which defaults to 'diffuse'." << endl;
+	}
+
+	static void setProperty(Properties &props, const std::string &name, const std::string &value) {
+		std::vector<std::string> tokens;
+		if (boost::starts_with(value, "vector:")) {
+			boost::split(tokens, value.substr(7), boost::is_any_of(","));
+			if (tokens.size() != 3)
+				SLog(EError, "Could not parse the vector \"%s\"", value.c_str());
+			props.setVector(name, Vector(
+				boost::lexical_cast<Float>(tokens[0]),
+				boost::lexical_cast<Float>(tokens[1]),
+				boost::lexical_cast<Float>(tokens[2])));
+			return;
+		}
+		if (value == "true" || value == "false") {
+			props.setBoolean(name, value == "true");
+			return;
+		}
+		boost::split(tokens, value, boost::is_any_of(","));
+		try {
+			if (tokens.size() == 3) {
+				Spectrum spec;
+				spec.fromLinearRGB(
+					boost::lexical_cast<Float>(tokens[0]),
+					boost::lexical_cast<Float>(tokens[1]),
+					boost::lexical_cast<Float>(tokens[2]));
+				props.setSpectrum(name, spec);
+			} else if (value.find_first_of(".eE") == std::string::npos) {
+				props.setInteger(name, boost::lexical_cast<int>(value));
+			} else {
+				props.setFloat(name, boost::lexical_cast<Float>(value));
+			}
+		} catch (const boost::bad_lexical_cast &) {
+			props.setString(name, value);
+		}
+	}
+
+	/// Create a configured BSDF from the plugin name and the remaining command line arguments
+	ref<BSDF> createBSDF(const std::string &pluginName, int argc, char **argv) {
+		PluginManager *pluginMgr = PluginManager::getInstance();
+		Properties props(pluginName);
+		std::map<std::string, Properties> children;
+		std::vector<std::string> childOrder;
+
+		for (int i = 0; i < argc; ++i) {
+			std::string arg(argv[i]);
+			size_t eq = arg.find('='), colon = arg.find(':'), dot = arg.find('.');
+			if (eq != std::string::npos && (colon == std::string::npos || eq < colon)) {
+				std::string name = arg.substr(0, eq);
+				if (dot != std::string::npos && dot < eq) {
+					std::string slot = name.substr(0, dot);
+					if (children.find(slot) == children.end())
+						Log(EError, "Parameter \"%s\" refers to the undeclared slot \"%s\"", arg.c_str(), slot.c_str());
+					setProperty(children[slot], name.substr(dot + 1), arg.substr(eq + 1));
+				} else {
+					setProperty(props, name, arg.substr(eq + 1));
+				}
+			} else if (colon != std::string::npos) {
+				std::string slot = arg.substr(0, colon);
+				if (children.find(slot) == children.end())
+					childOrder.push_back(slot);
+				children[slot] = Properties(arg.substr(colon + 1));
+			} else {
+				Log(EError, "Could not parse the argument \"%s\"", arg.c_str());
+			}
+		}
+
+		if (pluginName == "multilayered") {
+			int nbLayers = props.hasProperty("nbLayers") ? props.getInteger("nbLayers") : 2;
+			for (int l = 0; m_deepWalks && l < nbLayers - 1; ++l) {
+				std::string sigmaT = formatString("sigmaT_%i", l), albedo = formatString("albedo_%i", l);
+				if (!props.hasProperty(sigmaT))
+					props.setSpectrum(sigmaT, Spectrum(32.0f));
+				if (!props.hasProperty(albedo))
+					props.setSpectrum(albedo, Spectrum(0.999f));
+			}
+			for (int l = 0; l < nbLayers; ++l) {
+				std::string slot = formatString("surface_%i", l);
+				if (children.find(slot) == children.end()) {
+					children[slot] = Properties(l == nbLayers - 1 ? "diffuse" : "dielectric");
+					childOrder.push_back(slot);
+				}
+			}
+		}
+
+		ref<BSDF> bsdf = static_cast<BSDF *> (pluginMgr->createObject(MTS_CLASS(BSDF), props));
+		for (size_t i = 0; i < childOrder.size(); ++i) {
+			ref<ConfigurableObject> child = pluginMgr->createObject(children[childOrder[i]]);
+			child->configure();
+			bsdf->addChild(childOrder[i], child);
+			child->setParent(bsdf);
+		}
+		bsdf->configure();
+		return bsdf;
+	}
+
+	Vector sampleDirection(Sampler *sampler) const {
+		Point2 sample = sampler->next2D();
+		if (m_distribution == "uniform")
+			return warp::squareToUniformSphere(sample);
+		if (m_distribution == "grazing") {
+			Float cosTheta = 0.01f + 0.09f * sample.x;
+			Float sinTheta = math::safe_sqrt(1 - cosTheta * cosTheta);
+			Float sinPhi, cosPhi;
+			math::sincos(2 * M_PI * sample.y, &sinPhi, &cosPhi);
+			return Vector(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+		}
+		return warp::squareToCosineHemisphere(sample);
+	}
+
+	void generateQueries(std::vector<Query> &queries, size_t count, Sampler *sampler) const {
+		queries.resize(count);
+		for (size_t i = 0; i < count; ++i) {
+			queries[i].wi = sampleDirection(sampler);
+			queries[i].wo = sampleDirection(sampler);
+			queries[i].uv = sampler->next2D();
+			queries[i].sample = sampler->next2D();
+		}
+	}
+
+	/// Run one entry point over the query range [begin, end); returns a checksum of the results
+	static Float runQueries(const BSDF *bsdf, EEntryPoint entry, const Query *begin,
+			const Query *end, Sampler *sampler) {
+		Intersection its;
+		its.p = Point(0.0f);
+		its.geoFrame = its.shFrame = Frame(Normal(0.0f, 0.0f, 1.0f));
+		its.t = 1;
+		Float checksum = 0;
+
+		for (const Query *q = begin; q != end; ++q) {
+			its.uv = q->uv;
+			its.wi = q->wi;
+			BSDFSamplingRecord bRec(its, sampler, ERadiance);
+			bRec.wi = q->wi;
+			bRec.wo = q->wo;
+
+			switch (entry) {
+				case EEval:
+					checksum += bsdf->eval(bRec).getLuminance();
+					break;
+				case ESample: {
+						Float pdf;
+						checksum += bsdf->sample(bRec, pdf, q->sample).getLuminance() + pdf;
+					}
+					break;
+				case EPdf:
+					checksum += bsdf->pdf(bRec);
+					break;
+				case EEvalAndSample: {
+						Spectrum evalVal, sampleVal;
+						Float evalPdf, samplePdf;
+						bsdf->evalAndSample(bRec, evalVal, evalPdf, sampleVal, samplePdf, q->sample);
+						checksum += evalVal.getLuminance() + evalPdf + sampleVal.getLuminance() + samplePdf;
+					}
+					break;
+				default:
+					break;
+			}
+		}
+		return checksum;
+	}
+
+	/**
+	 * Bytes currently allocated on the heap, or -1 when unknown. Plugins are
+	 * loaded with local symbol binding, so operator new cannot be interposed
+	 * from here; the allocator's own bookkeeping only gives the net growth,
+	 * i.e. allocations that are not released before the call returns.
+	 */
+	static int64_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+		return (int64_t) mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+		return (int64_t) mallinfo().uordblks;
+#else
+		return -1;
+#endif
+	}
+
+	/// Worker of the thread scaling test
+	class BenchThread : public Thread {
+	public:
+		BenchThread(const BSDF *bsdf, const std::vector<Query> &queries, Sampler *sampler, int id)
+			: Thread(formatString("bench%i", id)), m_bsdf(bsdf), m_queries(queries), m_sampler(sampler), m_checksum(0) { }
+
+		void run() {
+			const Query *begin = &m_queries[0], *end = begin + m_queries.size();
+			for (int entry = 0; entry < EEntryPointCount; ++entry)
+				m_checksum += runQueries(m_bsdf, (EEntryPoint) entry, begin, end, m_sampler);
+		}
+
+		inline Float getChecksum() const { return m_checksum; }
+
+	private:
+		const BSDF *m_bsdf;
+		const std::vector<Query> &m_queries;
+		ref<Sampler> m_sampler;
+		Float m_checksum;
+	};
+
+	int run(int argc, char **argv) {
+		char optchar, *end_ptr = NULL;
+		size_t queryCount = 100000;
+		int maxThreads = getCoreCount();
+		int varianceDirs = 16, varianceSamples = 256;
+		bool printStats = false;
+		m_distribution = "cosine";
+		m_deepWalks = false;
+
+		optind = 1;
+		while ((optchar = getopt(argc, argv, "hn:d:p:k:m:ws")) != -1) {
+			switch (optchar) {
+				case 'h': {
+						help();
+						return 0;
+					}
+					break;
+				case 'n':
+					queryCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || queryCount == 0)
+						Log(EError, "Could not parse the query count!");
+					break;
+				case 'd':
+					m_distribution = optarg;
+					if (m_distribution != "cosine" && m_distribution != "uniform" && m_distribution != "grazing")
+						Log(EError, "Unknown direction distribution \"%s\"!", optarg);
+					break;
+				case 'p':
+					maxThreads = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || maxThreads < 1)
+						Log(EError, "Could not parse the thread count!");
+					break;
+				case 'k':
+					varianceDirs = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || varianceDirs < 1)
+						Log(EError, "Could not parse the number of variance directions!");
+					break;
+				case 'm':
+					varianceSamples = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || varianceSamples < 2)
+						Log(EError, "Could not parse the number of variance samples!");
+					break;
+				case 'w':
+					m_deepWalks = true;
+					break;
+				case 's':
+					printStats = true;
+					break;
+			};
+		}
+
+		if (optind == argc) {
+			help();
+			return 0;
+		}
+
+		std::string pluginName(argv[optind]);
+		ref<BSDF> bsdf = createBSDF(pluginName, argc - optind - 1, argv + optind + 1);
+		ref<Sampler> sampler = static_cast<Sampler *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Sampler), Properties("independent")));
+
+		std::vector<Query> queries;
+		generateQueries(queries, queryCount, sampler);
+		const Query *begin = &queries[0], *end = begin + queries.size();
+
+		static const char *entryNames[EEntryPointCount] = { "eval", "sample", "pdf", "evalAndSample" };
+		double cost[EEntryPointCount];
+		Float checksum = 0;
+		ref<Timer> timer = new Timer();
+
+		cout << "Benchmarking " << bsdf->toString() << endl
+			<< queryCount << " queries per entry point, " << m_distribution << " directions" << endl << endl;
+
+		/* Single-threaded cost of every entry point. A short warm-up
+		   run first fills the per-thread caches of the plugin */
+		cout << formatString("%-16s %12s %16s", "entry point", "ns/call", "heap B/call") << endl;
+		for (int entry = 0; entry < EEntryPointCount; ++entry) {
+			checksum += runQueries(bsdf, (EEntryPoint) entry, begin, begin + std::min(queryCount, (size_t) 1000), sampler);
+
+			int64_t heapBefore = heapInUse();
+			timer->reset();
+			checksum += runQueries(bsdf, (EEntryPoint) entry, begin, end, sampler);
+			cost[entry] = timer->getMicroseconds() * 1000.0 / queryCount;
+			int64_t heapAfter = heapInUse();
+
+			std::string heap = heapBefore < 0 ? "n/a"
+				: formatString("%.2f", (heapAfter - heapBefore) / (double) queryCount);
+			cout << formatString("%-16s %12.1f %16s", entryNames[entry], cost[entry], heap.c_str()) << endl;
+		}
+
+		/* Throughput scaling: every thread runs all entry points over the full query set */
+		cout << endl << formatString("%-16s %16s %12s", "threads", "Mqueries/s", "speed-up") << endl;
+		double baseThroughput = 0;
+		for (int threadCount = 1; ; threadCount = std::min(2 * threadCount, maxThreads)) {
+			std::vector<ref<BenchThread> > threads;
+			for (int i = 0; i < threadCount; ++i)
+				threads.push_back(new BenchThread(bsdf, queries, sampler->clone(), i));
+			timer->reset();
+			for (int i = 0; i < threadCount; ++i)
+				threads[i]->start();
+			for (int i = 0; i < threadCount; ++i) {
+				threads[i]->join();
+				checksum += threads[i]->getChecksum();
+			}
+			double seconds = timer->getMicroseconds() * 1e-6;
+			double throughput = threadCount * (double) queryCount * EEntryPointCount / seconds;
+			if (threadCount == 1)
+				baseThroughput = throughput;
+			cout << formatString("%-16i %16.3f %12.2f", threadCount, throughput * 1e-6, throughput / baseThroughput) << endl;
+			if (threadCount == maxThreads)
+				break;
+		}
+
+		/* Variance per unit time of the eval() and pdf() estimates for a few
+		   fixed direction pairs (relative variance, averaged over the pairs) */
+		cout << endl << formatString("%-16s %16s %20s", "estimator", "rel. variance", "rel. variance x ns") << endl;
+		const EEntryPoint estimators[2] = { EEval, EPdf };
+		for (int e = 0; e < 2; ++e) {
+			double relVariance = 0;
+			int pairs = 0;
+			for (int d = 0; d < varianceDirs; ++d) {
+				const Query &q = queries[d % queries.size()];
+				double mean = 0, meanSqr = 0;
+				for (int i = 0; i < varianceSamples; ++i) {
+					double value = runQueries(bsdf, estimators[e], &q, &q + 1, sampler);
+					mean += value;
+					meanSqr += value * value;
+				}
+				mean /= varianceSamples;
+				meanSqr /= varianceSamples;
+				if (mean <= 0)
+					continue;
+				double variance = std::max(0.0, meanSqr - mean * mean) * varianceSamples / (varianceSamples - 1);
+				relVariance += variance / (mean * mean);
+				++pairs;
+			}
+			if (pairs == 0) {
+				cout << formatString("%-16s %16s %20s", entryNames[estimators[e]], "n/a", "n/a") << endl;
+				continue;
+			}
+			relVariance /= pairs;
+			cout << formatString("%-16s %16.4e %20.4e", entryNames[estimators[e]], relVariance,
+				relVariance * cost[estimators[e]]) << endl;
+		}
+
+		if (printStats)
+			cout << endl << Statistics::getInstance()->getStats();
+
+		cout << endl << "(checksum " << checksum << ")" << endl;
+		return 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+
+private:
+	std::string m_distribution;
+	bool m_deepWalks;
+};
+
+MTS_EXPORT_UTILITY(BSDFBench, "Microbenchmark for the BSDF plugins");
+MTS_NAMESPACE_END
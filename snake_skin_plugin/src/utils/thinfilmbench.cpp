@@ -0,0 +1,377 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/core/random.h>
+#include <mitsuba/core/timer.h>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Thin-film microbenchmark and accuracy check (mtsutil thinfilmbench)
+ *
+ * Sweeps a jittered grid over the incident cosine, the wavelength and the
+ * film thickness for a set of (n0, n1, n2) triples, and runs every
+ * implementation of the single-film Airy formula over it:
+ *
+ * - the scalar \ref ThinFilmTransmission(), \ref ThinFilmReflectance() and
+ *   their \c Ext variants,
+ * - the batched \ref ThinFilmTransmission() (all cosines and wavelengths of
+ *   one thickness per call) and \ref ThinFilmTransmissionRGB(),
+ * - lookups into a point-sampled \ref ThinFilmTable.
+ *
+ * Every implementation is compared against a double-precision evaluation of
+ * the same formula, including the total internal reflection branches. The
+ * utility returns a non-zero exit code when an error exceeds its tolerance,
+ * so that it can gate changes to these functions.
+ */
+class ThinFilmBench : public Utility {
+public:
+	/// Accuracy and throughput of one implementation over one IOR triple
+	struct Result {
+		std::string name;
+		double valuesPerSecond;
+		double maxError, meanError;
+		double tolerance;
+	};
+
+	void help() {
+		cout << "Syntax: mtsutil thinfilmbench [options]" << endl
+			<< "Options/Arguments:" << endl
+			<< "   -h             Display this help text" << endl << endl
+			<< "   -i n0,n1,n2    Add an IOR triple to the sweep (can be repeated). By default, a set" << endl
+			<< "                  of triples with and without total internal reflection is used" << endl << endl
+			<< "   -c count       Number of incident cosines (default: 64)" << endl << endl
+			<< "   -l count       Number of wavelengths in [380, 780] nm (default: 32)" << endl << endl
+			<< "   -d count       Number of film thicknesses (default: 32)" << endl << endl
+			<< "   -r min,max     Film thickness range in nm (default: 0,1000)" << endl << endl
+			<< "   -n count       Timing repetitions (default: 10)" << endl << endl
+			<< "   -t tolerance   Maximum absolute error of the direct evaluations (default: 5e-4)" << endl << endl
+			<< "   -e error       Target error of the tables (default: 1e-3). Table lookups are checked" << endl
+			<< "                  against four times the larger of this value and the error reported" << endl
+			<< "                  by the table (which exceeds the target when it runs out of entries)" << endl << endl
+			<< "Throughput is given in values per second; a batched call or a table lookup produces" << endl
+			<< "several values. The errors of the Ext variants also include the returned cosThetaT." << endl
+			<< "The exit code is non-zero when any error exceeds its tolerance." << endl;
+	}
+
+	/**
+	 * Double-precision evaluation of the film transmission, following the
+	 * same conventions (phase shifts, clamping, total internal reflection)
+	 * as \ref ThinFilmTransmissionExt(). \c cosThetaT is zero under total
+	 * internal reflection.
+	 */
+	static double referenceTransmission(double cos0, double lambda, double thickness,
+			double n0, double n1, double n2, double &cosThetaT) {
+		cosThetaT = 0;
+		double sin1 = (n0 / n1) * (n0 / n1) * (1 - cos0 * cos0);
+		if (sin1 > 1)
+			return 0;
+		double cos1 = std::sqrt(1 - sin1);
+
+		double sin2 = (n1 / n2) * (n1 / n2) * (1 - cos1 * cos1);
+		if (sin2 > 1)
+			return 0;
+		double cos2 = std::sqrt(1 - sin2);
+		cosThetaT = cos0 > 0 ? -cos2 : cos2;
+
+		double delta = (n1 >= n0 ? 0 : M_PI) + (n1 >= n2 ? 0 : M_PI);
+		double phi = (2 * M_PI / lambda) * (2 * n1 * thickness * cos1) + delta;
+
+		double Bs = (2 * n0 * cos0 / (n0 * cos0 + n1 * cos1)) * (2 * n1 * cos1 / (n1 * cos1 + n2 * cos2));
+		double Bp = (2 * n0 * cos0 / (n0 * cos1 + n1 * cos0)) * (2 * n1 * cos1 / (n1 * cos2 + n2 * cos1));
+		double as = ((n1 * cos1 - n0 * cos0) / (n1 * cos1 + n0 * cos0))
+			* ((n1 * cos1 - n2 * cos2) / (n1 * cos1 + n2 * cos2));
+		double ap = ((n0 * cos1 - n1 * cos0) / (n1 * cos0 + n0 * cos1))
+			* ((n2 * cos1 - n1 * cos2) / (n1 * cos2 + n2 * cos1));
+
+		double Ts = Bs * Bs / (as * as - 2 * as * std::cos(phi) + 1);
+		double Tp = Bp * Bp / (ap * ap - 2 * ap * std::cos(phi) + 1);
+		double T = (n2 * cos2) / (n0 * cos0) * (Ts + Tp) / 2;
+
+		return std::min(1.0, std::max(0.0, T));
+	}
+
+	static void accumulate(Result &result, double error, size_t &count) {
+		error = std::abs(error);
+		if (!(error == error))
+			error = std::numeric_limits<double>::infinity();
+		result.maxError = std::max(result.maxError, error);
+		result.meanError += error;
+		++count;
+	}
+
+	int run(int argc, char **argv) {
+		char optchar, *end_ptr = NULL;
+		size_t cosCount = 64, lambdaCount = 32, thicknessCount = 32;
+		int repetitions = 10;
+		Float thicknessMin = 0, thicknessMax = 1000;
+		double tolerance = 5e-4;
+		Float tableError = 1e-3f;
+		std::vector<Vector> triples;
+		std::vector<std::string> tokens;
+
+		optind = 1;
+		while ((optchar = getopt(argc, argv, "hi:c:l:d:r:n:t:e:")) != -1) {
+			switch (optchar) {
+				case 'h': {
+						help();
+						return 0;
+					}
+					break;
+				case 'i':
+					boost::split(tokens, optarg, boost::is_any_of(","));
+					try {
+						if (tokens.size() != 3)
+							throw boost::bad_lexical_cast();
+						triples.push_back(Vector(
+							boost::lexical_cast<Float>(tokens[0]),
+							boost::lexical_cast<Float>(tokens[1]),
+							boost::lexical_cast<Float>(tokens[2])));
+					} catch (const boost::bad_lexical_cast &) {
+						Log(EError, "Could not parse the IOR triple \"%s\"!", optarg);
+					}
+					if (triples.back().x <= 0 || triples.back().y <= 0 || triples.back().z <= 0)
+						Log(EError, "The indices of refraction must be positive!");
+					break;
+				case 'c':
+					cosCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || cosCount == 0)
+						Log(EError, "Could not parse the cosine count!");
+					break;
+				case 'l':
+					lambdaCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || lambdaCount == 0)
+						Log(EError, "Could not parse the wavelength count!");
+					break;
+				case 'd':
+					thicknessCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || thicknessCount == 0)
+						Log(EError, "Could not parse the thickness count!");
+					break;
+				case 'r':
+					boost::split(tokens, optarg, boost::is_any_of(","));
+					try {
+						if (tokens.size() != 2)
+							throw boost::bad_lexical_cast();
+						thicknessMin = boost::lexical_cast<Float>(tokens[0]);
+						thicknessMax = boost::lexical_cast<Float>(tokens[1]);
+					} catch (const boost::bad_lexical_cast &) {
+						Log(EError, "Could not parse the thickness range \"%s\"!", optarg);
+					}
+					if (thicknessMin < 0 || thicknessMax < thicknessMin)
+						Log(EError, "Invalid thickness range!");
+					break;
+				case 'n':
+					repetitions = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || repetitions < 1)
+						Log(EError, "Could not parse the number of repetitions!");
+					break;
+				case 't':
+					tolerance = strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || tolerance <= 0)
+						Log(EError, "Could not parse the tolerance!");
+					break;
+				case 'e':
+					tableError = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || tableError <= 0)
+						Log(EError, "Could not parse the table error!");
+					break;
+			};
+		}
+
+		if (triples.empty()) {
+			triples.push_back(Vector(1.0f, 1.33f, 1.5f));  // soap film on glass
+			triples.push_back(Vector(1.0f, 1.6f, 1.3f));   // high-index film
+			triples.push_back(Vector(1.5f, 1.33f, 1.0f));  // leaving glass, TIR at both interfaces
+			triples.push_back(Vector(1.5f, 1.0f, 1.33f));  // low-index film, TIR at the first interface
+			triples.push_back(Vector(1.0f, 2.0f, 1.0f));   // free-standing film
+		}
+
+		/* Jittered sample positions, shared by all triples */
+		ref<Random> random = new Random();
+		std::vector<Float> cos0(cosCount), lambda(lambdaCount), thickness(thicknessCount);
+		for (size_t i = 0; i < cosCount; ++i)
+			cos0[i] = std::max((Float) 1e-4f, (i + random->nextFloat()) / cosCount);
+		for (size_t j = 0; j < lambdaCount; ++j)
+			lambda[j] = 380 + 400 * (j + random->nextFloat()) / lambdaCount;
+		for (size_t k = 0; k < thicknessCount; ++k)
+			thickness[k] = thicknessMin + (thicknessMax - thicknessMin) * (k + random->nextFloat()) / thicknessCount;
+
+		/* Results are stored thickness-major, then cosine-major, like the output of the batched version */
+		const size_t valueCount = thicknessCount * cosCount * lambdaCount,
+			rgbCount = thicknessCount * cosCount * ThinFilmTable::Channels;
+		std::vector<double> reference(valueCount), referenceCosT(thicknessCount * cosCount), referenceRGB(rgbCount);
+		std::vector<Float> T(valueCount), cosT(valueCount), rgb(rgbCount);
+
+		ref<Timer> timer = new Timer();
+		bool failed = false;
+		Float checksum = 0;
+
+		cout << "Sweeping " << cosCount << " cosines x " << lambdaCount << " wavelengths x "
+			<< thicknessCount << " thicknesses in [" << thicknessMin << ", " << thicknessMax << "] nm, "
+			<< repetitions << " repetitions" << endl;
+
+		for (size_t t = 0; t < triples.size(); ++t) {
+			const Float n0 = triples[t].x, n1 = triples[t].y, n2 = triples[t].z;
+
+			size_t tirCount = 0;
+			for (size_t k = 0; k < thicknessCount; ++k) {
+				for (size_t i = 0; i < cosCount; ++i) {
+					double *dest = &reference[(k * cosCount + i) * lambdaCount];
+					for (size_t j = 0; j < lambdaCount; ++j)
+						dest[j] = referenceTransmission(cos0[i], lambda[j], thickness[k], n0, n1, n2,
+							referenceCosT[k * cosCount + i]);
+					for (int ch = 0; ch < ThinFilmTable::Channels; ++ch)
+						referenceRGB[(k * cosCount + i) * ThinFilmTable::Channels + ch] = referenceTransmission(
+							cos0[i], ThinFilmTable::Wavelengths[ch], thickness[k], n0, n1, n2,
+							referenceCosT[k * cosCount + i]);
+					if (referenceCosT[k * cosCount + i] == 0)
+						++tirCount;
+				}
+			}
+
+			cout << endl << formatString("n0 = %.3f, n1 = %.3f, n2 = %.3f (%.1f%% of the cosines under total internal reflection)",
+				n0, n1, n2, 100.0 * tirCount / (thicknessCount * cosCount)) << endl
+				<< formatString("%-22s %14s %14s %14s", "implementation", "Mvalues/s", "max. error", "mean error") << endl;
+
+			std::vector<Result> results;
+
+			/* Scalar versions, one call per value */
+			for (int variant = 0; variant < 4; ++variant) {
+				static const char *names[4] = { "scalar T", "scalar R", "scalar T (ext)", "scalar R (ext)" };
+				timer->reset();
+				for (int rep = 0; rep < repetitions; ++rep) {
+					for (size_t k = 0; k < thicknessCount; ++k) {
+						for (size_t i = 0; i < cosCount; ++i) {
+							size_t offset = (k * cosCount + i) * lambdaCount;
+							for (size_t j = 0; j < lambdaCount; ++j) {
+								Float &value = T[offset + j], &cosThetaT = cosT[offset + j];
+								cosThetaT = 0;
+								switch (variant) {
+									case 0: value = ThinFilmTransmission(cos0[i], lambda[j], thickness[k], n0, n1, n2); break;
+									case 1: value = ThinFilmReflectance(cos0[i], lambda[j], thickness[k], n0, n1, n2); break;
+									case 2: value = ThinFilmTransmissionExt(cos0[i], cosThetaT, lambda[j], thickness[k], n0, n1, n2); break;
+									default: value = ThinFilmReflectanceExt(cos0[i], cosThetaT, lambda[j], thickness[k], n0, n1, n2); break;
+								}
+							}
+						}
+					}
+				}
+				double seconds = timer->getMicroseconds() * 1e-6;
+
+				Result result = { names[variant], repetitions * valueCount / seconds, 0, 0, tolerance };
+				size_t count = 0;
+				for (size_t v = 0; v < valueCount; ++v) {
+					double expected = (variant & 1) ? 1 - reference[v] : reference[v];
+					accumulate(result, T[v] - expected, count);
+					if (variant >= 2)
+						accumulate(result, cosT[v] - referenceCosT[v / lambdaCount], count);
+					checksum += T[v];
+				}
+				result.meanError /= count;
+				results.push_back(result);
+			}
+
+			/* Batched version: all cosines and wavelengths of one thickness per call */
+			timer->reset();
+			for (int rep = 0; rep < repetitions; ++rep)
+				for (size_t k = 0; k < thicknessCount; ++k)
+					ThinFilmTransmission(&cos0[0], cosCount, &lambda[0], lambdaCount, thickness[k],
+						n0, n1, n2, &T[k * cosCount * lambdaCount]);
+			{
+				double seconds = timer->getMicroseconds() * 1e-6;
+				Result result = { "batched T", repetitions * valueCount / seconds, 0, 0, tolerance };
+				size_t count = 0;
+				for (size_t v = 0; v < valueCount; ++v) {
+					accumulate(result, T[v] - reference[v], count);
+					checksum += T[v];
+				}
+				result.meanError /= count;
+				results.push_back(result);
+			}
+
+			/* Batched version at the RGB wavelengths, i.e. the work that a table replaces */
+			timer->reset();
+			for (int rep = 0; rep < repetitions; ++rep)
+				for (size_t k = 0; k < thicknessCount; ++k)
+					ThinFilmTransmissionRGB(&cos0[0], cosCount, thickness[k], n0, n1, n2,
+						&rgb[k * cosCount * ThinFilmTable::Channels]);
+			{
+				double seconds = timer->getMicroseconds() * 1e-6;
+				Result result = { "batched T (RGB)", repetitions * rgbCount / seconds, 0, 0, tolerance };
+				size_t count = 0;
+				for (size_t v = 0; v < rgbCount; ++v) {
+					accumulate(result, rgb[v] - referenceRGB[v], count);
+					checksum += rgb[v];
+				}
+				result.meanError /= count;
+				results.push_back(result);
+			}
+
+			/* Point-sampled table over the thickness range */
+			timer->reset();
+			ThinFilmTable table(n0, n1, n2, thicknessMin, thicknessMax,
+				ThinFilmTable::EPointSampled, tableError);
+			double buildTime = timer->getMicroseconds() * 1e-3;
+
+			timer->reset();
+			for (int rep = 0; rep < repetitions; ++rep)
+				for (size_t k = 0; k < thicknessCount; ++k)
+					for (size_t i = 0; i < cosCount; ++i)
+						table.evalTransmittance(cos0[i], thickness[k],
+							&rgb[(k * cosCount + i) * ThinFilmTable::Channels]);
+			{
+				double seconds = timer->getMicroseconds() * 1e-6;
+				Result result = { "table T (RGB)", repetitions * rgbCount / seconds, 0, 0,
+					4 * std::max((double) tableError, (double) table.getError()) };
+				size_t count = 0;
+				for (size_t v = 0; v < rgbCount; ++v) {
+					accumulate(result, rgb[v] - referenceRGB[v], count);
+					checksum += rgb[v];
+				}
+				result.meanError /= count;
+				results.push_back(result);
+			}
+
+			for (size_t r = 0; r < results.size(); ++r) {
+				const Result &result = results[r];
+				bool exceeded = !(result.maxError <= result.tolerance);
+				cout << formatString("%-22s %14.2f %14.3e %14.3e%s", result.name.c_str(),
+					result.valuesPerSecond * 1e-6, result.maxError, result.meanError,
+					exceeded ? formatString("   FAILED (tolerance %.1e)", result.tolerance).c_str() : "") << endl;
+				failed |= exceeded;
+			}
+			cout << formatString("(table: %i x %i entries, built in %.1f ms, construction error %.2e)",
+				(int) table.getCosResolution(), (int) table.getThicknessResolution(), buildTime,
+				table.getError()) << endl;
+		}
+
+		cout << endl << "(checksum " << checksum << ")" << endl;
+		if (failed)
+			cout << "Some errors exceeded their tolerance!" << endl;
+		return failed ? 1 : 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+};
+
+MTS_EXPORT_UTILITY(ThinFilmBench, "Microbenchmark and accuracy check of the thin-film functions");
+MTS_NAMESPACE_END